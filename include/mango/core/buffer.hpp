@@ -18,6 +18,7 @@ namespace mango
         Memory m_memory;
         size_t m_capacity;
         Alignment m_alignment;
+        bool m_tracked; // the capacity is counted in the memory tracking
 
     public:
         Buffer(Alignment alignment = Alignment());
@@ -39,9 +40,12 @@ namespace mango
         void reserve(size_t bytes);
         void append(const void* source, size_t bytes);
 
+        // transfer the memory to the caller without copying; the buffer is left empty
+        SharedMemory release();
+
     private:
         u8* allocate(size_t bytes, Alignment alignment) const;
-        void free(u8* ptr) const;
+        void free(u8* ptr, size_t bytes) const;
     };
 
     class MemoryStream : public Stream
@@ -66,6 +70,9 @@ namespace mango
         void seek(u64 distance, SeekMode mode);
         void read(void* dest, size_t bytes);
         void write(const void* source, size_t bytes);
+
+        // transfer the written data to the caller without copying; the stream is left empty
+        SharedMemory detach();
     };
 
 } // namespace mango
@@ -13,4 +13,9 @@ namespace mango
     u32 crc32(u32 crc, ConstMemory memory);
     u32 crc32c(u32 crc, ConstMemory memory);
 
+    // combine the checksums of two consecutive blocks: crc(a) and crc(b) -> crc(a + b);
+    // the blocks can be hashed in parallel and combined afterwards
+    u32 crc32_combine(u32 crc0, u32 crc1, size_t length1);
+    u32 crc32c_combine(u32 crc0, u32 crc1, size_t length1);
+
 } // namespace mango
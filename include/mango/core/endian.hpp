@@ -85,6 +85,106 @@ namespace mango
         ustore64(p, byteswap(value));
     }
 
+    // --------------------------------------------------------------
+    // byteswap arrays
+    // --------------------------------------------------------------
+
+    // Swap the byte order of count elements from src to dest. The arrays
+    // do not have to be aligned and the swap can be done in-place (dest == src).
+
+    static inline void byteswap16(void* dest, const void* src, size_t count)
+    {
+        u8* d = reinterpret_cast<u8*>(dest);
+        const u8* s = reinterpret_cast<const u8*>(src);
+
+#if defined(MANGO_ENABLE_SSSE3)
+        const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        for ( ; count >= 8; count -= 8)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_shuffle_epi8(v, mask));
+            s += 16;
+            d += 16;
+        }
+#elif defined(MANGO_ENABLE_NEON)
+        for ( ; count >= 8; count -= 8)
+        {
+            vst1q_u8(d, vrev16q_u8(vld1q_u8(s)));
+            s += 16;
+            d += 16;
+        }
+#endif
+
+        for ( ; count > 0; --count)
+        {
+            ustore16swap(d, uload16(s));
+            s += 2;
+            d += 2;
+        }
+    }
+
+    static inline void byteswap32(void* dest, const void* src, size_t count)
+    {
+        u8* d = reinterpret_cast<u8*>(dest);
+        const u8* s = reinterpret_cast<const u8*>(src);
+
+#if defined(MANGO_ENABLE_SSSE3)
+        const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for ( ; count >= 4; count -= 4)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_shuffle_epi8(v, mask));
+            s += 16;
+            d += 16;
+        }
+#elif defined(MANGO_ENABLE_NEON)
+        for ( ; count >= 4; count -= 4)
+        {
+            vst1q_u8(d, vrev32q_u8(vld1q_u8(s)));
+            s += 16;
+            d += 16;
+        }
+#endif
+
+        for ( ; count > 0; --count)
+        {
+            ustore32swap(d, uload32(s));
+            s += 4;
+            d += 4;
+        }
+    }
+
+    static inline void byteswap64(void* dest, const void* src, size_t count)
+    {
+        u8* d = reinterpret_cast<u8*>(dest);
+        const u8* s = reinterpret_cast<const u8*>(src);
+
+#if defined(MANGO_ENABLE_SSSE3)
+        const __m128i mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for ( ; count >= 2; count -= 2)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_shuffle_epi8(v, mask));
+            s += 16;
+            d += 16;
+        }
+#elif defined(MANGO_ENABLE_NEON)
+        for ( ; count >= 2; count -= 2)
+        {
+            vst1q_u8(d, vrev64q_u8(vld1q_u8(s)));
+            s += 16;
+            d += 16;
+        }
+#endif
+
+        for ( ; count > 0; --count)
+        {
+            ustore64swap(d, uload64(s));
+            s += 8;
+            d += 8;
+        }
+    }
+
     // --------------------------------------------------------------
 	// endian load/store
     // --------------------------------------------------------------
@@ -68,6 +68,8 @@ namespace detail {
     using Memory = detail::Memory<u8>;
     using ConstMemory = detail::Memory<const u8>;
 
+    class Alignment;
+
     class SharedMemory
     {
     private:
@@ -78,18 +80,45 @@ namespace detail {
         SharedMemory(size_t bytes);
         SharedMemory(u8* address, size_t bytes);
 
+        // take the ownership of memory allocated with aligned_malloc(capacity, alignment)
+        SharedMemory(Memory memory, size_t capacity, Alignment alignment);
+
         operator Memory () const
         {
             return m_memory;
         }
     };
 
+    /*
+        VirtualMemory is memory mapped by the filesystem. The access pattern hints tell
+        the virtual memory system how the pages will be used; sequential access enables
+        aggressive read-ahead, random access disables it and WILLNEED starts reading the
+        range in the background. POPULATE blocks until the range is in memory. DONTNEED
+        releases the pages and is honored only by file mappings which can read them back.
+
+        Usage example:
+
+        File file("image.jpg");
+        file.advise(VirtualMemory::SEQUENTIAL);
+
+    */
+
     class VirtualMemory : private NonCopyable
     {
     protected:
         ConstMemory m_memory;
 
     public:
+        enum Advice
+        {
+            NORMAL,
+            SEQUENTIAL,
+            RANDOM,
+            WILLNEED,
+            DONTNEED,
+            POPULATE
+        };
+
         VirtualMemory() = default;
         virtual ~VirtualMemory() {}
 
@@ -102,32 +131,119 @@ namespace detail {
         {
             return m_memory;
         }
+
+        // the range is clipped to the memory; an empty range is the whole memory
+        virtual void advise(Advice advice, ConstMemory range = ConstMemory()) const;
+
+        void prefetch(ConstMemory range = ConstMemory()) const
+        {
+            advise(WILLNEED, range);
+        }
+    };
+
+    // Apply the hint to the pages overlapping the range. The range can be any memory;
+    // DONTNEED is ignored because the pages could be anonymous memory.
+    void adviseMemory(ConstMemory range, VirtualMemory::Advice advice);
+
+    // -----------------------------------------------------------------------
+    // memory tracking
+    // -----------------------------------------------------------------------
+
+    /*
+        The memory held by mango can be tracked per category. The tracking is disabled by
+        default; the cost is a single relaxed load per allocation. When enabled the counters
+        are updated with lock-free atomics. The tracking should be enabled before the memory
+        is allocated; memory allocated earlier is not accounted for when it is released.
+
+        trackAllocation() returns true when the allocation was counted. The owner keeps the
+        result and calls trackDeallocation() only for the counted allocations; they are
+        counted out even if the tracking has been disabled in the meantime.
+
+        Usage example:
+
+        setMemoryTracking(true);
+        ...
+        MemoryStatistics stats = getMemoryStatistics(MemoryCategory::BITMAP);
+        if (stats.live_bytes > budget)
+        {
+            // evict
+        }
+
+    */
+
+    enum class MemoryCategory
+    {
+        BUFFER,   // Buffer and MemoryStream, until the memory is released to a SharedMemory
+        BITMAP,   // Bitmap images
+        MAPPER,   // files decompressed or decrypted by the filesystem mappers
+        SCRATCH,  // MemoryArena chunks used by the decoders
+        COUNT
     };
 
+    struct MemoryStatistics
+    {
+        u64 live_bytes = 0;
+        u64 peak_bytes = 0;
+        u64 allocations = 0;
+        u64 deallocations = 0;
+    };
+
+    void setMemoryTracking(bool enable);
+    bool getMemoryTracking();
+
+    MemoryStatistics getMemoryStatistics(MemoryCategory category);
+
+    // restart the peak tracking from the current live bytes
+    void resetMemoryPeak(MemoryCategory category);
+
+    bool trackAllocation(MemoryCategory category, size_t bytes);
+    void trackDeallocation(MemoryCategory category, size_t bytes);
+
     // -----------------------------------------------------------------------
     // Alignment
     // -----------------------------------------------------------------------
 
     // NOTE: The alignment has to be a power-of-two and at least sizeof(void*)
 
+    // The HUGE_PAGES policy backs allocations of at least 2 MB with huge pages. This
+    // reduces the TLB misses and the page fault cost on first touch for large bitmaps
+    // and buffers. Explicit huge pages are used when the system has reserved them, otherwise
+    // transparent huge pages are requested. The PREFAULT policy touches the pages in parallel
+    // with the ThreadPool before the memory is returned. The REMAP policy maps allocations of
+    // at least 2 MB directly so that aligned_realloc() can resize them without copying.
+    // The policy is ignored on platforms which do not support it.
+
     class Alignment
     {
     protected:
         u32 m_alignment;
+        u32 m_policy;
 
     public:
+        enum Policy : u32
+        {
+            HUGE_PAGES = 0x01,
+            PREFAULT   = 0x02,
+            REMAP      = 0x04,
+        };
+
         Alignment(); // default alignment
-        Alignment(u32 alignment);
+        Alignment(u32 alignment, u32 policy = 0);
 
         operator u32 () const;
+        u32 policy() const;
     };
 
     // -----------------------------------------------------------------------
     // aligned malloc / free
     // -----------------------------------------------------------------------
 
+    // NOTE: Memory allocated with a policy must be released with the size and the alignment
+
     void* aligned_malloc(size_t bytes, Alignment alignment = Alignment());
     void aligned_free(void* aligned);
+    void aligned_free(void* aligned, size_t bytes, Alignment alignment);
+    void* aligned_realloc(void* aligned, size_t old_bytes, size_t new_bytes, Alignment alignment);
 
     // -----------------------------------------------------------------------
     // AlignedPointer
@@ -142,10 +258,12 @@ namespace detail {
     private:
         T* m_data;
         size_t m_size;
+        Alignment m_alignment;
 
     public:
         AlignedPointer(size_t size, Alignment alignment = Alignment())
             : m_size(size)
+            , m_alignment(alignment)
         {
             void* ptr = aligned_malloc(size * sizeof(T), alignment);
             m_data = reinterpret_cast<T*>(ptr);
@@ -153,7 +271,7 @@ namespace detail {
 
         ~AlignedPointer()
         {
-            aligned_free(m_data);
+            aligned_free(m_data, m_size * sizeof(T), m_alignment);
         }
 
         operator T* () const
@@ -172,6 +290,115 @@ namespace detail {
         }
     };
 
+    // -----------------------------------------------------------------------
+    // MemoryArena
+    // -----------------------------------------------------------------------
+
+    /*
+        MemoryArena is a bump allocator for short lived scratch memory. The memory is
+        carved from a chain of chunks which are retained when the arena is rewound, so
+        repeating the same work does not allocate from the heap after the first pass.
+        Allocations are released in LIFO order by rewinding the arena with a Scope.
+        The arena does not call constructors or destructors; store only POD types.
+
+        Every thread has it's own arena; tasks executed by the ThreadPool are wrapped
+        in a Scope so scratch memory left in the local arena is reclaimed after the task.
+
+        Usage example:
+
+        MemoryArena& arena = getLocalMemoryArena();
+        MemoryArena::Scope scope(arena);
+
+        s16* coefficients = arena.allocate<s16>(64 * 10);
+        u8* scanline = arena.allocate<u8>(stride);
+
+        // the arena is rewound when the scope is destroyed
+
+    */
+
+    class MemoryArena : private NonCopyable
+    {
+    protected:
+        struct Chunk
+        {
+            Chunk* next;
+            size_t size;
+            bool tracked;
+
+            u8* data()
+            {
+                return reinterpret_cast<u8*>(this) + MANGO_DEFAULT_ALIGNMENT;
+            }
+        };
+
+        Chunk* m_head = nullptr;
+        Chunk* m_current = nullptr;
+        u8* m_pointer = nullptr;
+        u8* m_end = nullptr;
+        size_t m_chunk_size;
+
+        void* grow(size_t bytes, size_t alignment);
+
+    public:
+        class Scope : private NonCopyable
+        {
+        protected:
+            MemoryArena& m_arena;
+            Chunk* m_current;
+            u8* m_pointer;
+            u8* m_end;
+
+        public:
+            Scope(MemoryArena& arena)
+                : m_arena(arena)
+                , m_current(arena.m_current)
+                , m_pointer(arena.m_pointer)
+                , m_end(arena.m_end)
+            {
+            }
+
+            ~Scope()
+            {
+                m_arena.m_current = m_current;
+                m_arena.m_pointer = m_pointer;
+                m_arena.m_end = m_end;
+            }
+        };
+
+        MemoryArena(size_t chunk_size = 64 * 1024);
+        ~MemoryArena();
+
+        void* allocate(size_t bytes, size_t alignment = MANGO_DEFAULT_ALIGNMENT)
+        {
+            uintptr_t address = (uintptr_t(m_pointer) + alignment - 1) & ~uintptr_t(alignment - 1);
+            if (address + bytes > uintptr_t(m_end))
+            {
+                return grow(bytes, alignment);
+            }
+
+            m_pointer = reinterpret_cast<u8*>(address + bytes);
+            return reinterpret_cast<void*>(address);
+        }
+
+        template <typename T>
+        T* allocate(size_t count, size_t alignment = MANGO_DEFAULT_ALIGNMENT)
+        {
+            return reinterpret_cast<T*>(allocate(count * sizeof(T), alignment));
+        }
+
+        // rewind the arena to the beginning; the chunks are retained
+        void reset();
+
+        // release the chunks which are not in use
+        void trim();
+
+        // total bytes in the chunk chain
+        size_t capacity() const;
+    };
+
+    // the calling thread's arena
+    MemoryArena& getLocalMemoryArena();
+
     // -----------------------------------------------------------------------
     // aligned (std) memory allocator
     // -----------------------------------------------------------------------
@@ -217,7 +444,7 @@ namespace detail {
             return &x;
         }
 
-        pointer allocate(size_type n, std::allocator<void>::const_pointer hint = 0)
+        pointer allocate(size_type n, const void* hint = 0)
         {
             MANGO_UNREFERENCED(hint);
             void* s = aligned_malloc(n * sizeof(T), ALIGNMENT);
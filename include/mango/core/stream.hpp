@@ -4,11 +4,14 @@
 */
 #pragma once
 
+#include <vector>
+#include <algorithm>
 #include "configure.hpp"
 #include "endian.hpp"
 #include "memory.hpp"
 #include "object.hpp"
 #include "half.hpp"
+#include "exception.hpp"
 
 namespace mango
 {
@@ -333,6 +336,533 @@ namespace mango
     using LittleEndianStream = SwapEndianStream;
     using BigEndianStream = SameEndianStream;
 
+#endif
+
+    // --------------------------------------------------------------
+    // BufferedReader
+    // --------------------------------------------------------------
+
+    /*
+        BufferedReader reads the Stream in large blocks into a window which the
+        typed reads are served from with inline code. The per-field virtual Stream::read
+        calls are replaced with a bounds check and a memcpy; the Stream is only accessed
+        when the window has been consumed. Seeking inside the window is free.
+
+        The array reads transfer the data with a single copy and swap the byte order
+        in-place with vector instructions when required.
+
+        The reader reads ahead of the logical position; the Stream is seeked back to the
+        logical position when the reader is destroyed.
+
+        Usage example:
+
+        FileStream file("data.bin", Stream::READ);
+        LittleEndianBufferedReader s(file);
+
+        u32 magic = s.read32();
+        u32 count = s.read32();
+
+        std::vector<float> values(count);
+        s.read32f(values.data(), count);
+
+    */
+
+    namespace detail
+    {
+
+        template <bool Swap>
+        class BufferedReader : protected NonCopyable
+        {
+        private:
+            Stream& s;
+            std::vector<u8> m_buffer;
+            const u8* m_pointer;
+            const u8* m_end;
+            u64 m_position; // stream offset of the window start
+
+            const u8* begin() const
+            {
+                return m_buffer.data();
+            }
+
+            void reset(u64 position)
+            {
+                m_position = position;
+                m_pointer = begin();
+                m_end = begin();
+            }
+
+            void refill()
+            {
+                m_position += u64(m_end - begin());
+
+                const u64 size = s.size();
+                const u64 left = size > m_position ? size - m_position : 0;
+                const size_t bytes = size_t(std::min(u64(m_buffer.size()), left));
+
+                s.read(m_buffer.data(), bytes);
+                m_pointer = begin();
+                m_end = begin() + bytes;
+            }
+
+            void fill(void* dest, size_t size)
+            {
+                u8* d = reinterpret_cast<u8*>(dest);
+
+                size_t left = size_t(m_end - m_pointer);
+                std::memcpy(d, m_pointer, left);
+                m_pointer = m_end;
+                d += left;
+                size -= left;
+
+                if (size >= m_buffer.size())
+                {
+                    // large transfer goes directly to the destination
+                    s.read(d, size);
+                    reset(m_position + u64(m_end - begin()) + size);
+                    return;
+                }
+
+                refill();
+
+                if (size > size_t(m_end - m_pointer))
+                {
+                    MANGO_EXCEPTION("[BufferedReader] Reading past end of stream.");
+                }
+
+                std::memcpy(d, m_pointer, size);
+                m_pointer += size;
+            }
+
+            template <typename T>
+            T load()
+            {
+                T value;
+                if (size_t(m_end - m_pointer) >= sizeof(T))
+                {
+                    std::memcpy(&value, m_pointer, sizeof(T));
+                    m_pointer += sizeof(T);
+                }
+                else
+                {
+                    fill(&value, sizeof(T));
+                }
+                return Swap ? byteswap(value) : value;
+            }
+
+        public:
+            BufferedReader(Stream& stream, size_t buffer_size = 64 * 1024)
+                : s(stream)
+                , m_buffer(std::max(buffer_size, size_t(64)))
+            {
+                reset(s.offset());
+            }
+
+            ~BufferedReader()
+            {
+                if (m_end != begin())
+                {
+                    s.seek(offset(), Stream::BEGIN);
+                }
+            }
+
+            u64 size() const
+            {
+                return s.size();
+            }
+
+            u64 offset() const
+            {
+                return m_position + u64(m_pointer - begin());
+            }
+
+            void seek(u64 distance, Stream::SeekMode mode)
+            {
+                u64 target;
+
+                switch (mode)
+                {
+                    case Stream::BEGIN:
+                        target = distance;
+                        break;
+
+                    case Stream::CURRENT:
+                        target = offset() + distance;
+                        break;
+
+                    case Stream::END:
+                    default:
+                        s.seek(distance, Stream::END);
+                        reset(s.offset());
+                        return;
+                }
+
+                if (target >= m_position && target <= m_position + u64(m_end - begin()))
+                {
+                    m_pointer = begin() + size_t(target - m_position);
+                }
+                else
+                {
+                    s.seek(target, Stream::BEGIN);
+                    reset(s.offset());
+                }
+            }
+
+            // read functions
+
+            void read(void* dest, size_t size)
+            {
+                if (size_t(m_end - m_pointer) >= size)
+                {
+                    std::memcpy(dest, m_pointer, size);
+                    m_pointer += size;
+                }
+                else
+                {
+                    fill(dest, size);
+                }
+            }
+
+            u8 read8()
+            {
+                if (m_pointer < m_end)
+                {
+                    return *m_pointer++;
+                }
+
+                u8 value;
+                fill(&value, 1);
+                return value;
+            }
+
+            u16 read16()
+            {
+                return load<u16>();
+            }
+
+            u32 read32()
+            {
+                return load<u32>();
+            }
+
+            u64 read64()
+            {
+                return load<u64>();
+            }
+
+            float16 read16f()
+            {
+                Half value;
+                value.u = read16();
+                return value;
+            }
+
+            float read32f()
+            {
+                Float value;
+                value.u = read32();
+                return value;
+            }
+
+            double read64f()
+            {
+                Double value;
+                value.u = read64();
+                return value;
+            }
+
+            // array read functions
+
+            void read16(u16* dest, size_t count)
+            {
+                read(dest, count * sizeof(u16));
+                if (Swap)
+                {
+                    byteswap16(dest, dest, count);
+                }
+            }
+
+            void read32(u32* dest, size_t count)
+            {
+                read(dest, count * sizeof(u32));
+                if (Swap)
+                {
+                    byteswap32(dest, dest, count);
+                }
+            }
+
+            void read64(u64* dest, size_t count)
+            {
+                read(dest, count * sizeof(u64));
+                if (Swap)
+                {
+                    byteswap64(dest, dest, count);
+                }
+            }
+
+            void read32f(float* dest, size_t count)
+            {
+                read(dest, count * sizeof(float));
+                if (Swap)
+                {
+                    byteswap32(dest, dest, count);
+                }
+            }
+
+            void read64f(double* dest, size_t count)
+            {
+                read(dest, count * sizeof(double));
+                if (Swap)
+                {
+                    byteswap64(dest, dest, count);
+                }
+            }
+        };
+
+        // --------------------------------------------------------------
+        // BufferedWriter
+        // --------------------------------------------------------------
+
+        template <bool Swap>
+        class BufferedWriter : protected NonCopyable
+        {
+        private:
+            Stream& s;
+            std::vector<u8> m_buffer;
+            u8* m_pointer;
+            u8* m_end;
+
+            u8* begin()
+            {
+                return m_buffer.data();
+            }
+
+            size_t pending() const
+            {
+                return size_t(m_pointer - m_buffer.data());
+            }
+
+            void spill(const void* data, size_t size)
+            {
+                flush();
+
+                if (size >= m_buffer.size())
+                {
+                    // large transfer goes directly to the stream
+                    s.write(data, size);
+                }
+                else
+                {
+                    std::memcpy(m_pointer, data, size);
+                    m_pointer += size;
+                }
+            }
+
+            template <typename T>
+            void store(T value)
+            {
+                value = Swap ? byteswap(value) : value;
+                if (size_t(m_end - m_pointer) >= sizeof(T))
+                {
+                    std::memcpy(m_pointer, &value, sizeof(T));
+                    m_pointer += sizeof(T);
+                }
+                else
+                {
+                    spill(&value, sizeof(T));
+                }
+            }
+
+            template <typename T>
+            void storeArray(const T* data, size_t count, void (*convert)(void*, const void*, size_t))
+            {
+                if (!Swap)
+                {
+                    write(data, count * sizeof(T));
+                    return;
+                }
+
+                // swap directly into the buffer
+                while (count > 0)
+                {
+                    size_t n = size_t(m_end - m_pointer) / sizeof(T);
+                    if (!n)
+                    {
+                        flush();
+                        continue;
+                    }
+
+                    n = std::min(n, count);
+                    convert(m_pointer, data, n);
+                    m_pointer += n * sizeof(T);
+                    data += n;
+                    count -= n;
+                }
+            }
+
+        public:
+            BufferedWriter(Stream& stream, size_t buffer_size = 64 * 1024)
+                : s(stream)
+                , m_buffer(std::max(buffer_size, size_t(64)))
+            {
+                m_pointer = begin();
+                m_end = begin() + m_buffer.size();
+            }
+
+            ~BufferedWriter()
+            {
+                try
+                {
+                    flush();
+                }
+                catch (Exception&)
+                {
+                    // the destructor cannot report the error; call flush() to see it
+                }
+            }
+
+            u64 size() const
+            {
+                return std::max(s.size(), offset());
+            }
+
+            u64 offset() const
+            {
+                return s.offset() + pending();
+            }
+
+            void seek(u64 distance, Stream::SeekMode mode)
+            {
+                flush();
+                s.seek(distance, mode);
+            }
+
+            // write the buffered data into the stream; the write errors are reported only
+            // when flush() is called explicitly, the destructor discards them
+            void flush()
+            {
+                if (pending())
+                {
+                    s.write(m_buffer.data(), pending());
+                    m_pointer = begin();
+                }
+            }
+
+            // write functions
+
+            void write(const void* data, size_t size)
+            {
+                if (size_t(m_end - m_pointer) >= size)
+                {
+                    std::memcpy(m_pointer, data, size);
+                    m_pointer += size;
+                }
+                else
+                {
+                    spill(data, size);
+                }
+            }
+
+            void write(mango::Memory memory)
+            {
+                write(memory.address, memory.size);
+            }
+
+            void write8(u8 value)
+            {
+                if (m_pointer < m_end)
+                {
+                    *m_pointer++ = value;
+                }
+                else
+                {
+                    spill(&value, 1);
+                }
+            }
+
+            void write16(u16 value)
+            {
+                store<u16>(value);
+            }
+
+            void write32(u32 value)
+            {
+                store<u32>(value);
+            }
+
+            void write64(u64 value)
+            {
+                store<u64>(value);
+            }
+
+            void write16f(Half value)
+            {
+                write16(value.u);
+            }
+
+            void write32f(Float value)
+            {
+                write32(value.u);
+            }
+
+            void write64f(Double value)
+            {
+                write64(value.u);
+            }
+
+            // array write functions
+
+            void write16(const u16* data, size_t count)
+            {
+                storeArray(data, count, byteswap16);
+            }
+
+            void write32(const u32* data, size_t count)
+            {
+                storeArray(data, count, byteswap32);
+            }
+
+            void write64(const u64* data, size_t count)
+            {
+                storeArray(data, count, byteswap64);
+            }
+
+            void write32f(const float* data, size_t count)
+            {
+                storeArray(data, count, byteswap32);
+            }
+
+            void write64f(const double* data, size_t count)
+            {
+                storeArray(data, count, byteswap64);
+            }
+        };
+
+    } // namespace detail
+
+    using SameEndianBufferedReader = detail::BufferedReader<false>;
+    using SwapEndianBufferedReader = detail::BufferedReader<true>;
+    using SameEndianBufferedWriter = detail::BufferedWriter<false>;
+    using SwapEndianBufferedWriter = detail::BufferedWriter<true>;
+
+    // --------------------------------------------------------------
+    // Little/BigEndianBufferedReader/Writer
+    // --------------------------------------------------------------
+
+#ifdef MANGO_LITTLE_ENDIAN
+
+    using LittleEndianBufferedReader = SameEndianBufferedReader;
+    using BigEndianBufferedReader = SwapEndianBufferedReader;
+    using LittleEndianBufferedWriter = SameEndianBufferedWriter;
+    using BigEndianBufferedWriter = SwapEndianBufferedWriter;
+
+#else
+
+    using LittleEndianBufferedReader = SwapEndianBufferedReader;
+    using BigEndianBufferedReader = SameEndianBufferedReader;
+    using LittleEndianBufferedWriter = SwapEndianBufferedWriter;
+    using BigEndianBufferedWriter = SameEndianBufferedWriter;
+
 #endif
 
 } // namespace mango
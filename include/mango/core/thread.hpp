@@ -12,360 +12,1954 @@
 #include <functional>
 #include <condition_variable>
 #include <future>
+#include <new>
+#include <chrono>
+#include <type_traits>
 #include "exception.hpp"
 #include "object.hpp"
 #include "atomic.hpp"
+#include "bits.hpp"
+
+#if defined(MANGO_PLATFORM_LINUX) || defined(MANGO_PLATFORM_ANDROID)
+    #define MANGO_ENABLE_FUTEX
+#endif
+
+// C++20 coroutine support
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+    #if __has_include(<coroutine>)
+        #include <coroutine>
+        #include <optional>
+        #include <utility>
+        #define MANGO_ENABLE_COROUTINES
+    #endif
+#endif
 
 namespace mango
 {
 
-    // TODO: use lock-free MPMC queue for free objects and only lock
-    //       when running out of objects in the queue
+    // ----------------------------------------------------------------------------
+    // EventCount
+    // ----------------------------------------------------------------------------
+
+    /*
+        EventCount is a condition variable for lock-free data structures. The waiting
+        thread announces itself with prepareWait(), checks the condition once more
+        and then either cancels or commits to the wait. A notification which arrives
+        after prepareWait() is never lost. The notifying side is a single load when
+        there are no waiters. Linux and Android park the threads on a futex.
+
+        Usage example:
+
+        // consumer
+        for (;;) {
+            if (try_consume())
+                break;
+            u32 key = event.prepareWait();
+            if (try_consume()) {
+                event.cancelWait();
+                break;
+            }
+            event.commitWait(key);
+        }
+
+        // producer
+        produce();
+        event.notifyOne();
+
+    */
+
+    class EventCount : private NonCopyable
+    {
+    protected:
+        std::atomic<u32> m_epoch { 0 };
+        std::atomic<u32> m_waiters { 0 };
+
+#if !defined(MANGO_ENABLE_FUTEX)
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+#endif
+
+    public:
+        EventCount() = default;
+        ~EventCount() = default;
+
+        u32 prepareWait();
+        void cancelWait();
+        void commitWait(u32 key);
+        bool commitWait(u32 key, std::chrono::nanoseconds timeout);
+
+        void notifyOne();
+        void notifyAll();
+    };
+
+    // ----------------------------------------------------------------------------
+    // ObjectCache
+    // ----------------------------------------------------------------------------
+
+    /*
+        ObjectCache recycles objects through magazines: fixed-size arrays of free
+        objects. The magazines are exchanged between the threads through a lock-free
+        depot which holds stacks of full and empty magazines. The thread-local front,
+        ObjectCache::Local, keeps two magazines so that the depot is visited only once
+        per MagazineSize operations. A lock is taken only when the cache is out of
+        objects and allocates a new block; the existing objects are never moved.
+
+        The single object acquire() and discard() go to the depot directly and are
+        intended for infrequent use; use the Local front for the hot paths. A thread-local
+        Local must not be used after it has been destroyed at thread exit; objects which
+        are released later must go to the depot directly.
+    */
+
     template <typename T>
-    class ObjectCache
+    class ObjectCache : private NonCopyable
     {
+    public:
+        static constexpr int MagazineSize = 64;
+
     protected:
+        struct Magazine
+        {
+            T* objects[MagazineSize];
+            int size { 0 };
+            u32 index { 0 };
+            std::atomic<u32> next { 0 };
+        };
+
+        // The magazines are addressed with 1-based indices so that the stack heads fit into
+        // 64 bits with a modification tag (high 32 bits) which prevents the ABA problem.
+        // The magazines are never released while the cache is alive.
+
+        static constexpr int SegmentCount = 26;
+        static constexpr u32 SegmentBase = 16;
+
+        std::atomic<u64> m_full { 0 };
+        std::atomic<u64> m_empty { 0 };
+        std::atomic<Magazine*> m_segments[SegmentCount];
+        std::atomic<u32> m_magazine_count { 0 };
+
         int m_block_size;
         std::vector<T*> m_blocks;
-        T** m_stack { nullptr };
-        int m_stack_capacity { 0 };
-        int m_stack_size { 0 };
-        SpinLock m_lock;
+        std::mutex m_mutex;
+
+    public:
+        class Local : private NonCopyable
+        {
+        protected:
+            ObjectCache& m_cache;
+            Magazine* m_loaded;
+            Magazine* m_previous;
+
+        public:
+            Local(ObjectCache& cache)
+                : m_cache(cache)
+                , m_loaded(cache.getEmptyMagazine())
+                , m_previous(cache.getEmptyMagazine())
+            {
+            }
+
+            ~Local()
+            {
+                m_cache.release(m_loaded);
+                m_cache.release(m_previous);
+            }
+
+            T* acquire()
+            {
+                if (!m_loaded->size)
+                {
+                    if (m_previous->size)
+                    {
+                        std::swap(m_loaded, m_previous);
+                    }
+                    else
+                    {
+                        m_cache.push(m_cache.m_empty, m_previous);
+                        m_previous = m_loaded;
+                        m_loaded = m_cache.getFullMagazine();
+                    }
+                }
+
+                return m_loaded->objects[--m_loaded->size];
+            }
+
+            void discard(T* object)
+            {
+                if (m_loaded->size == MagazineSize)
+                {
+                    if (!m_previous->size)
+                    {
+                        std::swap(m_loaded, m_previous);
+                    }
+                    else
+                    {
+                        m_cache.push(m_cache.m_full, m_previous);
+                        m_previous = m_loaded;
+                        m_loaded = m_cache.getEmptyMagazine();
+                    }
+                }
+
+                m_loaded->objects[m_loaded->size++] = object;
+            }
+        };
+
+        ObjectCache(int block_size)
+            : m_block_size(std::max(block_size, MagazineSize))
+        {
+            for (auto& segment : m_segments)
+            {
+                segment = nullptr;
+            }
+        }
+
+        ~ObjectCache()
+        {
+            for (auto block : m_blocks)
+            {
+                delete[] block;
+            }
+
+            for (auto& segment : m_segments)
+            {
+                delete[] segment.load();
+            }
+        }
+
+        T* acquire()
+        {
+            Magazine* magazine = getFullMagazine();
+            T* object = magazine->objects[--magazine->size];
+            release(magazine);
+            return object;
+        }
+
+        void discard(T* object)
+        {
+            Magazine* magazine = getEmptyMagazine();
+            magazine->objects[magazine->size++] = object;
+            release(magazine);
+        }
+
+    protected:
+        Magazine* getMagazine(u32 index) const
+        {
+            // segment s holds SegmentBase << s magazines
+            const u32 i = index - 1;
+            const int s = u32_index_of_msb(i / SegmentBase + 1);
+            const u32 first = SegmentBase * ((1u << s) - 1);
+            return m_segments[s].load(std::memory_order_acquire) + (i - first);
+        }
+
+        Magazine* allocateMagazine(bool locked)
+        {
+            const u32 index = m_magazine_count.fetch_add(1, std::memory_order_relaxed) + 1;
+            const u32 i = index - 1;
+            const int s = u32_index_of_msb(i / SegmentBase + 1);
+
+            if (!m_segments[s].load(std::memory_order_acquire))
+            {
+                std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+                if (!locked)
+                {
+                    lock.lock();
+                }
+
+                if (!m_segments[s].load(std::memory_order_relaxed))
+                {
+                    const u32 count = SegmentBase << s;
+                    const u32 first = SegmentBase * ((1u << s) - 1);
+
+                    Magazine* segment = new Magazine[count];
+                    for (u32 j = 0; j < count; ++j)
+                    {
+                        segment[j].index = first + j + 1;
+                    }
+
+                    m_segments[s].store(segment, std::memory_order_release);
+                }
+            }
+
+            return getMagazine(index);
+        }
+
+        Magazine* pop(std::atomic<u64>& stack)
+        {
+            u64 head = stack.load(std::memory_order_acquire);
+            for (;;)
+            {
+                const u32 index = u32(head);
+                if (!index)
+                {
+                    return nullptr;
+                }
+
+                Magazine* magazine = getMagazine(index);
+                const u64 next = magazine->next.load(std::memory_order_relaxed);
+                const u64 desired = (((head >> 32) + 1) << 32) | next;
+
+                if (stack.compare_exchange_weak(head, desired, std::memory_order_acq_rel, std::memory_order_acquire))
+                {
+                    return magazine;
+                }
+            }
+        }
+
+        void push(std::atomic<u64>& stack, Magazine* magazine)
+        {
+            u64 head = stack.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                magazine->next.store(u32(head), std::memory_order_relaxed);
+                const u64 desired = (((head >> 32) + 1) << 32) | magazine->index;
+
+                if (stack.compare_exchange_weak(head, desired, std::memory_order_release, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+        }
+
+        void release(Magazine* magazine)
+        {
+            push(magazine->size ? m_full : m_empty, magazine);
+        }
+
+        Magazine* getEmptyMagazine()
+        {
+            Magazine* magazine = pop(m_empty);
+            if (!magazine)
+            {
+                magazine = allocateMagazine(false);
+            }
+            return magazine;
+        }
+
+        Magazine* getFullMagazine()
+        {
+            Magazine* magazine = pop(m_full);
+            if (!magazine)
+            {
+                magazine = grow();
+            }
+            return magazine;
+        }
+
+        Magazine* grow()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            // another thread might have refilled the depot while we were waiting
+            Magazine* result = pop(m_full);
+            if (result)
+            {
+                return result;
+            }
+
+            T* block = new T[m_block_size];
+            m_blocks.push_back(block);
+
+            for (int i = 0; i < m_block_size; i += MagazineSize)
+            {
+                Magazine* magazine = pop(m_empty);
+                if (!magazine)
+                {
+                    magazine = allocateMagazine(true);
+                }
+
+                const int count = std::min(MagazineSize, m_block_size - i);
+                for (int j = 0; j < count; ++j)
+                {
+                    magazine->objects[j] = block + i + j;
+                }
+                magazine->size = count;
+
+                if (result)
+                {
+                    push(m_full, magazine);
+                }
+                else
+                {
+                    result = magazine;
+                }
+            }
+
+            return result;
+        }
+    };
+
+namespace detail {
+
+    // Pooled storage for task objects. Small allocations are recycled through
+    // thread-local caches so that submitting tasks does not go through malloc.
+    void* allocateTaskStorage(size_t bytes, size_t alignment);
+    void freeTaskStorage(void* address, size_t bytes, size_t alignment);
+
+} // namespace detail
+
+    // ----------------------------------------------------------------------------
+    // TaskFunction
+    // ----------------------------------------------------------------------------
+
+    /*
+        TaskFunction is a move-only std::function<void()> replacement. Callable objects
+        up to InlineSize bytes are stored in the object itself; larger ones are placed
+        in pooled storage. Either way no memory is allocated from the heap when the
+        tasks are recycled at a steady rate.
+    */
+
+    class TaskFunction
+    {
+    public:
+        static constexpr size_t InlineSize = 64;
+        static constexpr size_t InlineAlignment = 16;
+
+    protected:
+        struct Operations
+        {
+            void (*invoke)(void* storage);
+            void (*move)(void* dest, void* source);
+            void (*destroy)(void* storage);
+        };
+
+        template <typename F>
+        struct InlineOperations
+        {
+            static void invoke(void* storage)
+            {
+                (*reinterpret_cast<F*>(storage))();
+            }
+
+            static void move(void* dest, void* source)
+            {
+                F* object = reinterpret_cast<F*>(source);
+                new (dest) F(std::move(*object));
+                object->~F();
+            }
+
+            static void destroy(void* storage)
+            {
+                reinterpret_cast<F*>(storage)->~F();
+            }
+        };
+
+        template <typename F>
+        struct PooledOperations
+        {
+            static F* get(void* storage)
+            {
+                return *reinterpret_cast<F**>(storage);
+            }
+
+            static void invoke(void* storage)
+            {
+                (*get(storage))();
+            }
+
+            static void move(void* dest, void* source)
+            {
+                *reinterpret_cast<F**>(dest) = get(source);
+            }
+
+            static void destroy(void* storage)
+            {
+                F* object = get(storage);
+                object->~F();
+                detail::freeTaskStorage(object, sizeof(F), alignof(F));
+            }
+        };
+
+        template <typename F>
+        struct IsInline
+        {
+            static constexpr bool value = sizeof(F) <= InlineSize &&
+                                          alignof(F) <= InlineAlignment &&
+                                          std::is_nothrow_move_constructible<F>::value;
+        };
+
+        template <typename F>
+        static const Operations* getOperations(std::true_type)
+        {
+            static const Operations operations =
+            {
+                InlineOperations<F>::invoke,
+                InlineOperations<F>::move,
+                InlineOperations<F>::destroy
+            };
+            return &operations;
+        }
+
+        template <typename F>
+        static const Operations* getOperations(std::false_type)
+        {
+            static const Operations operations =
+            {
+                PooledOperations<F>::invoke,
+                PooledOperations<F>::move,
+                PooledOperations<F>::destroy
+            };
+            return &operations;
+        }
+
+        template <typename F>
+        void construct(F&& f, std::true_type)
+        {
+            using Function = typename std::decay<F>::type;
+            new (m_storage) Function(std::forward<F>(f));
+        }
+
+        template <typename F>
+        void construct(F&& f, std::false_type)
+        {
+            using Function = typename std::decay<F>::type;
+            void* address = detail::allocateTaskStorage(sizeof(Function), alignof(Function));
+            *reinterpret_cast<Function**>(m_storage) = new (address) Function(std::forward<F>(f));
+        }
+
+        const Operations* m_operations { nullptr };
+        alignas(InlineAlignment) char m_storage[InlineSize];
+
+    public:
+        TaskFunction() = default;
+
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, TaskFunction>::value>::type>
+        TaskFunction(F&& f)
+        {
+            using Function = typename std::decay<F>::type;
+            using Inline = std::integral_constant<bool, IsInline<Function>::value>;
+            construct(std::forward<F>(f), Inline());
+            m_operations = getOperations<Function>(Inline());
+        }
+
+        TaskFunction(TaskFunction&& other)
+            : m_operations(other.m_operations)
+        {
+            if (m_operations)
+            {
+                m_operations->move(m_storage, other.m_storage);
+                other.m_operations = nullptr;
+            }
+        }
+
+        TaskFunction& operator = (TaskFunction&& other)
+        {
+            if (this != &other)
+            {
+                reset();
+                m_operations = other.m_operations;
+                if (m_operations)
+                {
+                    m_operations->move(m_storage, other.m_storage);
+                    other.m_operations = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        TaskFunction(const TaskFunction&) = delete;
+        TaskFunction& operator = (const TaskFunction&) = delete;
+
+        ~TaskFunction()
+        {
+            reset();
+        }
+
+        explicit operator bool () const
+        {
+            return m_operations != nullptr;
+        }
+
+        void operator () ()
+        {
+            m_operations->invoke(m_storage);
+        }
+
+        void reset()
+        {
+            if (m_operations)
+            {
+                m_operations->destroy(m_storage);
+                m_operations = nullptr;
+            }
+        }
+    };
+
+    struct TaskQueue;
+    struct QueueList;
+    struct QueueCounters;
+    struct TaskWorker;
+    class TaskDeque;
+    class TaskGraph;
+
+namespace detail {
+
+    class TaskNode;
+
+} // namespace detail
+
+#if defined(MANGO_ENABLE_COROUTINES)
+
+    template <typename T>
+    class AsyncTask;
+
+    // resume the awaiting coroutine as a task in the queue
+    template <typename Q>
+    struct ScheduleAwaiter
+    {
+        Q& queue;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
 
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            queue.enqueue([handle] {
+                handle.resume();
+            });
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+#endif
+
+    class ThreadPool : private NonCopyable
+    {
+    private:
+        friend struct TaskQueue;
+        friend struct QueueList;
+        friend struct QueueCache;
+        friend struct QueueCounters;
+        friend struct TaskWorker;
+        friend class TaskDeque;
+        friend class ConcurrentQueue;
+        friend class SerialQueue;
+        friend class TaskGraph;
+        friend class detail::TaskNode;
+
+        struct Queue
+        {
+            ThreadPool* pool;
+            int priority;
+            std::atomic<int> task_input_count;
+            std::atomic<int> task_complete_count;
+            std::atomic<int> stamp_cancel;
+            std::string name;
+            TaskQueue* tasks { nullptr };
+            QueueCounters* counters { nullptr };
+            EventCount event;
+
+            ~Queue();
+
+            bool empty() const
+            {
+                return task_input_count.load() == task_complete_count.load();
+            }
+        };
+
+        struct Task
+        {
+            Queue* queue;
+            int stamp;
+            u64 time; // enqueue time when the telemetry is enabled
+            TaskFunction func;
+        };
+
+    public:
+        struct ParkingPolicy
+        {
+            u32 spin_count = 64;  // polls with cpu pause before the worker starts yielding
+            u32 yield_count = 8;  // polls with thread yield before the worker is parked
+        };
+
+        struct Statistics
+        {
+            u64 spins = 0;  // idle episodes where worker started spinning
+            u64 parks = 0;  // workers put to sleep
+            u64 wakes = 0;  // parked workers woken up
+
+            // worker time in nanoseconds, summed over all workers
+            u64 busy_time = 0;
+            u64 idle_time = 0;
+            u64 park_time = 0;
+        };
+
+        struct Histogram
+        {
+            // bucket i counts the samples in [2^i, 2^(i+1)) nanoseconds
+            static constexpr int BucketCount = 40;
+
+            u64 buckets[BucketCount] = {};
+            u64 count = 0;
+            u64 total = 0;
+
+            u64 average() const
+            {
+                return count ? total / count : 0;
+            }
+
+            // upper bound of the bucket where the percentile (0..1) falls
+            u64 percentile(double p) const
+            {
+                const u64 target = u64(p * count);
+                u64 sum = 0;
+                for (int i = 0; i < BucketCount; ++i)
+                {
+                    sum += buckets[i];
+                    if (sum > target)
+                        return (2ull << i) - 1;
+                }
+                return 0;
+            }
+        };
+
+        struct QueueStatistics
+        {
+            std::string name;
+            u64 enqueued = 0;
+            u64 executed_by_workers = 0;
+            u64 executed_by_waiters = 0;  // threads helping in wait()
+            u64 cancelled = 0;
+            Histogram latency;  // from enqueue to start of execution
+            Histogram runtime;  // execution time
+        };
+
+        struct Config
+        {
+            size_t size = 0;                // number of workers (0: one for each processor in the set)
+            std::vector<int> processors;    // processors the workers run on (empty: all)
+            bool pin = false;               // bind each worker to one processor instead of the whole set
+            std::string name = "mango";     // workers are named "<name>.<index>"
+            size_t stack_size = 0;          // worker stack size in bytes (0: platform default)
+            bool telemetry = false;         // gather QueueStatistics
+            ParkingPolicy parking;
+        };
+
+        ThreadPool(size_t size);
+        ThreadPool(const Config& config);
+        ~ThreadPool();
+
+        static ThreadPool& getInstance();
+        static int getInstanceSize();
+
+        // configure the shared instance; must be called before it is used the first time
+        static void configureInstance(const Config& config);
+
+        // processor topology; these are the processor sets a pool is typically bound to
+        static std::vector<int> getProcessors();
+        static std::vector<std::vector<int>> getNumaNodes();
+        static std::vector<std::vector<int>> getCacheDomains();
+
+        int size() const;
+        const Config& getConfig() const;
+
+        void setParkingPolicy(const ParkingPolicy& policy);
+        ParkingPolicy getParkingPolicy() const;
+        Statistics getStatistics() const;
+
+        // The telemetry is aggregated by queue name; it is collected for the queues
+        // which are created while the telemetry is enabled.
+        void setTelemetry(bool enable);
+        std::vector<QueueStatistics> getQueueStatistics() const;
+
+        void enqueue(TaskFunction&& func)
+        {
+            enqueue(m_static_queue, std::move(func));
+        }
+
+#if defined(MANGO_ENABLE_COROUTINES)
+
+        // co_await pool.schedule() resumes the coroutine in a worker thread
+        auto schedule()
+        {
+            return ScheduleAwaiter<ThreadPool> { *this };
+        }
+
+#endif
+
+    protected:
+        void thread(size_t threadID);
+
+        Queue* createQueue(const std::string& name, int priority);
+        void deleteQueue(Queue* queue);
+
+        void enqueue(Queue* queue, TaskFunction&& func);
+        bool dequeue_and_process();
+        void cancel(Queue* queue);
+        void wait(Queue* queue);
+        bool wait_for(Queue* queue, std::chrono::nanoseconds timeout);
+        bool wait(Queue* queue, const std::chrono::steady_clock::time_point* deadline);
+
+        Task* acquireTask();
+        void discardTask(Task* task);
+
+        TaskWorker* getCurrentWorker() const;
+        Task* dequeue(TaskWorker* worker);
+        Task* dequeue(TaskWorker* worker, const Queue* queue);
+        Task* steal(TaskWorker* worker, int priority, const Queue* queue);
+        void process(Task* task, bool waiter);
+        QueueCounters* getQueueCounters(const std::string& name);
+
+    private:
+        alignas(64) QueueList* m_queues;
+        ObjectCache<Queue>* m_queue_cache;
+        u64 m_id;
+        TaskWorker* m_workers;
+
+        std::atomic<bool> m_stop { false };
+        std::atomic<bool> m_telemetry { false };
+        std::atomic<u32> m_spin_count;
+        std::atomic<u32> m_yield_count;
+        EventCount m_event;
+
+        Queue* m_static_queue;
+        Config m_config;
+
+        mutable std::mutex m_counters_mutex;
+        std::vector<QueueCounters*> m_counters;
+    };
+
+    enum class Priority
+    {
+        HIGH = 0,
+        NORMAL = 1,
+        LOW = 2
+    };
+
+    /*
+        ConcurrentQueue is API to submit work into the ThreadPool. The tasks have no
+        dependency to each other and can be executed in any order. Any number of queues
+        can be created from any thread in the program. The ThreadPool is shared between
+        queues. The queues can be configuted to different priorities to control which tasks
+        are more time critical.
+
+        Usage example:
+
+        // create queue
+        ConcurrentQueue q;
+
+        // submit work into the queue
+        q.enqueue([] {
+            // TODO: do your stuff here..
+        });
+
+        // wait until the queue is drained
+        q.wait();
+
+        The queues use the shared ThreadPool instance unless a pool is given. Separate pools
+        can be created for example for I/O and compute, or for a subset of the processors:
+
+        ThreadPool::Config config;
+        config.processors = ThreadPool::getNumaNodes()[0];
+        config.name = "compute";
+
+        ThreadPool pool(config);
+        ConcurrentQueue q(pool, "tiles");
+
+        The waiting thread helps by executing the queue's own tasks. When none are
+        available the thread is parked until the queue is drained; it never picks up
+        unrelated work from other queues. The exception is a task waiting in a single
+        worker pool: it runs the nested tasks of its own worker, which no other thread
+        could reach, before parking. wait_for() does not help; it parks until the queue
+        is drained or the timeout expires.
+
+    */
+
+    class ConcurrentQueue : private NonCopyable
+    {
+    protected:
+        ThreadPool& m_pool;
+        ThreadPool::Queue* m_queue;
+
+    public:
+        ConcurrentQueue();
+        ConcurrentQueue(const std::string& name, Priority priority = Priority::NORMAL);
+        ConcurrentQueue(ThreadPool& pool, const std::string& name, Priority priority = Priority::NORMAL);
+        ~ConcurrentQueue();
+
+        template <class F, class... Args>
+        void enqueue(F&& f, Args&&... args)
+        {
+            m_pool.enqueue(m_queue, TaskFunction(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+        }
+
+#if defined(MANGO_ENABLE_COROUTINES)
+
+        // co_await queue.schedule() resumes the coroutine as a task in this queue
+        auto schedule()
+        {
+            return ScheduleAwaiter<ConcurrentQueue> { *this };
+        }
+
+#endif
+
+        void steal();
+        void cancel();
+        void wait();
+
+        // returns false if the queue was not drained before the timeout
+        template <class Rep, class Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return wait_for(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout));
+        }
+
+        bool wait_for(std::chrono::nanoseconds timeout);
+    };
+
+    /*
+        SerialQueue is API to serialize tasks to be executed after previous task
+        in the queue has completed. By default the tasks are NOT executed in the ThreadPool;
+        each queue has it's own execution thread, which is the right choice for blocking I/O.
+
+        A queue created with a ThreadPool is a strand: the tasks are executed in order by the
+        pool's workers and the queue does not own a thread, so any number of them can be
+        created (eg. one per open archive or client connection).
+
+        SerialQueue and ConcurrentQueue can be freely mixed can can enqueue work to other
+        queues from their tasks.
+
+        Usage example:
+
+        // create queue
+        SerialQueue s;
+
+        // submit work into the queue
+        s.enqueue([] {
+            // TODO: do your stuff here..
+        });
+
+        // wait until the queue is drained
+        s.wait(); // non-cooperative, CPU-sink
+
+        // strand executed in the shared ThreadPool
+        SerialQueue strand(ThreadPool::getInstance(), "connection");
+
+    */
+
+    class SerialQueue : private NonCopyable
+    {
+    protected:
+        using Task = std::function<void()>;
+
+        std::string m_name;
+        std::thread m_thread;
+        std::atomic<bool> m_stop { false };
+        std::atomic<int> m_task_counter { 0 };
+
+        std::deque<Task> m_task_queue;
+        std::mutex m_queue_mutex;
+        std::condition_variable m_condition;
+
+        // strand mode: lock-free multiple-producer single-consumer list of tasks
+        struct StrandNode;
+
+        ThreadPool* m_pool { nullptr };
+        ThreadPool::Queue* m_strand_queue { nullptr };
+        std::atomic<StrandNode*> m_strand_head { nullptr };
+        StrandNode* m_strand_tail { nullptr };
+        StrandNode* m_strand_stub { nullptr };
+        std::atomic<u32> m_strand_sequence { 0 };
+        std::atomic<u32> m_strand_cancel { 0 };
+
+        void thread();
+
+        void submit(TaskFunction&& func);
+        void push(StrandNode* node);
+        StrandNode* pop();
+        void drain();
+
+    public:
+        SerialQueue();
+        SerialQueue(const std::string& name);
+        SerialQueue(ThreadPool& pool, const std::string& name, Priority priority = Priority::NORMAL);
+        ~SerialQueue();
+
+        template <class F, class... Args>
+        void enqueue(F&& f, Args&&... args)
+        {
+            if (m_pool)
+            {
+                submit(TaskFunction(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(m_queue_mutex);
+            m_task_queue.emplace_back(f, (args)...);
+            ++m_task_counter;
+            m_condition.notify_one();
+        }
+
+#if defined(MANGO_ENABLE_COROUTINES)
+
+        // co_await queue.schedule() resumes the coroutine as the queue's next task
+        auto schedule()
+        {
+            return ScheduleAwaiter<SerialQueue> { *this };
+        }
+
+#endif
+
+        void cancel();
+        void wait();
+    };
+
+    /*
+        Task is a simple queue-less convenience object to enqueue work into the ThreadPool.
+        Synchronization must be done manually.
+    */
+
+    class Task
+    {
+    public:
+        template <class F, class... Args>
+        Task(F&& f, Args&&... args)
+        {
+            ThreadPool& pool = ThreadPool::getInstance();
+            pool.enqueue(TaskFunction(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+        }
+    };
+
+namespace detail {
+
+    // ----------------------------------------------------------------------------
+    // TaskNode
+    // ----------------------------------------------------------------------------
+
+    /*
+        TaskNode is the dependency machinery shared by TaskGraph and FutureTask. The node
+        is blocked by a counter which is initially one (the "hold") plus the number of
+        unfinished predecessors. The node is enqueued into the ThreadPool when the counter
+        reaches zero. When the node has executed it releases all of its successors, which
+        enqueues them from the worker thread so they are picked up cache-hot. No thread
+        is blocked anywhere in the chain.
+    */
+
+    class TaskNode : private NonCopyable
+    {
+    public:
+        using Queue = ThreadPool::Queue;
+
+    protected:
+        struct Link
+        {
+            TaskNode* node;
+            Link* next;
+        };
+
+        Queue* m_queue;
+        TaskFunction m_function;
+        std::atomic<int> m_blocking { 1 };
+        std::atomic<Link*> m_successors { nullptr };
+
+        void schedule();
+        void resolve();
+
+        virtual void execute();
+
+    public:
+        TaskNode(Queue* queue);
+        virtual ~TaskNode();
+
+        static Queue* getDefaultQueue();
+
+        template <typename F>
+        void setFunction(F&& f)
+        {
+            m_function = TaskFunction(std::forward<F>(f));
+        }
+
+        // The successor will not be scheduled before this node has been executed.
+        // The dependencies must be declared before the successor is unblocked.
+        void precede(TaskNode* successor);
+
+        // release the hold or a finished predecessor
+        void unblock();
+
+        // the node has been executed and the successors released
+        bool done() const;
+    };
+
+    // ----------------------------------------------------------------------------
+    // FutureState
+    // ----------------------------------------------------------------------------
+
+    class FutureStateBase : public TaskNode
+    {
+    protected:
+        // references from the FutureTask and from the pending execution
+        std::atomic<int> m_refcount { 2 };
+        std::atomic<bool> m_ready { false };
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+
+        void execute() override
+        {
+            m_function();
+            m_function.reset();
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_ready.store(true, std::memory_order_release);
+                m_condition.notify_all();
+            }
+
+            resolve();
+            release();
+        }
+
+        virtual void destroy() = 0;
+
+    public:
+        FutureStateBase(Queue* queue)
+            : TaskNode(queue)
+        {
+        }
+
+        bool ready() const
+        {
+            return m_ready.load(std::memory_order_acquire);
+        }
+
+        void wait()
+        {
+            if (!ready())
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this] {
+                    return ready();
+                });
+            }
+        }
+
+        void retain()
+        {
+            m_refcount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release()
+        {
+            if (m_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                destroy();
+            }
+        }
+    };
+
+    // The shared state lives in pooled task storage instead of the heap
+    // allocated std::promise / std::future shared state.
+    template <typename T>
+    class FutureState : public FutureStateBase
+    {
+    protected:
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type m_value;
+
+        void destroy() override
+        {
+            this->~FutureState();
+            freeTaskStorage(this, sizeof(FutureState), alignof(FutureState));
+        }
+
+    public:
+        FutureState(Queue* queue)
+            : FutureStateBase(queue)
+        {
+        }
+
+        ~FutureState()
+        {
+            if (ready())
+            {
+                reinterpret_cast<T*>(&m_value)->~T();
+            }
+        }
+
+        static FutureState* create(Queue* queue)
+        {
+            void* address = allocateTaskStorage(sizeof(FutureState), alignof(FutureState));
+            return new (address) FutureState(queue);
+        }
+
+        template <typename F>
+        void compute(F& func)
+        {
+            new (&m_value) T(func());
+        }
+
+        template <typename F>
+        auto apply(F& func) -> decltype(func(std::declval<const T&>()))
+        {
+            return func(value());
+        }
+
+        const T& value() const
+        {
+            return *reinterpret_cast<const T*>(&m_value);
+        }
+    };
+
+    template <>
+    class FutureState<void> : public FutureStateBase
+    {
+    protected:
+        void destroy() override
+        {
+            this->~FutureState();
+            freeTaskStorage(this, sizeof(FutureState), alignof(FutureState));
+        }
+
+    public:
+        FutureState(Queue* queue)
+            : FutureStateBase(queue)
+        {
+        }
+
+        static FutureState* create(Queue* queue)
+        {
+            void* address = allocateTaskStorage(sizeof(FutureState), alignof(FutureState));
+            return new (address) FutureState(queue);
+        }
+
+        template <typename F>
+        void compute(F& func)
+        {
+            func();
+        }
+
+        template <typename F>
+        auto apply(F& func) -> decltype(func())
+        {
+            return func();
+        }
+
+        void value() const
+        {
+        }
+    };
+
+    template <typename T, typename F>
+    struct ContinuationResult
+    {
+        using type = decltype(std::declval<F&>()(std::declval<const T&>()));
+    };
+
+    template <typename F>
+    struct ContinuationResult<void, F>
+    {
+        using type = decltype(std::declval<F&>()());
+    };
+
+} // namespace detail
+
+    /*
+        FutureTask is an asynchronous API to submit tasks into the ThreadPool.
+        The get() member function will block the current thread until the result is available
+        and does not consume any significant amount of CPU; the thread will yield/sleep
+        while waiting for the result.
+
+        Usage example:
+
+        // enqueue a simple task into the ThreadPool
+        FutureTask<int> task([] () -> int {
+            return 7;
+        });
+
+        // this will block until the task has been completed
+        int x = task.get();
+
+        Continuations are scheduled when the result becomes available; nothing blocks
+        until get() or wait() is called on the final result.
+
+        FutureTask<float> half = task.then([] (int x) {
+            return x * 0.5f;
+        });
+
+        FutureTask<void> all = when_all(task, half);
+
+    */
+
+    template <typename T>
+    class FutureTask;
+
+    FutureTask<void> when_all();
+
+    template <typename... Ts>
+    FutureTask<void> when_all(FutureTask<Ts>&... futures);
+
+    template <typename T>
+    FutureTask<void> when_all(std::vector<FutureTask<T>>& futures);
+
+    template <typename T>
+    class FutureTask
+    {
+    private:
+        template <typename U>
+        friend class FutureTask;
+
+        friend FutureTask<void> when_all();
+
+        template <typename... Ts>
+        friend FutureTask<void> when_all(FutureTask<Ts>&... futures);
+
+        template <typename U>
+        friend FutureTask<void> when_all(std::vector<FutureTask<U>>& futures);
+
+        using State = detail::FutureState<T>;
+
+        State* m_state;
+
+        explicit FutureTask(State* state)
+            : m_state(state)
+        {
+        }
+
+    public:
+        template <class F, class... Args>
+        FutureTask(F&& f, Args&&... args)
+            : m_state(State::create(detail::TaskNode::getDefaultQueue()))
+        {
+            State* state = m_state;
+            auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+            state->setFunction([state, func] () mutable {
+                state->compute(func);
+            });
+            state->unblock();
+        }
+
+        FutureTask(FutureTask&& other)
+            : m_state(other.m_state)
+        {
+            other.m_state = nullptr;
+        }
+
+        FutureTask& operator = (FutureTask&& other)
+        {
+            std::swap(m_state, other.m_state);
+            return *this;
+        }
+
+        ~FutureTask()
+        {
+            if (m_state)
+            {
+                m_state->release();
+            }
+        }
+
+        T get()
+        {
+            m_state->wait();
+            return m_state->value();
+        }
+
+        void wait()
+        {
+            m_state->wait();
+        }
+
+        bool ready() const
+        {
+            return m_state->ready();
+        }
+
+#if defined(MANGO_ENABLE_COROUTINES)
+
+        // co_await resumes the coroutine in the ThreadPool when the result is available
+        auto operator co_await ()
+        {
+            struct Awaiter
+            {
+                FutureTask& future;
+
+                bool await_ready() const
+                {
+                    return future.ready();
+                }
+
+                void await_suspend(std::coroutine_handle<> handle)
+                {
+                    using Resume = detail::FutureState<void>;
+
+                    Resume* resume = Resume::create(detail::TaskNode::getDefaultQueue());
+                    resume->setFunction([handle] {
+                        handle.resume();
+                    });
+
+                    future.m_state->precede(resume);
+                    resume->unblock();
+
+                    // the resume is not referenced by any FutureTask
+                    resume->release();
+                }
+
+                T await_resume()
+                {
+                    return future.get();
+                }
+            };
+
+            return Awaiter { *this };
+        }
+
+#endif
+
+        // Schedule func(result) to be executed when the result is available.
+        template <typename F>
+        FutureTask<typename detail::ContinuationResult<T, typename std::decay<F>::type>::type> then(F&& f)
+        {
+            using R = typename detail::ContinuationResult<T, typename std::decay<F>::type>::type;
+            using NextState = detail::FutureState<R>;
+
+            State* state = m_state;
+            NextState* next = NextState::create(detail::TaskNode::getDefaultQueue());
+
+            // the continuation reads our result so keep the state alive until then
+            state->retain();
+
+            auto func = std::forward<F>(f);
+            next->setFunction([state, next, func] () mutable {
+                auto apply = [state, &func] () {
+                    return state->apply(func);
+                };
+                next->compute(apply);
+                state->release();
+            });
+
+            state->precede(next);
+            next->unblock();
+
+            return FutureTask<R>(next);
+        }
+    };
+
+    // The returned FutureTask becomes ready when all of the futures are ready.
+
+    inline FutureTask<void> when_all()
+    {
+        // nothing to wait for; the empty pack would form a zero-length array below
+        using State = detail::FutureState<void>;
+
+        State* state = State::create(detail::TaskNode::getDefaultQueue());
+        state->setFunction([] {
+        });
+
+        state->unblock();
+        return FutureTask<void>(state);
+    }
+
+    template <typename... Ts>
+    FutureTask<void> when_all(FutureTask<Ts>&... futures)
+    {
+        using State = detail::FutureState<void>;
+
+        State* state = State::create(detail::TaskNode::getDefaultQueue());
+        state->setFunction([] {
+        });
+
+        detail::TaskNode* predecessors[] = { futures.m_state... };
+        for (detail::TaskNode* predecessor : predecessors)
+        {
+            predecessor->precede(state);
+        }
+
+        state->unblock();
+        return FutureTask<void>(state);
+    }
+
+    template <typename T>
+    FutureTask<void> when_all(std::vector<FutureTask<T>>& futures)
+    {
+        using State = detail::FutureState<void>;
+
+        State* state = State::create(detail::TaskNode::getDefaultQueue());
+        state->setFunction([] {
+        });
+
+        for (auto& future : futures)
+        {
+            future.m_state->precede(state);
+        }
+
+        state->unblock();
+        return FutureTask<void>(state);
+    }
+
+#if defined(MANGO_ENABLE_COROUTINES)
+
+    // ----------------------------------------------------------------------------
+    // AsyncTask
+    // ----------------------------------------------------------------------------
+
+namespace detail {
+
+    class AsyncPromiseBase
+    {
+    protected:
+        // the awaiting coroutine, or one of the markers below
+        std::atomic<void*> m_state { nullptr };
+        std::atomic<bool> m_done { false };
+        std::exception_ptr m_exception;
+
+        template <typename T>
+        friend class mango::AsyncTask;
+
+        static void* completed()
+        {
+            return reinterpret_cast<void*>(uintptr_t(1));
+        }
+
+        static void* detached()
+        {
+            return reinterpret_cast<void*>(uintptr_t(2));
+        }
+
+        void rethrow()
+        {
+            if (m_exception)
+            {
+                std::rethrow_exception(m_exception);
+            }
+        }
+
+    public:
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            template <typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+            {
+                AsyncPromiseBase& promise = handle.promise();
+
+                promise.m_done.store(true, std::memory_order_release);
+                promise.m_done.notify_all();
+
+                void* state = promise.m_state.exchange(completed(), std::memory_order_acq_rel);
+                if (state == detached())
+                {
+                    // nobody is interested in the result anymore
+                    handle.destroy();
+                    return std::noop_coroutine();
+                }
+
+                if (state)
+                {
+                    // continue the awaiting coroutine in this thread
+                    return std::coroutine_handle<>::from_address(state);
+                }
+
+                return std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        };
+
+        std::suspend_never initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception()
+        {
+            m_exception = std::current_exception();
+        }
+    };
+
+    template <typename T>
+    class AsyncResult : public AsyncPromiseBase
+    {
+    protected:
+        std::optional<T> m_value;
+
+    public:
+        template <typename U>
+        void return_value(U&& value)
+        {
+            m_value.emplace(std::forward<U>(value));
+        }
+
+        T result()
+        {
+            rethrow();
+            return std::move(*m_value);
+        }
+    };
+
+    template <>
+    class AsyncResult<void> : public AsyncPromiseBase
+    {
     public:
-        ObjectCache(int block_size)
-            : m_block_size(block_size)
+        void return_void()
         {
         }
 
-        ~ObjectCache()
+        void result()
         {
-            for (auto block : m_blocks) {
-                delete[] block;
-            }
-
-            delete[] m_stack;
+            rethrow();
         }
+    };
 
-        T* acquire()
-        {
-            SpinLockGuard guard(m_lock);
-            if (!m_stack_size)
-            {
-                // reallocate stack
-                delete[] m_stack;
-                m_stack_capacity += m_block_size;
-                m_stack = new T*[m_stack_capacity];
+} // namespace detail
 
-                // allocate more objects
-                T* block = new T[m_block_size];
-                m_blocks.push_back(block);
+    /*
+        AsyncTask is the return type for coroutines. The coroutine starts executing
+        immediately in the calling thread and continues wherever it is resumed from;
+        co_await on a queue's schedule() moves it to the queue's execution context.
+        An AsyncTask can be awaited by one coroutine or waited from a normal function
+        with get(). Destroying the AsyncTask detaches the coroutine.
 
-                // put the allocated objects in the stack
-                for (int i = 0; i < m_block_size; ++i)
-                {
-                    m_stack[i] = block + i;
-                }
+        Usage example:
 
-                m_stack_size = m_block_size;
-            }
+        AsyncTask<int> process(SerialQueue& io, ConcurrentQueue& compute)
+        {
+            co_await io.schedule();
+            Buffer buffer = read();             // executed in the I/O thread
 
-            T* object = m_stack[--m_stack_size];
-            return object;
+            co_await compute.schedule();
+            co_return decode(buffer);           // executed in the ThreadPool
         }
 
-        void discard(T* object)
-        {
-            SpinLockGuard guard(m_lock);
-            m_stack[m_stack_size++] = object;
-        }
-    };
+        // long operations can also be submitted as FutureTask and awaited
+        int x = co_await FutureTask<int>([] { return compute(); });
 
-    struct TaskQueue;
+    */
 
-    class ThreadPool : private NonCopyable
+    template <typename T>
+    class AsyncTask
     {
-    private:
-        friend struct TaskQueue;
-        friend class ConcurrentQueue;
-        friend class SerialQueue;
-
-        struct Queue
+    public:
+        struct promise_type : detail::AsyncResult<T>
         {
-            ThreadPool* pool;
-            int priority;
-            std::atomic<int> task_input_count;
-            std::atomic<int> task_complete_count;
-            std::atomic<int> stamp_cancel;
-            std::string name;
-
-            bool empty() const
+            AsyncTask get_return_object()
             {
-                return task_input_count.load() == task_complete_count.load();
+                return AsyncTask(std::coroutine_handle<promise_type>::from_promise(*this));
             }
         };
 
-        struct Task
+    protected:
+        std::coroutine_handle<promise_type> m_handle;
+
+        explicit AsyncTask(std::coroutine_handle<promise_type> handle)
+            : m_handle(handle)
         {
-            Queue* queue;
-            int stamp;
-            std::function<void()> func;
-        };
+        }
 
     public:
-        ThreadPool(size_t size);
-        ~ThreadPool();
-
-        static ThreadPool& getInstance();
-        static int getInstanceSize();
-
-        int size() const;
+        AsyncTask(AsyncTask&& other) noexcept
+            : m_handle(std::exchange(other.m_handle, nullptr))
+        {
+        }
 
-        void enqueue(std::function<void()>&& func)
+        AsyncTask& operator = (AsyncTask&& other) noexcept
         {
-            enqueue(m_static_queue, std::move(func));
+            std::swap(m_handle, other.m_handle);
+            return *this;
         }
 
-    protected:
-        void thread(size_t threadID);
+        ~AsyncTask()
+        {
+            if (m_handle)
+            {
+                promise_type& promise = m_handle.promise();
+                void* state = promise.m_state.exchange(promise_type::detached(), std::memory_order_acq_rel);
+                if (state == promise_type::completed())
+                {
+                    m_handle.destroy();
+                }
+            }
+        }
 
-        Queue* createQueue(const std::string& name, int priority);
-        void deleteQueue(Queue* queue);
+        bool ready() const
+        {
+            return m_handle.promise().m_done.load(std::memory_order_acquire);
+        }
 
-        void enqueue(Queue* queue, std::function<void()>&& func);
-        bool dequeue_and_process();
-        void cancel(Queue* queue);
-        void wait(Queue* queue);
+        // block the calling thread until the coroutine has completed
+        T get()
+        {
+            promise_type& promise = m_handle.promise();
+            promise.m_done.wait(false, std::memory_order_acquire);
+            return promise.result();
+        }
 
-    private:
-        alignas(64) ObjectCache<Queue> m_queue_cache;
-        alignas(64) TaskQueue* m_queues;
+        bool await_ready() const noexcept
+        {
+            return m_handle.promise().m_state.load(std::memory_order_acquire) == promise_type::completed();
+        }
 
-        std::atomic<bool> m_stop { false };
-        std::atomic<int> m_sleep_count { 0 };
-        std::mutex m_queue_mutex;
-        std::condition_variable m_condition;
+        bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            // the awaiting coroutine is resumed immediately if we completed in the meantime
+            void* expected = nullptr;
+            return m_handle.promise().m_state.compare_exchange_strong(expected, awaiting.address(),
+                std::memory_order_acq_rel, std::memory_order_acquire);
+        }
 
-        Queue* m_static_queue;
-        std::vector<std::thread> m_threads;
+        T await_resume()
+        {
+            return m_handle.promise().result();
+        }
     };
 
-    enum class Priority
-    {
-        HIGH = 0,
-        NORMAL = 1,
-        LOW = 2
-    };
+#endif // defined(MANGO_ENABLE_COROUTINES)
 
     /*
-        ConcurrentQueue is API to submit work into the ThreadPool. The tasks have no
-        dependency to each other and can be executed in any order. Any number of queues
-        can be created from any thread in the program. The ThreadPool is shared between
-        queues. The queues can be configuted to different priorities to control which tasks
-        are more time critical.
+        TaskGraph is API to execute tasks with dependencies. A task is enqueued into the
+        ThreadPool as soon as all of it's predecessors have been executed; no thread blocks
+        between the stages of the graph. Nodes can be added to the graph after submit() and
+        submitted again. The graph is a queue so wait() helps only with the graph's tasks.
 
         Usage example:
 
-        // create queue
-        ConcurrentQueue q;
+        TaskGraph graph("image.load");
 
-        // submit work into the queue
-        q.enqueue([] {
-            // TODO: do your stuff here..
-        });
+        auto map = graph.add([] { ... });
+        auto decompress = graph.add([] { ... });
+        auto decode = graph.add([] { ... });
+        auto convert = graph.add([] { ... });
 
-        // wait until the queue is drained
-        q.wait();
+        map.precede(decompress);
+        decompress.precede(decode);
+        convert.succeed(decode);
+
+        graph.submit();
+        graph.wait();
 
     */
 
-    class ConcurrentQueue : private NonCopyable
+    class TaskGraph : private NonCopyable
     {
-    protected:
-        ThreadPool& m_pool;
-        ThreadPool::Queue* m_queue;
-
     public:
-        ConcurrentQueue();
-        ConcurrentQueue(const std::string& name, Priority priority = Priority::NORMAL);
-        ~ConcurrentQueue();
-
-        template <class F, class... Args>
-        void enqueue(F&& f, Args&&... args)
+        class Node
         {
-            m_pool.enqueue(m_queue, std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        }
-
-        void steal();
-        void cancel();
-        void wait();
-    };
-
-    /*
-        SerialQueue is API to serialize tasks to be executed after previous task
-        in the queue has completed. The tasks are NOT executed in the ThreadPool; each
-        queue has it's own execution thread.
-
-        SerialQueue and ConcurrentQueue can be freely mixed can can enqueue work to other
-        queues from their tasks.
-
-        Usage example:
+        protected:
+            detail::TaskNode* m_node;
 
-        // create queue
-        SerialQueue s;
+        public:
+            Node(detail::TaskNode* node)
+                : m_node(node)
+            {
+            }
 
-        // submit work into the queue
-        s.enqueue([] {
-            // TODO: do your stuff here..
-        });
+            Node& precede(Node successor)
+            {
+                m_node->precede(successor.m_node);
+                return *this;
+            }
 
-        // wait until the queue is drained
-        s.wait(); // non-cooperative, CPU-sink
+            Node& succeed(Node predecessor)
+            {
+                predecessor.m_node->precede(m_node);
+                return *this;
+            }
 
-    */
+            bool done() const
+            {
+                return m_node->done();
+            }
+        };
 
-    class SerialQueue : private NonCopyable
-    {
     protected:
-        using Task = std::function<void()>;
-
-        std::string m_name;
-        std::thread m_thread;
-        std::atomic<bool> m_stop { false };
-        std::atomic<int> m_task_counter { 0 };
-
-        std::deque<Task> m_task_queue;
-        std::mutex m_queue_mutex;
-        std::condition_variable m_condition;
+        ThreadPool& m_pool;
+        detail::TaskNode::Queue* m_queue;
+        std::vector<detail::TaskNode*> m_nodes;
+        size_t m_submitted { 0 };
 
-        void thread();
+        detail::TaskNode* createNode();
 
     public:
-        SerialQueue();
-        SerialQueue(const std::string& name);
-        ~SerialQueue();
+        TaskGraph();
+        TaskGraph(const std::string& name, Priority priority = Priority::NORMAL);
+        TaskGraph(ThreadPool& pool, const std::string& name, Priority priority = Priority::NORMAL);
+        ~TaskGraph();
 
         template <class F, class... Args>
-        void enqueue(F&& f, Args&&... args)
+        Node add(F&& f, Args&&... args)
         {
-            std::unique_lock<std::mutex> lock(m_queue_mutex);
-            m_task_queue.emplace_back(f, (args)...);
-            ++m_task_counter;
-            m_condition.notify_one();
+            detail::TaskNode* node = createNode();
+            node->setFunction(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            return Node(node);
         }
 
+        // start executing the nodes added since the previous submit()
+        void submit();
+
         void cancel();
         void wait();
+
+        template <class Rep, class Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return wait_for(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout));
+        }
+
+        bool wait_for(std::chrono::nanoseconds timeout);
     };
 
-    /*
-        Task is a simple queue-less convenience object to enqueue work into the ThreadPool.
-        Synchronization must be done manually.
-    */
+namespace detail {
 
-    class Task
+    // ----------------------------------------------------------------------------
+    // ParallelRange
+    // ----------------------------------------------------------------------------
+
+    class ParallelRange
     {
     public:
-        template <class F, class... Args>
-        Task(F&& f, Args&&... args)
+        virtual ~ParallelRange() {}
+
+        // The range is processed in contiguous chunks; chunk 0 is processed by the calling
+        // thread in one or more consecutive pieces before prepare() is called. The chunks
+        // 1..count are processed concurrently after prepare(count).
+        virtual void prepare(int count)
         {
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            MANGO_UNREFERENCED(count);
         }
-    };
 
-    /*
-        FutureTask is an asynchronous API to submit tasks into the ThreadPool.
-        The get() member function will block the current thread until the result is available
-        and does not consume any significant amount of CPU; the thread will yield/sleep
-        while waiting for the result.
+        virtual void process(int index, int first, int last) = 0;
+    };
 
-        Usage example:
+    // Execute the range using the ThreadPool. The grain is the number of elements in one
+    // chunk; zero selects the grain automatically from the measured cost of the elements.
+    void parallel(ParallelRange& range, int begin, int end, int grain);
 
-        // enqueue a simple task into the ThreadPool
-        FutureTask<int> task([] () -> int {
-            return 7;
-        });
+    template <typename F>
+    class ParallelForRange : public ParallelRange
+    {
+    protected:
+        F& m_func;
 
-        // this will block until the task has been completed
-        int x = task.get();
+    public:
+        ParallelForRange(F& func)
+            : m_func(func)
+        {
+        }
 
-    */
+        void process(int index, int first, int last) override
+        {
+            MANGO_UNREFERENCED(index);
+            m_func(first, last);
+        }
+    };
 
-    template <typename T>
-    class FutureTask
+    template <typename T, typename F, typename R>
+    class ParallelReduceRange : public ParallelRange
     {
-    private:
-        using Future = std::future<T>;
-        using Promise = std::promise<T>;
-        using Function = std::function<T()>;
-
-        Promise m_promise;
-        Future m_future;
+    protected:
+        F& m_func;
+        R& m_reduce;
+        T m_first;
+        std::vector<T> m_partials;
 
     public:
-        template <class F, class... Args>
-        FutureTask(F&& f, Args&&... args)
-            : m_promise()
-            , m_future(m_promise.get_future())
+        ParallelReduceRange(const T& identity, F& func, R& reduce)
+            : m_func(func)
+            , m_reduce(reduce)
+            , m_first(identity)
         {
-            Function func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto container = std::bind([this] (Function func) {
-                T value = func();
-                m_promise.set_value(value);
-            }, func);
+        }
 
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(container);
+        void prepare(int count) override
+        {
+            m_partials.resize(count, m_first);
         }
 
-        T get()
+        void process(int index, int first, int last) override
         {
-            return m_future.get();
+            if (index)
+            {
+                m_partials[index - 1] = m_func(first, last);
+            }
+            else
+            {
+                m_first = m_reduce(m_first, m_func(first, last));
+            }
         }
 
-        void wait()
+        T result()
         {
-            m_future.wait();
+            // the chunks are combined in order; the reduction does not need to be commutative
+            T value = m_first;
+            for (const T& partial : m_partials)
+            {
+                value = m_reduce(value, partial);
+            }
+            return value;
         }
     };
 
-    template <>
-    class FutureTask<void>
-    {
-    private:
-        using Future = std::future<void>;
-        using Promise = std::promise<void>;
-        using Function = std::function<void()>;
+} // namespace detail
 
-        Promise m_promise;
-        Future m_future;
+    /*
+        parallel_for executes func(first, last) for consecutive sub-ranges of [begin, end)
+        in the ThreadPool and returns when the whole range has been processed. The calling
+        thread participates in the work. When grain is zero the first elements are timed
+        and the chunk size is chosen so that small ranges run directly in the calling thread
+        and large ones are split into enough chunks to keep all workers busy.
 
-    public:
-        template <class F, class... Args>
-        FutureTask(F&& f, Args&&... args)
-            : m_promise()
-            , m_future(m_promise.get_future())
+        Usage example:
+
+        parallel_for(0, surface.height, [&] (int y0, int y1)
         {
-            Function func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto container = std::bind([this] (Function func) {
-                func();
-                m_promise.set_value();
-            }, func);
+            for (int y = y0; y < y1; ++y)
+            {
+                process(surface.address(0, y));
+            }
+        });
 
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(container);
-        }
+        parallel_reduce combines the results of func(first, last) with reduce(a, b):
 
-        void get()
+        u64 sum = parallel_reduce(0, count, u64(0), [&] (int first, int last)
         {
-            m_future.get();
-        }
-
-        void wait()
+            u64 x = 0;
+            for (int i = first; i < last; ++i)
+                x += values[i];
+            return x;
+        },
+        [] (u64 a, u64 b)
         {
-            m_future.wait();
-        }
-    };
+            return a + b;
+        });
+
+    */
+
+    template <typename F>
+    void parallel_for(int begin, int end, int grain, F&& func)
+    {
+        detail::ParallelForRange<typename std::remove_reference<F>::type> range(func);
+        detail::parallel(range, begin, end, grain);
+    }
+
+    template <typename F>
+    void parallel_for(int begin, int end, F&& func)
+    {
+        parallel_for(begin, end, 0, std::forward<F>(func));
+    }
+
+    template <typename T, typename F, typename R>
+    T parallel_reduce(int begin, int end, int grain, const T& identity, F&& func, R&& reduce)
+    {
+        detail::ParallelReduceRange<T, typename std::remove_reference<F>::type,
+                                       typename std::remove_reference<R>::type> range(identity, func, reduce);
+        detail::parallel(range, begin, end, grain);
+        return range.result();
+    }
+
+    template <typename T, typename F, typename R>
+    T parallel_reduce(int begin, int end, const T& identity, F&& func, R&& reduce)
+    {
+        return parallel_reduce(begin, end, 0, identity, std::forward<F>(func), std::forward<R>(reduce));
+    }
 
 } // namespace mango
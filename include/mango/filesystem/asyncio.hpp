@@ -0,0 +1,90 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <string>
+#include <functional>
+#include "../core/configure.hpp"
+#include "../core/object.hpp"
+#include "../core/stream.hpp"
+
+namespace mango {
+namespace filesystem {
+
+    class AsyncFile : protected NonCopyable
+    {
+    protected:
+        friend class AsyncIO;
+        struct AsyncFileHandle* m_handle;
+
+    public:
+        AsyncFile(const std::string& filename, Stream::OpenMode mode);
+        ~AsyncFile();
+
+        const std::string& filename() const;
+        u64 size() const;
+    };
+
+    /*
+        AsyncIO is an asynchronous file I/O engine. The requests are collected into a batch
+        which is handed to the kernel with a single system call when submit() is called or
+        the batch is full. The completion callbacks are executed in the ThreadPool so that
+        the next reads are in flight while the previous results are being decoded.
+
+        The engine uses io_uring on Linux and falls back to blocking transfers executed
+        in the ThreadPool on the other platforms or when io_uring is not available.
+
+        The callback receives the number of bytes transferred, which is less than the
+        request size at the end of the file, or a negative value on error. The buffers
+        must stay valid until the callback has been called.
+
+        Usage example:
+
+        AsyncIO io;
+
+        for (auto& node : path)
+        {
+            auto file = std::make_shared<AsyncFile>(path.pathname() + node.name, Stream::READ);
+            auto buffer = std::make_shared<Buffer>(size_t(file->size()));
+
+            io.read(*file, 0, *buffer, buffer->size(), [=] (s64 result) {
+                if (result >= 0)
+                {
+                    decode(*buffer, file->filename());
+                }
+            });
+        }
+
+        io.wait();
+
+    */
+
+    class AsyncIO : protected NonCopyable
+    {
+    protected:
+        struct AsyncIOState* m_state;
+
+    public:
+        using Callback = std::function<void(s64 result)>;
+
+        AsyncIO(u32 depth = 128);
+        ~AsyncIO();
+
+        // true when the requests are executed by the kernel (io_uring)
+        bool native() const;
+
+        void read(const AsyncFile& file, u64 offset, void* dest, size_t size, Callback callback);
+        void write(const AsyncFile& file, u64 offset, const void* data, size_t size, Callback callback);
+
+        // submit the batched requests
+        void submit();
+
+        // submit and wait until all requests have completed and the callbacks have returned;
+        // must not be called from the callbacks
+        void wait();
+    };
+
+} // namespace filesystem
+} // namespace mango
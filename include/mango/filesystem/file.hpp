@@ -38,15 +38,44 @@ namespace filesystem {
         operator const u8* () const;
         const u8* data() const;
         size_t size() const;
+
+        // access pattern hints; an empty range is the whole file
+        void advise(VirtualMemory::Advice advice, ConstMemory range = ConstMemory()) const;
+        void prefetch(ConstMemory range = ConstMemory()) const;
     };
 
+    /*
+        FileStream buffers the transfers in user space and uses positional I/O so that
+        the many small writes from the encoders become a few large system calls. The
+        positional pread() and pwrite() do not move the stream offset and pread() can be
+        called concurrently from multiple threads.
+
+        The DIRECT flag bypasses the page cache when writing large outputs (O_DIRECT on
+        Linux, F_NOCACHE on macOS). The stream falls back to cached writes on seek() and
+        pwrite() and the flag is ignored where it is not supported.
+
+        Usage example:
+
+        FileStream file("output.bin", Stream::WRITE, 1024 * 1024, FileStream::DIRECT);
+        file.preallocate(expected_size);
+        file.write(header, sizeof(header));
+        ...
+        file.pwrite(8, &count, 4);
+
+    */
+
     class FileStream : public Stream
     {
     protected:
 		struct FileHandle* m_handle;
 
     public:
-        FileStream(const std::string& filename, OpenMode mode);
+        enum Flags : u32
+        {
+            DIRECT = 0x01
+        };
+
+        FileStream(const std::string& filename, OpenMode mode, size_t buffer_size = 256 * 1024, u32 flags = 0);
         ~FileStream();
 
         const std::string& filename() const;
@@ -56,6 +85,64 @@ namespace filesystem {
         void seek(u64 distance, SeekMode mode);
         void read(void* dest, size_t size);
         void write(const void* data, size_t size);
+
+        // write the buffered data into the file
+        void flush();
+
+        // reserve storage for the file without changing it's size
+        void preallocate(u64 size);
+
+        // positional transfers; the stream offset is not changed
+        size_t pread(u64 offset, void* dest, size_t size) const;
+        void pwrite(u64 offset, const void* data, size_t size);
+    };
+
+    /*
+        MappedFileStream gives the encoders writable windows into a shared memory mapping
+        of the file. acquire() returns a window at the current offset so that the encoders
+        can produce their output directly into the file without copies. The file is grown
+        in large increments and truncated to the written size when the stream is closed.
+        The plain write() calls go through the file cache like FileStream does; copying
+        them into the mapping would only add page faults.
+
+        The windows remain valid as long as the stream does not grow beyond the reserved
+        capacity; reserve() the whole output up front when several windows are used at the
+        same time.
+
+        Usage example:
+
+        MappedFileStream file("texture.pkm");
+        file.write(header, sizeof(header));
+        Memory blocks = file.acquire(bytes);
+        info.compress(blocks, surface);
+
+    */
+
+    class MappedFileStream : public Stream
+    {
+    protected:
+        struct MappedFileHandle* m_handle;
+
+    public:
+        MappedFileStream(const std::string& filename, u64 capacity = 0);
+        ~MappedFileStream();
+
+        const std::string& filename() const;
+
+        u64 size() const;
+        u64 offset() const;
+        void seek(u64 distance, SeekMode mode);
+        void read(void* dest, size_t size);
+        void write(const void* data, size_t size);
+
+        // grow the file to hold at least capacity bytes
+        void reserve(u64 capacity);
+
+        // writable window at the current offset; the offset is advanced by size
+        Memory acquire(size_t size);
+
+        // write the modified pages into the file
+        void sync();
     };
 
 } // namespace filesystem
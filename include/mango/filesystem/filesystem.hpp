@@ -8,3 +8,5 @@
 #include "path.hpp"
 #include "file.hpp"
 #include "fileobserver.hpp"
+#include "asyncio.hpp"
+#include "mgx.hpp"
@@ -0,0 +1,119 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../core/configure.hpp"
+#include "../core/object.hpp"
+#include "../core/memory.hpp"
+#include "../core/compress.hpp"
+#include "../core/thread.hpp"
+
+namespace mango {
+namespace filesystem {
+
+    /*
+        MgxWriter creates .mgx containers which can be mounted with Path and File like
+        any other archive. Small files are packed together into shared blocks and large
+        files are split into block sized segments. The blocks are compressed in parallel
+        in the ThreadPool and written to the file in order as they complete; only a bounded
+        number of blocks are in flight so the memory usage does not depend on the archive size.
+
+        A block is stored without compression when the compressor cannot make it smaller;
+        the files in the uncompressed blocks are mapped directly from the container.
+
+        The DEDUPLICATE flag splits the files into content-defined chunks; the chunk
+        boundaries are found with a rolling hash so they depend only on the local content
+        and survive insertions and deletions. The chunks are keyed with xx3hash128 and
+        identical chunks are stored only once and shared by the file segments which
+        refer to them. Identical files are stored once and the near-identical files
+        share most of their data.
+
+        The folders are created automatically from the filenames. Empty folders can be
+        added with a filename ending with a slash and empty memory.
+
+        Usage example:
+
+        MgxWriter writer("data.mgx", Compressor::ZSTD);
+
+        Path path("data/");
+        for (auto& node : path)
+        {
+            if (!node.isDirectory())
+            {
+                File file(path, node.name);
+                writer.write(node.name, file);
+            }
+        }
+
+        // the errors are reported by close(), not by the destructor
+        writer.close();
+
+    */
+
+    class MgxWriter : protected NonCopyable
+    {
+    protected:
+        struct MgxWriterState* m_state;
+
+    public:
+        enum Flags : u32
+        {
+            DEDUPLICATE = 0x01
+        };
+
+        MgxWriter(const std::string& filename, Compressor::Method method = Compressor::LZ4,
+                  int level = 6, size_t block_size = 4 * 1024 * 1024, u32 flags = 0);
+        ~MgxWriter();
+
+        // add a file; the memory is copied and can be released when the call returns
+        void write(const std::string& filename, ConstMemory memory);
+
+        // write the remaining blocks and the tables; the destructor calls close() but
+        // discards the errors so call it explicitly to see them
+        void close();
+    };
+
+    // -----------------------------------------------------------------
+    // verification
+    // -----------------------------------------------------------------
+
+    /*
+        The files in .mgx containers carry a crc32c checksum. When the verification is
+        enabled the files are checked when they are mapped; the segments are hashed
+        in the decompression tasks right after they have been decompressed so the
+        verification does not need another pass over the memory. A file which fails
+        the verification throws an exception. The verification is disabled by default.
+
+        scrubMgx() verifies a whole container in the background. Every block is decompressed
+        only once and the blocks are processed in parallel in the ThreadPool.
+
+        Usage example:
+
+        FutureTask<MgxScrubStatus> scrub = scrubMgx("data.mgx");
+
+        // ... do other work ...
+
+        MgxScrubStatus status = scrub.get();
+        for (auto& error : status.errors)
+        {
+            printf("corrupted: %s\n", error.c_str());
+        }
+
+    */
+
+    struct MgxScrubStatus
+    {
+        u64 files = 0; // number of verified files
+        u64 bytes = 0; // number of verified bytes
+        std::vector<std::string> errors; // the files which failed verification
+    };
+
+    void setMgxVerification(bool enable);
+    FutureTask<MgxScrubStatus> scrubMgx(const std::string& filename);
+
+} // namespace filesystem
+} // namespace mango
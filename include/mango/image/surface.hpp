@@ -54,8 +54,16 @@ namespace mango
 
     class Bitmap : private NonCopyable, public Surface
     {
+    protected:
+        Alignment m_alignment;
+        size_t m_bytes;
+        bool m_tracked; // the image is counted in the memory tracking
+
+        void track();
+        void release();
+
     public:
-        Bitmap(int width, int height, const Format& format, int stride = 0);
+        Bitmap(int width, int height, const Format& format, int stride = 0, Alignment alignment = Alignment());
         Bitmap(ConstMemory memory, const std::string& extension);
         Bitmap(ConstMemory memory, const std::string& extension, const Format& format);
         Bitmap(const std::string& filename);
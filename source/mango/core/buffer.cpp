@@ -5,6 +5,18 @@
 #include <mango/core/buffer.hpp>
 #include <mango/core/exception.hpp>
 
+namespace
+{
+    using namespace mango;
+
+    // large buffers are mapped so that they grow without copying
+    Alignment remappable(Alignment alignment)
+    {
+        return Alignment(alignment, alignment.policy() | Alignment::REMAP);
+    }
+
+} // namespace
+
 namespace mango {
 
     // ----------------------------------------------------------------------------
@@ -14,21 +26,24 @@ namespace mango {
     Buffer::Buffer(Alignment alignment)
         : m_memory()
         , m_capacity(0)
-        , m_alignment(alignment)
+        , m_alignment(remappable(alignment))
+        , m_tracked(false)
     {
     }
 
     Buffer::Buffer(size_t bytes, Alignment alignment)
         : m_memory(allocate(bytes, alignment), bytes)
         , m_capacity(bytes)
-        , m_alignment(alignment)
+        , m_alignment(remappable(alignment))
+        , m_tracked(m_memory.address && trackAllocation(MemoryCategory::BUFFER, bytes))
     {
     }
 
     Buffer::Buffer(const u8* source, size_t bytes, Alignment alignment)
         : m_memory(allocate(bytes, alignment), bytes)
         , m_capacity(bytes)
-        , m_alignment(alignment)
+        , m_alignment(remappable(alignment))
+        , m_tracked(m_memory.address && trackAllocation(MemoryCategory::BUFFER, bytes))
     {
         std::memcpy(m_memory.address, source, bytes);
     }
@@ -36,14 +51,15 @@ namespace mango {
     Buffer::Buffer(ConstMemory memory, Alignment alignment)
         : m_memory(allocate(memory.size, alignment), memory.size)
         , m_capacity(memory.size)
-        , m_alignment(alignment)
+        , m_alignment(remappable(alignment))
+        , m_tracked(m_memory.address && trackAllocation(MemoryCategory::BUFFER, memory.size))
     {
         std::memcpy(m_memory.address, memory.address, memory.size);
     }
 
     Buffer::~Buffer()
     {
-        free(m_memory.address);
+        free(m_memory.address, m_capacity);
     }
 
     Buffer::operator ConstMemory () const
@@ -78,9 +94,10 @@ namespace mango {
 
     void Buffer::reset()
     {
-        free(m_memory.address);
+        free(m_memory.address, m_capacity);
         m_memory = Memory();
         m_capacity = 0;
+        m_tracked = false;
     }
 
     void Buffer::resize(size_t bytes)
@@ -93,13 +110,19 @@ namespace mango {
     {
         if (bytes > m_capacity)
         {
-            u8* storage = allocate(bytes, m_alignment);
-            if (m_memory.address)
+            void* storage = aligned_realloc(m_memory.address, m_capacity, bytes, m_alignment);
+            if (!storage)
+            {
+                MANGO_EXCEPTION("[Buffer] Out of memory.");
+            }
+
+            if (m_tracked)
             {
-                std::memcpy(storage, m_memory.address, m_memory.size);
-                free(m_memory.address);
+                trackDeallocation(MemoryCategory::BUFFER, m_capacity);
             }
-            m_memory.address = storage;
+            m_tracked = trackAllocation(MemoryCategory::BUFFER, bytes);
+
+            m_memory.address = reinterpret_cast<u8*>(storage);
             m_capacity = bytes;
         }
     }
@@ -117,15 +140,37 @@ namespace mango {
         m_memory.size += bytes;
     }
 
+    SharedMemory Buffer::release()
+    {
+        if (m_tracked)
+        {
+            // the memory is no longer held by a buffer
+            trackDeallocation(MemoryCategory::BUFFER, m_capacity);
+        }
+
+        SharedMemory memory(m_memory, m_capacity, m_alignment);
+        m_memory = Memory();
+        m_capacity = 0;
+        m_tracked = false;
+        return memory;
+    }
+
     u8* Buffer::allocate(size_t bytes, Alignment alignment) const
     {
-        void* ptr = aligned_malloc(bytes, alignment);
+        void* ptr = aligned_malloc(bytes, remappable(alignment));
         return reinterpret_cast<u8*>(ptr);
     }
 
-    void Buffer::free(u8* ptr) const
+    void Buffer::free(u8* ptr, size_t bytes) const
     {
-        aligned_free(ptr);
+        if (ptr)
+        {
+            if (m_tracked)
+            {
+                trackDeallocation(MemoryCategory::BUFFER, bytes);
+            }
+            aligned_free(ptr, bytes, m_alignment);
+        }
     }
 
     // ----------------------------------------------------------------------------
@@ -228,4 +273,10 @@ namespace mango {
         m_offset += bytes;
     }
 
+    SharedMemory MemoryStream::detach()
+    {
+        m_offset = 0;
+        return m_buffer.release();
+    }
+
 } // namespace mango
@@ -761,6 +761,47 @@ namespace
         return ~crc;
     }
 
+    // polynomial arithmetic modulo the (reflected) crc polynomial
+
+    u32 multiply_modp(u32 a, u32 b, u32 poly)
+    {
+        u32 m = 1u << 31;
+        u32 p = 0;
+
+        for (;;)
+        {
+            if (a & m)
+            {
+                p ^= b;
+                if ((a & (m - 1)) == 0)
+                    break;
+            }
+
+            m >>= 1;
+            b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+        }
+
+        return p;
+    }
+
+    u32 combine_template(u32 crc0, u32 crc1, size_t length1, u32 poly)
+    {
+        // x^(8 * length1) mod p by repeated squaring
+        u32 x2n = 1u << 30; // x^1
+        u32 p = 1u << 31; // x^0
+
+        for (u64 n = u64(length1) << 3; n; n >>= 1)
+        {
+            if (n & 1)
+            {
+                p = multiply_modp(x2n, p, poly);
+            }
+            x2n = multiply_modp(x2n, x2n, poly);
+        }
+
+        return multiply_modp(p, crc0, poly) ^ crc1;
+    }
+
 } // namespace
 
 namespace mango
@@ -776,4 +817,14 @@ namespace mango
         return crc_template(crc, memory, u8_crc32c, u64_crc32c);
     }
 
+    u32 crc32_combine(u32 crc0, u32 crc1, size_t length1)
+    {
+        return combine_template(crc0, crc1, length1, 0xedb88320);
+    }
+
+    u32 crc32c_combine(u32 crc0, u32 crc1, size_t length1)
+    {
+        return combine_template(crc0, crc1, length1, 0x82f63b78);
+    }
+
 } // namespace mango
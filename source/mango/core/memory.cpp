@@ -3,8 +3,307 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <cassert>
+#include <atomic>
 #include <mango/core/bits.hpp>
 #include <mango/core/memory.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/core/thread.hpp>
+
+#if !defined(MANGO_PLATFORM_WINDOWS)
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+namespace
+{
+    using namespace mango;
+
+    // -----------------------------------------------------------------------
+    // system aligned malloc/free
+    // -----------------------------------------------------------------------
+
+#if defined(MANGO_COMPILER_MICROSOFT)
+
+    void* system_aligned_malloc(size_t bytes, u32 alignment)
+    {
+        return _aligned_malloc(bytes, alignment);
+    }
+
+    void system_aligned_free(void* aligned)
+    {
+        _aligned_free(aligned);
+    }
+
+#elif defined(MANGO_PLATFORM_LINUX)
+
+    void* system_aligned_malloc(size_t bytes, u32 alignment)
+    {
+        return memalign(alignment, bytes);
+    }
+
+    void system_aligned_free(void* aligned)
+    {
+        free(aligned);
+    }
+
+#else
+
+    // generic implementation
+
+    void* system_aligned_malloc(size_t bytes, u32 alignment)
+    {
+        const size_t mask = alignment - 1;
+        void* block = std::malloc(bytes + mask + sizeof(void*));
+        char* aligned = reinterpret_cast<char*>(block) + sizeof(void*);
+
+        if (block)
+        {
+            aligned += alignment - (reinterpret_cast<ptrdiff_t>(aligned) & mask);
+            reinterpret_cast<void**>(aligned)[-1] = block;
+        }
+        else
+        {
+            aligned = nullptr;
+        }
+
+        return aligned;
+    }
+
+    void system_aligned_free(void* aligned)
+    {
+        if (aligned)
+        {
+            void* block = reinterpret_cast<void**>(aligned)[-1];
+            std::free(block);
+        }
+    }
+
+#endif
+
+    // -----------------------------------------------------------------------
+    // mapped allocations
+    // -----------------------------------------------------------------------
+
+#if defined(MANGO_PLATFORM_LINUX) && defined(MADV_HUGEPAGE)
+
+    #define MANGO_ENABLE_MAPPED_ALLOCATION
+
+    constexpr size_t g_huge_page_size = 2 * 1024 * 1024;
+
+    // explicit huge pages are not tried again after the reserved pool could not serve a request
+    std::atomic<bool> g_hugetlb_enable { true };
+
+    bool is_mapped_allocation(size_t bytes, const Alignment& alignment)
+    {
+        const u32 mask = Alignment::HUGE_PAGES | Alignment::REMAP;
+        return (alignment.policy() & mask) && bytes >= g_huge_page_size;
+    }
+
+    size_t get_huge_size(size_t bytes)
+    {
+        return (bytes + g_huge_page_size - 1) & ~(g_huge_page_size - 1);
+    }
+
+    void prefault_pages(u8* address, size_t bytes)
+    {
+        const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+        const int count = int(bytes / g_huge_page_size);
+
+        // fault the pages from multiple threads so that the kernel clears them in parallel
+        parallel_for(0, count, 1, [=] (int first, int last)
+        {
+            volatile u8* begin = address + first * g_huge_page_size;
+            volatile u8* end = address + last * g_huge_page_size;
+
+            for (volatile u8* page = begin; page < end; page += page_size)
+            {
+                *page = 0;
+            }
+        });
+    }
+
+    void* mapped_malloc(size_t bytes, const Alignment& alignment)
+    {
+        const int protection = PROT_READ | PROT_WRITE;
+        const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        const bool huge = (alignment.policy() & Alignment::HUGE_PAGES) != 0;
+
+        bytes = get_huge_size(bytes);
+        u8* address = nullptr;
+
+#if defined(MAP_HUGETLB)
+        if (huge && g_hugetlb_enable.load(std::memory_order_relaxed))
+        {
+            void* ptr = ::mmap(nullptr, bytes, protection, flags | MAP_HUGETLB, -1, 0);
+            if (ptr != MAP_FAILED)
+            {
+                address = reinterpret_cast<u8*>(ptr);
+            }
+            else
+            {
+                g_hugetlb_enable.store(false, std::memory_order_relaxed);
+            }
+        }
+#endif
+
+        if (!address)
+        {
+            // the mapping is over-allocated and trimmed so that it starts at the huge page
+            // boundary; transparent huge pages are requested with the HUGE_PAGES policy
+            void* ptr = ::mmap(nullptr, bytes + g_huge_page_size, protection, flags, -1, 0);
+            if (ptr == MAP_FAILED)
+            {
+                return nullptr;
+            }
+
+            u8* base = reinterpret_cast<u8*>(ptr);
+            address = reinterpret_cast<u8*>((uintptr_t(base) + g_huge_page_size - 1) & ~uintptr_t(g_huge_page_size - 1));
+
+            const size_t head = address - base;
+            const size_t tail = g_huge_page_size - head;
+
+            if (head)
+            {
+                ::munmap(base, head);
+            }
+
+            if (tail)
+            {
+                ::munmap(address + bytes, tail);
+            }
+
+            if (huge)
+            {
+                ::madvise(address, bytes, MADV_HUGEPAGE);
+            }
+        }
+
+        if (alignment.policy() & Alignment::PREFAULT)
+        {
+            prefault_pages(address, bytes);
+        }
+
+        return address;
+    }
+
+    void mapped_free(void* address, size_t bytes)
+    {
+        ::munmap(address, get_huge_size(bytes));
+    }
+
+    void* mapped_realloc(void* address, size_t old_bytes, size_t new_bytes)
+    {
+        // the page tables are moved instead of the data; the new address is page aligned
+        void* ptr = ::mremap(address, get_huge_size(old_bytes), get_huge_size(new_bytes), MREMAP_MAYMOVE);
+        return ptr != MAP_FAILED ? ptr : nullptr;
+    }
+
+#endif
+
+    // -----------------------------------------------------------------------
+    // memory advice
+    // -----------------------------------------------------------------------
+
+    size_t get_page_size()
+    {
+#if defined(MANGO_PLATFORM_WINDOWS)
+        static size_t page_size = [] {
+            SYSTEM_INFO info;
+            ::GetSystemInfo(&info);
+            return size_t(info.dwPageSize);
+        } ();
+#else
+        static size_t page_size = size_t(::sysconf(_SC_PAGESIZE));
+#endif
+        return page_size;
+    }
+
+    void touch_pages(const u8* address, size_t bytes, size_t page_size)
+    {
+        // read one byte from each page to fault them in
+        u8 sum = 0;
+        for (const volatile u8* page = address; page < address + bytes; page += page_size)
+        {
+            sum += *page;
+        }
+        MANGO_UNREFERENCED(sum);
+    }
+
+#if defined(MANGO_PLATFORM_WINDOWS)
+
+    void system_advise(u8* address, size_t bytes, VirtualMemory::Advice advice)
+    {
+        if (advice == VirtualMemory::WILLNEED || advice == VirtualMemory::POPULATE)
+        {
+#if defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0602)
+            WIN32_MEMORY_RANGE_ENTRY entry;
+            entry.VirtualAddress = address;
+            entry.NumberOfBytes = bytes;
+            ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &entry, 0);
+#endif
+        }
+
+        if (advice == VirtualMemory::POPULATE)
+        {
+            touch_pages(address, bytes, get_page_size());
+        }
+    }
+
+#else
+
+    void system_advise(u8* address, size_t bytes, VirtualMemory::Advice advice)
+    {
+        switch (advice)
+        {
+            case VirtualMemory::NORMAL:
+                ::posix_madvise(address, bytes, POSIX_MADV_NORMAL);
+                break;
+
+            case VirtualMemory::SEQUENTIAL:
+                ::posix_madvise(address, bytes, POSIX_MADV_SEQUENTIAL);
+                break;
+
+            case VirtualMemory::RANDOM:
+                ::posix_madvise(address, bytes, POSIX_MADV_RANDOM);
+                break;
+
+            case VirtualMemory::WILLNEED:
+                ::posix_madvise(address, bytes, POSIX_MADV_WILLNEED);
+                break;
+
+            case VirtualMemory::DONTNEED:
+                break;
+
+            case VirtualMemory::POPULATE:
+#if defined(MADV_POPULATE_READ)
+                // Linux 5.14
+                if (!::madvise(address, bytes, MADV_POPULATE_READ))
+                    break;
+#endif
+                ::posix_madvise(address, bytes, POSIX_MADV_WILLNEED);
+                touch_pages(address, bytes, get_page_size());
+                break;
+        }
+    }
+
+#endif
+
+    // -----------------------------------------------------------------------
+    // memory tracking
+    // -----------------------------------------------------------------------
+
+    struct alignas(64) MemoryCounters
+    {
+        std::atomic<u64> live_bytes { 0 };
+        std::atomic<u64> peak_bytes { 0 };
+        std::atomic<u64> allocations { 0 };
+        std::atomic<u64> deallocations { 0 };
+    };
+
+    std::atomic<bool> g_memory_tracking { false };
+    MemoryCounters g_memory_counters[int(MemoryCategory::COUNT)];
+
+} // namespace
 
 namespace mango
 {
@@ -26,17 +325,88 @@ namespace mango
     {
     }
 
+    SharedMemory::SharedMemory(Memory memory, size_t capacity, Alignment alignment)
+        : m_memory(memory)
+        , m_ptr(memory.address, [capacity, alignment] (u8* address)
+        {
+            aligned_free(address, capacity, alignment);
+        })
+    {
+    }
+
+    // -----------------------------------------------------------------------
+    // memory tracking
+    // -----------------------------------------------------------------------
+
+    void setMemoryTracking(bool enable)
+    {
+        g_memory_tracking.store(enable, std::memory_order_relaxed);
+    }
+
+    bool getMemoryTracking()
+    {
+        return g_memory_tracking.load(std::memory_order_relaxed);
+    }
+
+    MemoryStatistics getMemoryStatistics(MemoryCategory category)
+    {
+        const MemoryCounters& counters = g_memory_counters[int(category)];
+
+        MemoryStatistics stats;
+        stats.live_bytes = counters.live_bytes.load(std::memory_order_relaxed);
+        stats.peak_bytes = counters.peak_bytes.load(std::memory_order_relaxed);
+        stats.allocations = counters.allocations.load(std::memory_order_relaxed);
+        stats.deallocations = counters.deallocations.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void resetMemoryPeak(MemoryCategory category)
+    {
+        MemoryCounters& counters = g_memory_counters[int(category)];
+        counters.peak_bytes.store(counters.live_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    bool trackAllocation(MemoryCategory category, size_t bytes)
+    {
+        if (!g_memory_tracking.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        MemoryCounters& counters = g_memory_counters[int(category)];
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+
+        const u64 live = counters.live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        u64 peak = counters.peak_bytes.load(std::memory_order_relaxed);
+
+        while (live > peak && !counters.peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        {
+        }
+
+        return true;
+    }
+
+    void trackDeallocation(MemoryCategory category, size_t bytes)
+    {
+        // the allocation was counted; it is counted out even if the tracking is disabled now
+        MemoryCounters& counters = g_memory_counters[int(category)];
+        counters.deallocations.fetch_add(1, std::memory_order_relaxed);
+        counters.live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
     // -----------------------------------------------------------------------
     // Alignment
     // -----------------------------------------------------------------------
 
     Alignment::Alignment()
         : m_alignment(MANGO_DEFAULT_ALIGNMENT)
+        , m_policy(0)
     {
     }
 
-    Alignment::Alignment(u32 alignment)
+    Alignment::Alignment(u32 alignment, u32 policy)
         : m_alignment(alignment)
+        , m_policy(policy)
     {
         assert(u32_is_power_of_two(m_alignment));
         assert(m_alignment >= sizeof(void*));
@@ -47,66 +417,230 @@ namespace mango
         return m_alignment;
     }
 
+    u32 Alignment::policy() const
+    {
+        return m_policy;
+    }
+
     // -----------------------------------------------------------------------
     // aligned malloc/free
     // -----------------------------------------------------------------------
 
-#if defined(MANGO_COMPILER_MICROSOFT)
-
     void* aligned_malloc(size_t bytes, Alignment alignment)
     {
-        return _aligned_malloc(bytes, alignment);
+#if defined(MANGO_ENABLE_MAPPED_ALLOCATION)
+        if (is_mapped_allocation(bytes, alignment))
+        {
+            return mapped_malloc(bytes, alignment);
+        }
+#endif
+
+        return system_aligned_malloc(bytes, alignment);
     }
 
     void aligned_free(void* aligned)
     {
-        _aligned_free(aligned);
+        system_aligned_free(aligned);
     }
 
-#elif defined(MANGO_PLATFORM_LINUX)
+    void aligned_free(void* aligned, size_t bytes, Alignment alignment)
+    {
+#if defined(MANGO_ENABLE_MAPPED_ALLOCATION)
+        if (is_mapped_allocation(bytes, alignment))
+        {
+            if (aligned)
+            {
+                mapped_free(aligned, bytes);
+            }
+            return;
+        }
+#else
+        MANGO_UNREFERENCED(bytes);
+        MANGO_UNREFERENCED(alignment);
+#endif
 
-    void* aligned_malloc(size_t bytes, Alignment alignment)
+        system_aligned_free(aligned);
+    }
+
+    void* aligned_realloc(void* aligned, size_t old_bytes, size_t new_bytes, Alignment alignment)
     {
-        return memalign(alignment, bytes);
+#if defined(MANGO_ENABLE_MAPPED_ALLOCATION)
+        const bool remap = aligned &&
+                           is_mapped_allocation(old_bytes, alignment) &&
+                           is_mapped_allocation(new_bytes, alignment) &&
+                           u32(alignment) <= u32(sysconf(_SC_PAGESIZE));
+        if (remap)
+        {
+            void* ptr = mapped_realloc(aligned, old_bytes, new_bytes);
+            if (ptr)
+            {
+                return ptr;
+            }
+        }
+#endif
+
+        void* ptr = aligned_malloc(new_bytes, alignment);
+        if (ptr && aligned)
+        {
+            std::memcpy(ptr, aligned, std::min(old_bytes, new_bytes));
+            aligned_free(aligned, old_bytes, alignment);
+        }
+
+        return ptr;
     }
 
-    void aligned_free(void* aligned)
+
+    // -----------------------------------------------------------------------
+    // VirtualMemory
+    // -----------------------------------------------------------------------
+
+    void VirtualMemory::advise(Advice advice, ConstMemory range) const
     {
-        free(aligned);
+        const u8* begin = m_memory.address;
+        const u8* end = m_memory.address + m_memory.size;
+
+        if (range.address)
+        {
+            begin = std::max(begin, range.address);
+            end = std::min(end, range.address + range.size);
+        }
+
+        if (begin < end)
+        {
+            adviseMemory(ConstMemory(begin, end - begin), advice);
+        }
     }
 
-#else
+    void adviseMemory(ConstMemory range, VirtualMemory::Advice advice)
+    {
+        if (!range.address || !range.size)
+        {
+            return;
+        }
 
-    // generic implementation
+        // the hints are applied to whole pages
+        const uintptr_t mask = uintptr_t(get_page_size() - 1);
+        const uintptr_t begin = uintptr_t(range.address) & ~mask;
+        const uintptr_t end = (uintptr_t(range.address) + range.size + mask) & ~mask;
 
-    void* aligned_malloc(size_t bytes, Alignment alignment)
+        system_advise(reinterpret_cast<u8*>(begin), size_t(end - begin), advice);
+    }
+
+    // -----------------------------------------------------------------------
+    // MemoryArena
+    // -----------------------------------------------------------------------
+
+    MemoryArena::MemoryArena(size_t chunk_size)
+        : m_chunk_size(chunk_size)
     {
-        const size_t mask = u32(alignment) - 1;
-        void* block = std::malloc(bytes + mask + sizeof(void*));
-        char* aligned = reinterpret_cast<char*>(block) + sizeof(void*);
+    }
 
-        if (block)
+    MemoryArena::~MemoryArena()
+    {
+        for (Chunk* chunk = m_head; chunk; )
         {
-            aligned += u32(alignment) - (reinterpret_cast<ptrdiff_t>(aligned) & mask);
-            reinterpret_cast<void**>(aligned)[-1] = block;
+            Chunk* next = chunk->next;
+            if (chunk->tracked)
+            {
+                trackDeallocation(MemoryCategory::SCRATCH, chunk->size);
+            }
+            aligned_free(chunk);
+            chunk = next;
+        }
+    }
+
+    void* MemoryArena::grow(size_t bytes, size_t alignment)
+    {
+        // the chunk data is aligned to MANGO_DEFAULT_ALIGNMENT; only larger alignments need padding
+        const size_t padding = alignment > MANGO_DEFAULT_ALIGNMENT ? alignment : 0;
+        const size_t required = bytes + padding;
+
+        Chunk* chunk = m_current ? m_current->next : m_head;
+
+        if (!chunk || chunk->size < required)
+        {
+            // the chunks are kept in the order they are used; a larger chunk is linked
+            // in front of the next one so that the chain is reused as-is on the next pass
+            const size_t size = std::max(m_chunk_size, required);
+            void* address = aligned_malloc(MANGO_DEFAULT_ALIGNMENT + size, MANGO_DEFAULT_ALIGNMENT);
+            if (!address)
+            {
+                MANGO_EXCEPTION("[MemoryArena] Out of memory.");
+            }
+
+            Chunk* next = chunk;
+            chunk = reinterpret_cast<Chunk*>(address);
+            chunk->next = next;
+            chunk->size = size;
+            chunk->tracked = trackAllocation(MemoryCategory::SCRATCH, size);
+
+            if (m_current)
+            {
+                m_current->next = chunk;
+            }
+            else
+            {
+                m_head = chunk;
+            }
+        }
+
+        m_current = chunk;
+        m_pointer = chunk->data();
+        m_end = m_pointer + chunk->size;
+
+        uintptr_t address = (uintptr_t(m_pointer) + alignment - 1) & ~uintptr_t(alignment - 1);
+        m_pointer = reinterpret_cast<u8*>(address + bytes);
+        return reinterpret_cast<void*>(address);
+    }
+
+    void MemoryArena::reset()
+    {
+        m_current = nullptr;
+        m_pointer = nullptr;
+        m_end = nullptr;
+    }
+
+    void MemoryArena::trim()
+    {
+        Chunk* chunk = m_current ? m_current->next : m_head;
+
+        if (m_current)
+        {
+            m_current->next = nullptr;
         }
         else
         {
-            aligned = nullptr;
+            m_head = nullptr;
         }
 
-        return aligned;
+        while (chunk)
+        {
+            Chunk* next = chunk->next;
+            if (chunk->tracked)
+            {
+                trackDeallocation(MemoryCategory::SCRATCH, chunk->size);
+            }
+            aligned_free(chunk);
+            chunk = next;
+        }
     }
 
-    void aligned_free(void* aligned)
+    size_t MemoryArena::capacity() const
     {
-        if (aligned)
+        size_t bytes = 0;
+
+        for (Chunk* chunk = m_head; chunk; chunk = chunk->next)
         {
-            void* block = reinterpret_cast<void**>(aligned)[-1];
-            std::free(block);
+            bytes += chunk->size;
         }
+
+        return bytes;
     }
 
-#endif
+    MemoryArena& getLocalMemoryArena()
+    {
+        static thread_local MemoryArena arena;
+        return arena;
+    }
 
 } // namespace mango
@@ -2,12 +2,25 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <unordered_map>
 #include <mango/core/thread.hpp>
+#include <mango/core/memory.hpp>
 #include "../../external/concurrentqueue/concurrentqueue.h"
 
-using std::chrono::high_resolution_clock;
-using std::chrono::duration_cast;
+#if !defined(MANGO_PLATFORM_WINDOWS)
+    #include <pthread.h>
+    #include <climits>
+#endif
+
+#if defined(MANGO_ENABLE_FUTEX)
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
 using std::chrono::milliseconds;
 
 // ------------------------------------------------------------
@@ -17,303 +30,2126 @@ using std::chrono::milliseconds;
 #if defined(MANGO_PLATFORM_LINUX) || defined(MANGO_PLATFORM_BSD)
 
 #include <pthread.h>
+#include <sched.h>
 
-    template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    static void set_current_thread_affinity(const std::vector<int>& processors)
     {
         cpu_set_t cpuset;
 
         CPU_ZERO(&cpuset);
-        CPU_SET(processor, &cpuset);
-        pthread_setaffinity_np(handle, sizeof(cpu_set_t), &cpuset);
+        for (int processor : processors)
+        {
+            CPU_SET(processor, &cpuset);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    }
+
+#elif defined(MANGO_PLATFORM_WINDOWS)
+
+    static void set_current_thread_affinity(const std::vector<int>& processors)
+    {
+        DWORD_PTR mask = 0;
+
+        for (int processor : processors)
+        {
+            // NOTE: only the first processor group is supported
+            if (processor < int(sizeof(DWORD_PTR) * 8))
+            {
+                mask |= DWORD_PTR(1) << processor;
+            }
+        }
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+    }
+
+#else
+
+    // TODO: iOS, macOS, Android
+
+    static void set_current_thread_affinity(const std::vector<int>& processors)
+    {
+        MANGO_UNREFERENCED(processors);
+    }
+
+#endif
+
+// ------------------------------------------------------------
+// thread name
+// ------------------------------------------------------------
+
+#if defined(MANGO_PLATFORM_LINUX) || defined(MANGO_PLATFORM_ANDROID)
+
+    static void set_current_thread_name(const std::string& name)
+    {
+        // the name is limited to 16 characters including the terminator
+        pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    }
+
+#elif defined(MANGO_PLATFORM_OSX) || defined(MANGO_PLATFORM_IOS)
+
+    static void set_current_thread_name(const std::string& name)
+    {
+        pthread_setname_np(name.c_str());
+    }
+
+#elif defined(MANGO_PLATFORM_WINDOWS)
+
+    static void set_current_thread_name(const std::string& name)
+    {
+        // SetThreadDescription is available since Windows 10 version 1607
+        using SetThreadDescriptionFunc = HRESULT (WINAPI *)(HANDLE, PCWSTR);
+
+        HMODULE module = GetModuleHandleA("kernel32.dll");
+        auto func = module ? reinterpret_cast<SetThreadDescriptionFunc>(GetProcAddress(module, "SetThreadDescription")) : nullptr;
+        if (func)
+        {
+            std::wstring wide(name.begin(), name.end());
+            func(GetCurrentThread(), wide.c_str());
+        }
+    }
+
+#else
+
+    static void set_current_thread_name(const std::string& name)
+    {
+        MANGO_UNREFERENCED(name);
+    }
+
+#endif
+
+// ------------------------------------------------------------
+// processor topology
+// ------------------------------------------------------------
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+    // parse sysfs cpu list, eg. "0-3,8-11"
+    static std::vector<int> read_processor_list(const std::string& filename)
+    {
+        std::vector<int> processors;
+
+        FILE* file = std::fopen(filename.c_str(), "r");
+        if (file)
+        {
+            int first;
+            while (std::fscanf(file, "%d", &first) == 1)
+            {
+                int last = first;
+                int c = std::fgetc(file);
+                if (c == '-')
+                {
+                    if (std::fscanf(file, "%d", &last) != 1)
+                        break;
+                    c = std::fgetc(file);
+                }
+
+                for (int i = first; i <= last; ++i)
+                {
+                    processors.push_back(i);
+                }
+
+                if (c != ',')
+                    break;
+            }
+
+            std::fclose(file);
+        }
+
+        return processors;
+    }
+
+    static std::vector<int> get_available_processors()
+    {
+        std::vector<int> processors;
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+
+        if (!sched_getaffinity(0, sizeof(cpu_set_t), &cpuset))
+        {
+            for (int i = 0; i < CPU_SETSIZE; ++i)
+            {
+                if (CPU_ISSET(i, &cpuset))
+                {
+                    processors.push_back(i);
+                }
+            }
+        }
+
+        return processors;
+    }
+
+#elif defined(MANGO_PLATFORM_WINDOWS)
+
+    static std::vector<int> get_available_processors()
+    {
+        std::vector<int> processors;
+
+        DWORD_PTR process_mask;
+        DWORD_PTR system_mask;
+
+        if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        {
+            for (int i = 0; i < int(sizeof(DWORD_PTR) * 8); ++i)
+            {
+                if (process_mask & (DWORD_PTR(1) << i))
+                {
+                    processors.push_back(i);
+                }
+            }
+        }
+
+        return processors;
+    }
+
+#else
+
+    static std::vector<int> get_available_processors()
+    {
+        return std::vector<int>();
+    }
+
+#endif
+
+// ------------------------------------------------------------
+// cpu_pause
+// ------------------------------------------------------------
+
+#if defined(MANGO_CPU_INTEL)
+
+    static inline void cpu_pause()
+    {
+        _mm_pause();
+    }
+
+#elif defined(MANGO_CPU_ARM) && (defined(MANGO_COMPILER_GCC) || defined(MANGO_COMPILER_CLANG))
+
+    static inline void cpu_pause()
+    {
+        __asm__ __volatile__("yield");
+    }
+
+#else
+
+    static inline void cpu_pause()
+    {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+
+#endif
+
+namespace mango
+{
+
+    // ------------------------------------------------------------
+    // EventCount
+    // ------------------------------------------------------------
+
+#if defined(MANGO_ENABLE_FUTEX)
+
+    static inline void futex_wait(std::atomic<u32>* address, u32 value)
+    {
+        syscall(SYS_futex, reinterpret_cast<u32*>(address), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+    }
+
+    static inline void futex_wait(std::atomic<u32>* address, u32 value, std::chrono::nanoseconds timeout)
+    {
+        struct timespec ts;
+        ts.tv_sec = time_t(timeout.count() / 1000000000);
+        ts.tv_nsec = long(timeout.count() % 1000000000);
+        syscall(SYS_futex, reinterpret_cast<u32*>(address), FUTEX_WAIT_PRIVATE, value, &ts, nullptr, 0);
+    }
+
+    static inline void futex_wake(std::atomic<u32>* address, int count)
+    {
+        syscall(SYS_futex, reinterpret_cast<u32*>(address), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+#endif
+
+    u32 EventCount::prepareWait()
+    {
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        u32 key = m_epoch.load(std::memory_order_acquire);
+
+        // the caller's re-check must not be reordered before we are visible as a waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return key;
+    }
+
+    void EventCount::cancelWait()
+    {
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+#if defined(MANGO_ENABLE_FUTEX)
+
+    void EventCount::commitWait(u32 key)
+    {
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            futex_wait(&m_epoch, key);
+        }
+
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    bool EventCount::commitWait(u32 key, std::chrono::nanoseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+        bool signaled;
+        for (;;)
+        {
+            signaled = m_epoch.load(std::memory_order_acquire) != key;
+            if (signaled)
+                break;
+
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+                break;
+
+            futex_wait(&m_epoch, key, deadline - now);
+        }
+
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return signaled;
+    }
+
+    void EventCount::notifyOne()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed))
+        {
+            m_epoch.fetch_add(1, std::memory_order_release);
+            futex_wake(&m_epoch, 1);
+        }
+    }
+
+    void EventCount::notifyAll()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed))
+        {
+            m_epoch.fetch_add(1, std::memory_order_release);
+            futex_wake(&m_epoch, std::numeric_limits<int>::max());
+        }
+    }
+
+#else
+
+    void EventCount::commitWait(u32 key)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this, key] {
+            return m_epoch.load(std::memory_order_acquire) != key;
+        });
+
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    bool EventCount::commitWait(u32 key, std::chrono::nanoseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        bool signaled = m_condition.wait_for(lock, timeout, [this, key] {
+            return m_epoch.load(std::memory_order_acquire) != key;
+        });
+
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return signaled;
+    }
+
+    void EventCount::notifyOne()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed))
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_epoch.fetch_add(1, std::memory_order_release);
+            }
+            m_condition.notify_one();
+        }
+    }
+
+    void EventCount::notifyAll()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed))
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_epoch.fetch_add(1, std::memory_order_release);
+            }
+            m_condition.notify_all();
+        }
+    }
+
+#endif
+
+    // ------------------------------------------------------------
+    // acquireLocalObject / discardLocalObject
+    // ------------------------------------------------------------
+
+    // NOTE: The shared caches are intentionally never destroyed; tasks can be released
+    //       from thread-local caches and static ThreadPools during the program shutdown.
+
+    template <typename T>
+    static ObjectCache<T>& getSharedObjectCache()
+    {
+        static ObjectCache<T>* cache = new ObjectCache<T>(256);
+        return *cache;
+    }
+
+    // Set when the first thread-local cache of the exiting thread is destroyed. The flag
+    // is trivially destructible so it stays valid after the caches are gone; objects
+    // released after this point go directly into the depot.
+    static thread_local bool g_local_caches_detached = false;
+
+    template <typename T>
+    struct LocalObjectCache : ObjectCache<T>::Local
+    {
+        LocalObjectCache()
+            : ObjectCache<T>::Local(getSharedObjectCache<T>())
+        {
+        }
+
+        ~LocalObjectCache()
+        {
+            g_local_caches_detached = true;
+        }
+    };
+
+    template <typename T>
+    static typename ObjectCache<T>::Local& getLocalObjectCache()
+    {
+        static thread_local LocalObjectCache<T> cache;
+        return cache;
+    }
+
+    template <typename T>
+    static T* acquireLocalObject()
+    {
+        if (g_local_caches_detached)
+        {
+            return getSharedObjectCache<T>().acquire();
+        }
+
+        return getLocalObjectCache<T>().acquire();
+    }
+
+    template <typename T>
+    static void discardLocalObject(T* object)
+    {
+        if (g_local_caches_detached)
+        {
+            getSharedObjectCache<T>().discard(object);
+            return;
+        }
+
+        getLocalObjectCache<T>().discard(object);
+    }
+
+    // ------------------------------------------------------------
+    // QueueCache
+    // ------------------------------------------------------------
+
+    // The queues are recycled only within their own pool (see QueueList). Each thread keeps
+    // a local front for the few pools it has recently used so that creating a queue is a
+    // thread-local operation in the steady state. The fronts are keyed by the pool id which
+    // is never reused. A front whose pool is gone is dropped without touching it; the
+    // magazines were released together with the pool's cache.
+
+    static std::atomic<u64> g_pool_id { 0 };
+
+    struct QueueCache
+    {
+        using Queue = ThreadPool::Queue;
+        using Local = ObjectCache<Queue>::Local;
+
+        static constexpr int FrontCount = 4;
+
+        struct Registry
+        {
+            std::mutex mutex;
+            std::unordered_map<u64, ObjectCache<Queue>*> caches;
+        };
+
+        struct Front
+        {
+            u64 id = 0; // zero: unused
+            typename std::aligned_storage<sizeof(Local), alignof(Local)>::type storage;
+
+            Local* local()
+            {
+                return reinterpret_cast<Local*>(&storage);
+            }
+        };
+
+        Front m_fronts[FrontCount];
+        int m_next = 0;
+
+        ~QueueCache()
+        {
+            for (Front& front : m_fronts)
+            {
+                detach(front);
+            }
+
+            g_local_caches_detached = true;
+        }
+
+        static Registry& getRegistry()
+        {
+            // NOTE: intentionally never destroyed; see getSharedObjectCache()
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        // the pool's cache is registered for its lifetime
+        static void attach(u64 id, ObjectCache<Queue>* cache)
+        {
+            Registry& registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.caches[id] = cache;
+        }
+
+        static void detach(u64 id)
+        {
+            Registry& registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.caches.erase(id);
+        }
+
+        void detach(Front& front)
+        {
+            if (front.id)
+            {
+                // the lock keeps the pool from deleting its cache while the magazines are released
+                Registry& registry = getRegistry();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+
+                if (registry.caches.count(front.id))
+                {
+                    front.local()->~Local();
+                }
+
+                front.id = 0;
+            }
+        }
+
+        Local& getLocal(u64 id, ObjectCache<Queue>& cache)
+        {
+            for (Front& front : m_fronts)
+            {
+                if (front.id == id)
+                {
+                    return *front.local();
+                }
+            }
+
+            Front& front = m_fronts[m_next];
+            m_next = (m_next + 1) % FrontCount;
+
+            detach(front);
+            new (&front.storage) Local(cache);
+            front.id = id;
+
+            return *front.local();
+        }
+    };
+
+    static thread_local QueueCache g_queue_cache;
+
+namespace detail {
+
+    template <size_t Size>
+    struct TaskStorageBlock
+    {
+        alignas(TaskFunction::InlineAlignment) char data[Size];
+    };
+
+    void* allocateTaskStorage(size_t bytes, size_t alignment)
+    {
+        if (alignment <= TaskFunction::InlineAlignment)
+        {
+            if (bytes <= 32) return acquireLocalObject<TaskStorageBlock<32>>();
+            if (bytes <= 64) return acquireLocalObject<TaskStorageBlock<64>>();
+            if (bytes <= 128) return acquireLocalObject<TaskStorageBlock<128>>();
+            if (bytes <= 256) return acquireLocalObject<TaskStorageBlock<256>>();
+            if (bytes <= 512) return acquireLocalObject<TaskStorageBlock<512>>();
+            if (bytes <= 1024) return acquireLocalObject<TaskStorageBlock<1024>>();
+        }
+
+        // large or over-aligned objects are rare enough to go through the heap
+        return aligned_malloc(bytes, u32(std::max(alignment, sizeof(void*))));
+    }
+
+    void freeTaskStorage(void* address, size_t bytes, size_t alignment)
+    {
+        if (alignment <= TaskFunction::InlineAlignment)
+        {
+            if (bytes <= 32) return discardLocalObject<TaskStorageBlock<32>>(reinterpret_cast<TaskStorageBlock<32>*>(address));
+            if (bytes <= 64) return discardLocalObject<TaskStorageBlock<64>>(reinterpret_cast<TaskStorageBlock<64>*>(address));
+            if (bytes <= 128) return discardLocalObject<TaskStorageBlock<128>>(reinterpret_cast<TaskStorageBlock<128>*>(address));
+            if (bytes <= 256) return discardLocalObject<TaskStorageBlock<256>>(reinterpret_cast<TaskStorageBlock<256>*>(address));
+            if (bytes <= 512) return discardLocalObject<TaskStorageBlock<512>>(reinterpret_cast<TaskStorageBlock<512>*>(address));
+            if (bytes <= 1024) return discardLocalObject<TaskStorageBlock<1024>>(reinterpret_cast<TaskStorageBlock<1024>*>(address));
+        }
+
+        aligned_free(address);
+    }
+
+} // namespace detail
+
+    // ------------------------------------------------------------
+    // TaskDeque
+    // ------------------------------------------------------------
+
+    /*
+        Chase-Lev work-stealing deque. The owning worker pushes and pops tasks
+        at the bottom (LIFO) and the other threads steal from the top (FIFO).
+        The storage is grown by the owner; retired arrays are kept alive until
+        the deque is destroyed as a thief might still be reading from them.
+
+        "Correct and Efficient Work-Stealing for Weak Memory Models"
+        Nhat Minh Le, Antoniu Pop, Albert Cohen, Francesco Zappa Nardelli (PPoPP 2013)
+    */
+
+    class TaskDeque : private NonCopyable
+    {
+    protected:
+        using Task = ThreadPool::Task;
+
+        struct Array
+        {
+            s64 capacity;
+            s64 mask;
+            std::atomic<Task*>* data;
+
+            Array(s64 capacity)
+                : capacity(capacity)
+                , mask(capacity - 1)
+                , data(new std::atomic<Task*>[capacity])
+            {
+            }
+
+            ~Array()
+            {
+                delete[] data;
+            }
+
+            Task* get(s64 index) const
+            {
+                return data[index & mask].load(std::memory_order_relaxed);
+            }
+
+            void put(s64 index, Task* task)
+            {
+                data[index & mask].store(task, std::memory_order_relaxed);
+            }
+        };
+
+        // keep the thief and owner ends in separate cache lines
+        std::atomic<s64> m_top { 0 };
+        char m_padding[64 - sizeof(std::atomic<s64>)];
+        std::atomic<s64> m_bottom { 0 };
+        std::atomic<Array*> m_array;
+        std::vector<Array*> m_retired;
+
+    public:
+        TaskDeque(s64 capacity = 256)
+            : m_array(new Array(capacity))
+        {
+        }
+
+        ~TaskDeque()
+        {
+            delete m_array.load();
+            for (Array* array : m_retired)
+            {
+                delete array;
+            }
+        }
+
+        // owner
+
+        void push(Task* task)
+        {
+            s64 b = m_bottom.load(std::memory_order_relaxed);
+            s64 t = m_top.load(std::memory_order_acquire);
+            Array* array = m_array.load(std::memory_order_relaxed);
+
+            if (b - t > array->capacity - 1)
+            {
+                array = grow(array, t, b);
+            }
+
+            array->put(b, task);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        Task* pop()
+        {
+            s64 b = m_bottom.load(std::memory_order_relaxed) - 1;
+            Array* array = m_array.load(std::memory_order_relaxed);
+            m_bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 t = m_top.load(std::memory_order_relaxed);
+
+            Task* task = nullptr;
+
+            if (t <= b)
+            {
+                task = array->get(b);
+                if (t == b)
+                {
+                    // last task; race against the thieves
+                    if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    {
+                        task = nullptr;
+                    }
+                    m_bottom.store(b + 1, std::memory_order_relaxed);
+                }
+            }
+            else
+            {
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+            }
+
+            return task;
+        }
+
+        // pop the bottom task only if it belongs to the queue
+        Task* pop(const ThreadPool::Queue* queue)
+        {
+            s64 b = m_bottom.load(std::memory_order_relaxed);
+            s64 t = m_top.load(std::memory_order_acquire);
+            if (b <= t)
+            {
+                return nullptr;
+            }
+
+            // the thieves never touch the bottom so the task cannot change under us;
+            // at worst it is the last one and pop() loses it to a thief
+            Array* array = m_array.load(std::memory_order_relaxed);
+            Task* task = array->get(b - 1);
+            if (task->queue != queue)
+            {
+                return nullptr;
+            }
+
+            return pop();
+        }
+
+        // thieves
+
+        Task* steal()
+        {
+            s64 t = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 b = m_bottom.load(std::memory_order_acquire);
+
+            Task* task = nullptr;
+
+            if (t < b)
+            {
+                Array* array = m_array.load(std::memory_order_acquire);
+                task = array->get(t);
+                if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    // lost the race
+                    task = nullptr;
+                }
+            }
+
+            return task;
+        }
+
+        // steal the top task only if it belongs to the queue
+        Task* steal(const ThreadPool::Queue* queue)
+        {
+            s64 t = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 b = m_bottom.load(std::memory_order_acquire);
+
+            Task* task = nullptr;
+
+            if (t < b)
+            {
+                Array* array = m_array.load(std::memory_order_acquire);
+                task = array->get(t);
+
+                // NOTE: the task can be concurrently taken and recycled; the tasks are never
+                //       freed so the read is harmless and a stale read means the CAS will fail
+                if (task->queue != queue)
+                {
+                    return nullptr;
+                }
+
+                if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    task = nullptr;
+                }
+            }
+
+            return task;
+        }
+
+    protected:
+        Array* grow(Array* array, s64 top, s64 bottom)
+        {
+            Array* temp = new Array(array->capacity * 2);
+            for (s64 i = top; i < bottom; ++i)
+            {
+                temp->put(i, array->get(i));
+            }
+
+            m_retired.push_back(array);
+            m_array.store(temp, std::memory_order_release);
+            return temp;
+        }
+    };
+
+    // ------------------------------------------------------------
+    // TaskQueue
+    // ------------------------------------------------------------
+
+    // Tasks enqueued from outside of the worker threads are stored in the queue they
+    // belong to. This way a thread waiting for a queue can find the queue's tasks.
+    struct TaskQueue
+    {
+        using Task = ThreadPool::Task;
+        moodycamel::ConcurrentQueue<Task*> tasks;
+    };
+
+    // Shared lists of queues with injected tasks, one for each priority level.
+    // Every injected task adds one entry; the entry is stale if somebody waiting for
+    // the queue has already taken the task. The queues are recycled only within their
+    // own pool so a stale entry never leads to the tasks of another pool.
+    struct QueueList
+    {
+        using Queue = ThreadPool::Queue;
+        moodycamel::ConcurrentQueue<Queue*> queues;
+    };
+
+    // ------------------------------------------------------------
+    // QueueCounters
+    // ------------------------------------------------------------
+
+    static inline u64 get_time_ns()
+    {
+        auto time = std::chrono::steady_clock::now().time_since_epoch();
+        return u64(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+    }
+
+    struct AtomicHistogram
+    {
+        using Histogram = ThreadPool::Histogram;
+
+        std::atomic<u64> buckets[Histogram::BucketCount];
+        std::atomic<u64> total { 0 };
+
+        AtomicHistogram()
+        {
+            for (auto& bucket : buckets)
+            {
+                bucket = 0;
+            }
+        }
+
+        void add(u64 time)
+        {
+            const int index = time ? std::min(int(u64_index_of_msb(time)), Histogram::BucketCount - 1) : 0;
+            buckets[index].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(time, std::memory_order_relaxed);
+        }
+
+        void get(Histogram& histogram) const
+        {
+            for (int i = 0; i < Histogram::BucketCount; ++i)
+            {
+                histogram.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+                histogram.count += histogram.buckets[i];
+            }
+            histogram.total = total.load(std::memory_order_relaxed);
+        }
+    };
+
+    // telemetry shared by all queues with the same name
+    struct QueueCounters
+    {
+        std::string name;
+        std::atomic<u64> enqueued { 0 };
+        std::atomic<u64> executed_by_workers { 0 };
+        std::atomic<u64> executed_by_waiters { 0 };
+        std::atomic<u64> cancelled { 0 };
+        AtomicHistogram latency;
+        AtomicHistogram runtime;
+    };
+
+    // ------------------------------------------------------------
+    // TaskWorker
+    // ------------------------------------------------------------
+
+    struct TaskWorker
+    {
+        ThreadPool* pool { nullptr };
+        int index { 0 };
+        u32 seed { 0 };
+
+        // parking statistics; written only by the worker thread
+        std::atomic<u64> spins { 0 };
+        std::atomic<u64> parks { 0 };
+        std::atomic<u64> wakes { 0 };
+
+        // time accounting in nanoseconds
+        std::atomic<u64> start_time { 0 };
+        std::atomic<u64> busy_time { 0 };
+        std::atomic<u64> park_time { 0 };
+        std::atomic<u64> park_start { 0 };  // non-zero while parked
+
+        // local tasks, one deque for each priority level
+        TaskDeque deques[3];
+
+#if defined(MANGO_PLATFORM_WINDOWS)
+        HANDLE handle;
+#else
+        pthread_t handle;
+#endif
+
+        void run()
+        {
+            pool->thread(size_t(index));
+        }
+
+        u32 random()
+        {
+            // xorshift32
+            u32 x = seed;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            seed = x;
+            return x;
+        }
+    };
+
+    // worker of the calling thread (nullptr for non-worker threads)
+    static thread_local TaskWorker* g_current_worker = nullptr;
+
+    // ------------------------------------------------------------
+    // worker threads
+    // ------------------------------------------------------------
+
+    // NOTE: std::thread cannot be configured with stack size so the workers are native threads
+
+#if defined(MANGO_PLATFORM_WINDOWS)
+
+    static DWORD WINAPI worker_entry(LPVOID arg)
+    {
+        TaskWorker* worker = reinterpret_cast<TaskWorker*>(arg);
+        worker->run();
+        return 0;
+    }
+
+    static void start_worker(TaskWorker& worker, size_t stack_size)
+    {
+        worker.handle = CreateThread(nullptr, stack_size, worker_entry, &worker, 0, nullptr);
+        if (!worker.handle)
+        {
+            MANGO_EXCEPTION("[ThreadPool] CreateThread() failed.");
+        }
+    }
+
+    static void join_worker(TaskWorker& worker)
+    {
+        WaitForSingleObject(worker.handle, INFINITE);
+        CloseHandle(worker.handle);
+    }
+
+#else
+
+    static void* worker_entry(void* arg)
+    {
+        TaskWorker* worker = reinterpret_cast<TaskWorker*>(arg);
+        worker->run();
+        return nullptr;
+    }
+
+    static void start_worker(TaskWorker& worker, size_t stack_size)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        if (stack_size)
+        {
+            const size_t page_size = 4096;
+            stack_size = std::max(stack_size, size_t(PTHREAD_STACK_MIN));
+            stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+            pthread_attr_setstacksize(&attr, stack_size);
+        }
+
+        int status = pthread_create(&worker.handle, &attr, worker_entry, &worker);
+        pthread_attr_destroy(&attr);
+
+        if (status)
+        {
+            MANGO_EXCEPTION("[ThreadPool] pthread_create() failed (%d).", status);
+        }
+    }
+
+    static void join_worker(TaskWorker& worker)
+    {
+        pthread_join(worker.handle, nullptr);
+    }
+
+#endif
+
+    // ------------------------------------------------------------
+    // ThreadPool
+    // ------------------------------------------------------------
+
+    static ThreadPool::Config get_size_config(size_t size)
+    {
+        ThreadPool::Config config;
+        config.size = size;
+        return config;
+    }
+
+    ThreadPool::ThreadPool(size_t size)
+        : ThreadPool(get_size_config(size))
+    {
+    }
+
+    ThreadPool::ThreadPool(const Config& config)
+        : m_queues(nullptr)
+        , m_queue_cache(nullptr)
+        , m_id(++g_pool_id)
+        , m_workers(nullptr)
+        , m_config(config)
+    {
+        if (!m_config.size)
+        {
+            // NOTE: the processors the process is restricted to (taskset, cgroups) are
+            //       used instead of all processors in the system
+            size_t count = m_config.processors.size();
+            if (!count)
+            {
+                count = get_available_processors().size();
+            }
+
+            if (!count)
+            {
+                count = std::thread::hardware_concurrency();
+            }
+
+            m_config.size = std::max(count, size_t(1));
+        }
+
+        const size_t size = m_config.size;
+
+        setParkingPolicy(m_config.parking);
+        setTelemetry(m_config.telemetry);
+
+        m_queues = new QueueList[3];
+        m_queue_cache = new ObjectCache<Queue>(64);
+        QueueCache::attach(m_id, m_queue_cache);
+        m_workers = new TaskWorker[size];
+        m_static_queue = createQueue("static", int(Priority::NORMAL));
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_workers[i].pool = this;
+            m_workers[i].index = int(i);
+            m_workers[i].seed = u32(i * 0x9e3779b9 + 0x7f4a7c15) | 1;
+        }
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            start_worker(m_workers[i], m_config.stack_size);
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        m_stop = true;
+        m_event.notifyAll();
+
+        const size_t size = m_config.size;
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            join_worker(m_workers[i]);
+        }
+
+        // discard tasks which were never processed
+        for (size_t i = 0; i < size; ++i)
+        {
+            for (int priority = 0; priority < 3; ++priority)
+            {
+                while (Task* task = m_workers[i].deques[priority].pop())
+                {
+                    discardTask(task);
+                }
+            }
+        }
+
+        Task* task;
+        while (m_static_queue->tasks->tasks.try_dequeue(task))
+        {
+            discardTask(task);
+        }
+
+        deleteQueue(m_static_queue);
+        delete[] m_workers;
+        delete[] m_queues;
+
+        QueueCache::detach(m_id);
+        delete m_queue_cache;
+
+        for (QueueCounters* counters : m_counters)
+        {
+            delete counters;
+        }
+    }
+
+    static std::mutex g_instance_mutex;
+    static bool g_instance_created = false;
+
+    static ThreadPool::Config& get_instance_config()
+    {
+        static ThreadPool::Config config;
+        return config;
+    }
+
+    static ThreadPool::Config create_instance_config()
+    {
+        std::lock_guard<std::mutex> lock(g_instance_mutex);
+        g_instance_created = true;
+        return get_instance_config();
+    }
+
+    ThreadPool& ThreadPool::getInstance()
+    {
+        static ThreadPool instance(create_instance_config());
+        return instance;
+    }
+
+    int ThreadPool::getInstanceSize()
+    {
+        ThreadPool& pool = getInstance();
+        return pool.size();
+    }
+
+    void ThreadPool::configureInstance(const Config& config)
+    {
+        std::lock_guard<std::mutex> lock(g_instance_mutex);
+        if (g_instance_created)
+        {
+            MANGO_EXCEPTION("[ThreadPool] The instance is already created.");
+        }
+
+        get_instance_config() = config;
+    }
+
+    std::vector<int> ThreadPool::getProcessors()
+    {
+        std::vector<int> processors = get_available_processors();
+        if (processors.empty())
+        {
+            const int count = std::max(int(std::thread::hardware_concurrency()), 1);
+            for (int i = 0; i < count; ++i)
+            {
+                processors.push_back(i);
+            }
+        }
+
+        return processors;
+    }
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+    // group the available processors by the processor list read for each of them
+    template <typename F>
+    static std::vector<std::vector<int>> get_processor_groups(F get_group)
+    {
+        std::vector<std::vector<int>> groups;
+        std::vector<int> available = ThreadPool::getProcessors();
+
+        for (int processor : available)
+        {
+            std::vector<int> group;
+
+            for (int i : get_group(processor))
+            {
+                if (std::find(available.begin(), available.end(), i) != available.end())
+                {
+                    group.push_back(i);
+                }
+            }
+
+            if (group.empty())
+            {
+                group.push_back(processor);
+            }
+
+            if (std::find(groups.begin(), groups.end(), group) == groups.end())
+            {
+                groups.push_back(group);
+            }
+        }
+
+        return groups;
+    }
+
+    std::vector<std::vector<int>> ThreadPool::getNumaNodes()
+    {
+        return get_processor_groups([] (int processor)
+        {
+            for (int node = 0; ; ++node)
+            {
+                std::string filename = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+
+                FILE* file = std::fopen(filename.c_str(), "r");
+                if (!file)
+                    break;
+                std::fclose(file);
+
+                std::vector<int> processors = read_processor_list(filename);
+                if (std::find(processors.begin(), processors.end(), processor) != processors.end())
+                {
+                    return processors;
+                }
+            }
+
+            return std::vector<int>();
+        });
+    }
+
+    std::vector<std::vector<int>> ThreadPool::getCacheDomains()
+    {
+        return get_processor_groups([] (int processor)
+        {
+            // the processors sharing the last level cache
+            std::vector<int> processors;
+
+            const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(processor) + "/cache/index";
+            for (int index = 0; ; ++index)
+            {
+                std::vector<int> shared = read_processor_list(path + std::to_string(index) + "/shared_cpu_list");
+                if (shared.empty())
+                    break;
+                processors = shared;
+            }
+
+            return processors;
+        });
+    }
+
+#else
+
+    // TODO: topology for other platforms; all processors are in one group
+
+    std::vector<std::vector<int>> ThreadPool::getNumaNodes()
+    {
+        return std::vector<std::vector<int>>(1, getProcessors());
+    }
+
+    std::vector<std::vector<int>> ThreadPool::getCacheDomains()
+    {
+        return std::vector<std::vector<int>>(1, getProcessors());
+    }
+
+#endif
+
+    int ThreadPool::size() const
+    {
+        return int(m_config.size);
+    }
+
+    const ThreadPool::Config& ThreadPool::getConfig() const
+    {
+        return m_config;
+    }
+
+    void ThreadPool::setParkingPolicy(const ParkingPolicy& policy)
+    {
+        m_spin_count = std::max(policy.spin_count, 1u);
+        m_yield_count = policy.yield_count;
+    }
+
+    ThreadPool::ParkingPolicy ThreadPool::getParkingPolicy() const
+    {
+        ParkingPolicy policy;
+        policy.spin_count = m_spin_count;
+        policy.yield_count = m_yield_count;
+        return policy;
+    }
+
+    ThreadPool::Statistics ThreadPool::getStatistics() const
+    {
+        Statistics stats;
+
+        for (int i = 0; i < size(); ++i)
+        {
+            const TaskWorker& worker = m_workers[i];
+            stats.spins += worker.spins.load(std::memory_order_relaxed);
+            stats.parks += worker.parks.load(std::memory_order_relaxed);
+            stats.wakes += worker.wakes.load(std::memory_order_relaxed);
+
+            const u64 start_time = worker.start_time.load(std::memory_order_relaxed);
+            if (start_time)
+            {
+                const u64 time = get_time_ns();
+                const u64 park_start = worker.park_start.load(std::memory_order_relaxed);
+
+                // include the current park episode
+                const u64 busy_time = worker.busy_time.load(std::memory_order_relaxed);
+                const u64 park_time = worker.park_time.load(std::memory_order_relaxed) + (park_start ? time - park_start : 0);
+                const u64 total_time = time - start_time;
+
+                stats.busy_time += busy_time;
+                stats.park_time += park_time;
+                stats.idle_time += total_time - std::min(total_time, busy_time + park_time);
+            }
+        }
+
+        return stats;
+    }
+
+    void ThreadPool::setTelemetry(bool enable)
+    {
+        m_telemetry = enable;
+    }
+
+    QueueCounters* ThreadPool::getQueueCounters(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(m_counters_mutex);
+
+        for (QueueCounters* counters : m_counters)
+        {
+            if (counters->name == name)
+            {
+                return counters;
+            }
+        }
+
+        QueueCounters* counters = new QueueCounters();
+        counters->name = name;
+        m_counters.push_back(counters);
+        return counters;
+    }
+
+    std::vector<ThreadPool::QueueStatistics> ThreadPool::getQueueStatistics() const
+    {
+        std::vector<QueueStatistics> result;
+
+        std::lock_guard<std::mutex> lock(m_counters_mutex);
+
+        for (const QueueCounters* counters : m_counters)
+        {
+            QueueStatistics stats;
+
+            stats.name = counters->name;
+            stats.enqueued = counters->enqueued.load(std::memory_order_relaxed);
+            stats.executed_by_workers = counters->executed_by_workers.load(std::memory_order_relaxed);
+            stats.executed_by_waiters = counters->executed_by_waiters.load(std::memory_order_relaxed);
+            stats.cancelled = counters->cancelled.load(std::memory_order_relaxed);
+            counters->latency.get(stats.latency);
+            counters->runtime.get(stats.runtime);
+
+            result.push_back(stats);
+        }
+
+        return result;
+    }
+
+    void ThreadPool::thread(size_t threadID)
+    {
+        TaskWorker& worker = m_workers[threadID];
+        g_current_worker = &worker;
+
+        const std::vector<int>& processors = m_config.processors;
+        if (!processors.empty())
+        {
+            if (m_config.pin)
+            {
+                set_current_thread_affinity(std::vector<int>(1, processors[threadID % processors.size()]));
+            }
+            else
+            {
+                set_current_thread_affinity(processors);
+            }
+        }
+
+        set_current_thread_name(m_config.name + "." + std::to_string(threadID));
+
+        worker.start_time = get_time_ns();
+
+        // the busy time is always measured; the idle time is derived from it
+        auto execute = [this, &worker] (Task* task)
+        {
+            u64 time0 = get_time_ns();
+            process(task, false);
+            u64 time1 = get_time_ns();
+            worker.busy_time.fetch_add(time1 - time0, std::memory_order_relaxed);
+        };
+
+        // adaptive spin budget; grows when spinning finds work and shrinks
+        // when the worker had to be parked anyway
+        u32 spin_limit = m_spin_count;
+
+        while (!m_stop.load(std::memory_order_relaxed))
+        {
+            Task* task = dequeue(&worker);
+            if (task)
+            {
+                execute(task);
+                continue;
+            }
+
+            worker.spins.fetch_add(1, std::memory_order_relaxed);
+
+            const u32 spin_count = std::min(spin_limit, m_spin_count.load(std::memory_order_relaxed));
+            const u32 yield_count = m_yield_count.load(std::memory_order_relaxed);
+
+            for (u32 i = 0; !task && i < spin_count; ++i)
+            {
+                for (int j = 0; j < 16; ++j)
+                {
+                    cpu_pause();
+                }
+                task = dequeue(&worker);
+            }
+
+            for (u32 i = 0; !task && i < yield_count; ++i)
+            {
+                std::this_thread::yield();
+                task = dequeue(&worker);
+            }
+
+            if (task)
+            {
+                spin_limit = std::min(spin_limit * 2, m_spin_count.load(std::memory_order_relaxed));
+                execute(task);
+                continue;
+            }
+
+            // park the worker until there is more work
+            u32 key = m_event.prepareWait();
+
+            task = dequeue(&worker);
+            if (task || m_stop.load(std::memory_order_relaxed))
+            {
+                m_event.cancelWait();
+                if (task)
+                {
+                    execute(task);
+                }
+                continue;
+            }
+
+            worker.parks.fetch_add(1, std::memory_order_relaxed);
+            u64 time0 = get_time_ns();
+            worker.park_start.store(time0, std::memory_order_relaxed);
+            m_event.commitWait(key);
+            u64 time1 = get_time_ns();
+            worker.park_time.fetch_add(time1 - time0, std::memory_order_relaxed);
+            worker.park_start.store(0, std::memory_order_relaxed);
+            worker.wakes.fetch_add(1, std::memory_order_relaxed);
+
+            spin_limit = std::max(spin_limit / 2, 1u);
+        }
+
+        g_current_worker = nullptr;
+    }
+
+    TaskWorker* ThreadPool::getCurrentWorker() const
+    {
+        TaskWorker* worker = g_current_worker;
+        if (worker && worker->pool != this)
+        {
+            // worker thread of some other pool
+            worker = nullptr;
+        }
+        return worker;
+    }
+
+    ThreadPool::Task* ThreadPool::acquireTask()
+    {
+        return acquireLocalObject<Task>();
+    }
+
+    void ThreadPool::discardTask(Task* task)
+    {
+        // release the callable's resources before recycling the task
+        task->func.reset();
+        discardLocalObject<Task>(task);
+    }
+
+    void ThreadPool::enqueue(Queue* queue, TaskFunction&& func)
+    {
+        Task* task = acquireTask();
+        task->queue = queue;
+        task->stamp = queue->task_input_count++;
+        task->func = std::move(func);
+
+        if (queue->counters)
+        {
+            task->time = get_time_ns();
+            queue->counters->enqueued.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        TaskWorker* worker = getCurrentWorker();
+        if (worker)
+        {
+            // nested enqueue from a task; keep the work local and cache-hot
+            worker->deques[queue->priority].push(task);
+        }
+        else
+        {
+            queue->tasks->tasks.enqueue(task);
+            m_queues[queue->priority].queues.enqueue(queue);
+        }
+
+        m_event.notifyOne();
+
+        // threads waiting for the queue can help with the new task
+        queue->event.notifyAll();
+    }
+
+    ThreadPool::Task* ThreadPool::steal(TaskWorker* worker, int priority, const Queue* queue)
+    {
+        const int count = size();
+
+        u32 start;
+        if (worker)
+        {
+            start = worker->random();
+        }
+        else
+        {
+            static thread_local u32 seed = u32(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            start = seed;
+        }
+
+        // visit the victims in randomized order to spread the contention
+        for (int i = 0; i < count; ++i)
+        {
+            TaskWorker& victim = m_workers[(start + i) % count];
+            if (&victim != worker)
+            {
+                TaskDeque& deque = victim.deques[priority];
+                Task* task = queue ? deque.steal(queue) : deque.steal();
+                if (task)
+                {
+                    return task;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    ThreadPool::Task* ThreadPool::dequeue(TaskWorker* worker)
+    {
+        // scan task queues in priority order
+        for (int priority = 0; priority < 3; ++priority)
+        {
+            Task* task = nullptr;
+
+            if (worker)
+            {
+                task = worker->deques[priority].pop();
+                if (task)
+                {
+                    return task;
+                }
+            }
+
+            // skip the stale entries; their tasks were taken by waiting threads
+            Queue* queue;
+            while (m_queues[priority].queues.try_dequeue(queue))
+            {
+                if (queue->tasks->tasks.try_dequeue(task))
+                {
+                    return task;
+                }
+            }
+
+            task = steal(worker, priority, nullptr);
+            if (task)
+            {
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    ThreadPool::Task* ThreadPool::dequeue(TaskWorker* worker, const Queue* queue)
+    {
+        Task* task = nullptr;
+
+        // nested tasks enqueued by the waiting worker itself
+        if (worker)
+        {
+            task = worker->deques[queue->priority].pop(queue);
+            if (task)
+            {
+                return task;
+            }
+        }
+
+        // tasks injected from outside of the pool
+        if (queue->tasks->tasks.try_dequeue(task))
+        {
+            return task;
+        }
+
+        // the queue's tasks which are next in line in the other workers
+        return steal(worker, queue->priority, queue);
+    }
+
+    void ThreadPool::process(Task* task, bool waiter)
+    {
+        Queue* queue = task->queue;
+        QueueCounters* counters = queue->counters;
+
+        // check if the task is cancelled
+        if (task->stamp > queue->stamp_cancel)
+        {
+            // scratch memory left in the local arena by the task is reclaimed
+            MemoryArena::Scope scope(getLocalMemoryArena());
+
+            if (counters)
+            {
+                u64 time0 = get_time_ns();
+                counters->latency.add(time0 - task->time);
+
+                // process task
+                task->func();
+
+                u64 time1 = get_time_ns();
+                counters->runtime.add(time1 - time0);
+
+                auto& executed = waiter ? counters->executed_by_waiters : counters->executed_by_workers;
+                executed.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                // process task
+                task->func();
+            }
+        }
+        else if (counters)
+        {
+            counters->cancelled.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        discardTask(task);
+
+        int complete = ++queue->task_complete_count;
+        if (complete == queue->task_input_count.load())
+        {
+            // NOTE: the queue can be already recycled if the waiter saw the last completion
+            //       before the notification; this only causes a spurious wakeup
+            queue->event.notifyAll();
+        }
+    }
+
+    bool ThreadPool::dequeue_and_process()
+    {
+        Task* task = dequeue(getCurrentWorker());
+        if (task)
+        {
+            process(task, true);
+            return true;
+        }
+
+        return false;
+    }
+
+    void ThreadPool::wait(Queue* queue)
+    {
+        wait(queue, nullptr);
+    }
+
+    bool ThreadPool::wait_for(Queue* queue, std::chrono::nanoseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        return wait(queue, &deadline);
+    }
+
+    bool ThreadPool::wait(Queue* queue, const std::chrono::steady_clock::time_point* deadline)
+    {
+        TaskWorker* worker = getCurrentWorker();
+
+        // Help only with the queue's own tasks. Picking up any other task could block
+        // the waiting thread for an unbounded time with unrelated (lower priority) work.
+        // Tasks which wait for their own (child) queues help those the same way. The only
+        // exception are the nested tasks in the waiting worker's own deque in a single
+        // worker pool. A timed wait does not help at all; the duration of a task is not
+        // known so running one could overrun the deadline.
+        while (!queue->empty())
+        {
+            if (!deadline)
+            {
+                Task* task = dequeue(worker, queue);
+                if (task)
+                {
+                    process(task, true);
+                    continue;
+                }
+
+                if (worker && size() == 1)
+                {
+                    // The queue's tasks can be buried under nested tasks of other queues in
+                    // our own deque where no thief can reach them; run the local tasks before
+                    // parking. With more workers the thieves drain the deque.
+                    task = worker->deques[queue->priority].pop();
+                    if (task)
+                    {
+                        process(task, true);
+                        continue;
+                    }
+                }
+            }
+
+            // park until the queue is drained or receives new tasks
+            u32 key = queue->event.prepareWait();
+
+            if (queue->empty())
+            {
+                queue->event.cancelWait();
+                break;
+            }
+
+            if (deadline)
+            {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= *deadline || !queue->event.commitWait(key, *deadline - now))
+                {
+                    return queue->empty();
+                }
+                continue;
+            }
+
+            Task* task = dequeue(worker, queue);
+            if (task)
+            {
+                queue->event.cancelWait();
+                process(task, true);
+                continue;
+            }
+
+            queue->event.commitWait(key);
+        }
+
+        return true;
+    }
+
+    void ThreadPool::cancel(Queue* queue)
+    {
+        queue->stamp_cancel = queue->task_input_count.load() - 1;
+    }
+
+    ThreadPool::Queue::~Queue()
+    {
+        delete tasks;
+    }
+
+    ThreadPool::Queue* ThreadPool::createQueue(const std::string& name, int priority)
+    {
+        Queue* queue;
+
+        if (g_local_caches_detached)
+        {
+            queue = m_queue_cache->acquire();
+        }
+        else
+        {
+            queue = g_queue_cache.getLocal(m_id, *m_queue_cache).acquire();
+        }
+
+        if (!queue->tasks)
+        {
+            // the storage is kept when the queue is recycled
+            queue->tasks = new TaskQueue();
+        }
+
+        queue->pool = this;
+        queue->priority = priority;
+        queue->task_input_count = 0;
+        queue->task_complete_count = 0;
+        queue->stamp_cancel = -1;
+        queue->name = name;
+        queue->counters = nullptr;
+
+        if (m_telemetry.load(std::memory_order_relaxed))
+        {
+            queue->counters = getQueueCounters(name);
+        }
+
+        return queue;
     }
 
-    static void set_current_thread_affinity(int processor)
+    void ThreadPool::deleteQueue(Queue* queue)
     {
-        set_thread_affinity(pthread_self(), processor);
+        if (g_local_caches_detached)
+        {
+            m_queue_cache->discard(queue);
+            return;
+        }
+
+        g_queue_cache.getLocal(m_id, *m_queue_cache).discard(queue);
     }
 
-#elif defined(MANGO_PLATFORM_WINDOWS)
+    // ------------------------------------------------------------
+    // ConcurrentQueue
+    // ------------------------------------------------------------
 
-    template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    ConcurrentQueue::ConcurrentQueue()
+        : m_pool(ThreadPool::getInstance())
     {
-        SetThreadAffinityMask(handle, DWORD_PTR(1) << processor);
+        m_queue = m_pool.createQueue("concurrent.default", int(Priority::NORMAL));
     }
 
-    static void set_current_thread_affinity(int processor)
+    ConcurrentQueue::ConcurrentQueue(const std::string& name, Priority priority)
+        : m_pool(ThreadPool::getInstance())
     {
-        set_thread_affinity(GetCurrentThread(), processor);
+        m_queue = m_pool.createQueue(name, int(priority));
     }
 
-#else
-
-    // TODO: iOS, macOS, Android
-
-    template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    ConcurrentQueue::ConcurrentQueue(ThreadPool& pool, const std::string& name, Priority priority)
+        : m_pool(pool)
     {
-        MANGO_UNREFERENCED(handle);
-        MANGO_UNREFERENCED(processor);
+        m_queue = m_pool.createQueue(name, int(priority));
     }
 
-    static void set_current_thread_affinity(int processor)
+    ConcurrentQueue::~ConcurrentQueue()
     {
-        MANGO_UNREFERENCED(processor);
+        wait();
+        m_pool.deleteQueue(m_queue);
     }
 
-#endif
-
-// MinGW usually uses winpthreads as std::thread backend, so we need
-// to convert winpthreads' pthread_t to Win32 HANDLE.
-#if defined(__WINPTHREADS_VERSION)
-
-#include <pthread.h>
-
-    static auto get_native_handle(std::thread& t)
+    void ConcurrentQueue::steal()
     {
-        // Note: this function is documented as private.
-        return pthread_gethandle(t.native_handle());
+        m_pool.dequeue_and_process();
     }
 
-#else
-
-    static auto get_native_handle(std::thread& t)
+    void ConcurrentQueue::cancel()
     {
-        return t.native_handle();
+        m_pool.cancel(m_queue);
     }
 
-#endif
-
-namespace mango
-{
-
-    // ------------------------------------------------------------
-    // TaskQueue
-    // ------------------------------------------------------------
+    void ConcurrentQueue::wait()
+    {
+        m_pool.wait(m_queue);
+    }
 
-    struct TaskQueue
+    bool ConcurrentQueue::wait_for(std::chrono::nanoseconds timeout)
     {
-        using Task = ThreadPool::Task;
-        moodycamel::ConcurrentQueue<Task> tasks;
-    };
+        return m_pool.wait_for(m_queue, timeout);
+    }
 
     // ------------------------------------------------------------
-    // ThreadPool
+    // TaskNode
     // ------------------------------------------------------------
 
-    ThreadPool::ThreadPool(size_t size)
-        : m_queue_cache(32)
-        , m_queues(nullptr)
-        , m_threads(size)
-    {
-        m_queues = new TaskQueue[3];
-        m_static_queue = createQueue("static", int(Priority::NORMAL));
-
-        // NOTE: let OS scheduler shuffle tasks as it sees fit
-        //       this gives better performance overall UNTIL we have some practical
-        //       use for the affinity (eg. dependent tasks using same cache)
-        const bool affinity = false;//std::thread::hardware_concurrency() > 1;
-		if (affinity)
-        {
-            set_current_thread_affinity(0);
-        }
+namespace detail {
 
-        for (size_t i = 0; i < size; ++i)
-        {
-            m_threads[i] = std::thread([this, i]
-            {
-                thread(i);
-            });
+    // successor list marker: the node has been executed
+    static const uintptr_t g_resolved_list = 1;
 
-			if (affinity)
-            {
-                set_thread_affinity(get_native_handle(m_threads[i]), int(i + 1));
-            }
-        }
+    TaskNode::TaskNode(Queue* queue)
+        : m_queue(queue)
+    {
     }
 
-    ThreadPool::~ThreadPool()
+    TaskNode::~TaskNode()
     {
-        m_stop = true;
-        m_condition.notify_all();
+        Link* head = m_successors.load(std::memory_order_acquire);
+        if (reinterpret_cast<uintptr_t>(head) == g_resolved_list)
+            return;
 
-        for (auto& thread : m_threads)
+        // the node was never executed (cancelled or not submitted)
+        while (head)
         {
-            thread.join();
+            Link* next = head->next;
+            freeTaskStorage(head, sizeof(Link), alignof(Link));
+            head = next;
         }
-
-        deleteQueue(m_static_queue);
-        delete[] m_queues;
-    }
-
-    ThreadPool& ThreadPool::getInstance()
-    {
-        static ThreadPool instance(std::max(std::thread::hardware_concurrency() - 0, 1U));
-        return instance;
     }
 
-    int ThreadPool::getInstanceSize()
+    TaskNode::Queue* TaskNode::getDefaultQueue()
     {
-        ThreadPool& pool = getInstance();
-        return pool.size();
+        return ThreadPool::getInstance().m_static_queue;
     }
 
-    int ThreadPool::size() const
+    void TaskNode::precede(TaskNode* successor)
     {
-        return int(m_threads.size());
-    }
+        successor->m_blocking.fetch_add(1, std::memory_order_relaxed);
 
-    void ThreadPool::thread(size_t threadID)
-    {
-        auto time0 = high_resolution_clock::now();
+        void* address = allocateTaskStorage(sizeof(Link), alignof(Link));
+        Link* link = new (address) Link { successor, nullptr };
 
-        while (!m_stop.load(std::memory_order_relaxed))
+        Link* head = m_successors.load(std::memory_order_acquire);
+        do
         {
-            if (dequeue_and_process())
-            {
-                // remember the last time we processed a task
-                time0 = high_resolution_clock::now();
-            }
-            else
+            if (reinterpret_cast<uintptr_t>(head) == g_resolved_list)
             {
-                // don't be too eager to sleep
-                auto time1 = high_resolution_clock::now();
-                auto elapsed = duration_cast<milliseconds>(time1 - time0).count();
-                if (elapsed >= milliseconds(2).count())
-                {
-                    // sleep but check what's happening after a while unless signaled
-                    ++m_sleep_count;
-                    std::unique_lock<std::mutex> lock(m_queue_mutex);
-                    m_condition.wait_for(lock, milliseconds(200));
-                    --m_sleep_count;
-                }
-                else
-                {
-                    // no work; yield and try again soon
-                    std::this_thread::yield();
-                }
+                // we are already done; the successor is not blocked by us
+                freeTaskStorage(link, sizeof(Link), alignof(Link));
+                successor->unblock();
+                return;
             }
-        }
-    }
-
-    void ThreadPool::enqueue(Queue* queue, std::function<void()>&& func)
-    {
-        Task task;
-        task.queue = queue;
-        task.stamp = queue->task_input_count++;
-        task.func = std::move(func);
 
-        m_queues[queue->priority].tasks.enqueue(std::move(task));
-
-        if (m_sleep_count > 0)
-        {
-            m_condition.notify_one();
-        }
+            link->next = head;
+        } while (!m_successors.compare_exchange_weak(head, link, std::memory_order_acq_rel, std::memory_order_acquire));
     }
 
-    bool ThreadPool::dequeue_and_process()
+    void TaskNode::unblock()
     {
-        // scan task queues in priority order
-        for (size_t priority = 0; priority < 3; ++priority)
+        if (m_blocking.fetch_sub(1, std::memory_order_acq_rel) == 1)
         {
-            Task task;
-            if (m_queues[priority].tasks.try_dequeue(task))
-            {
-                Queue* queue = task.queue;
-
-                // check if the task is cancelled
-                if (task.stamp > queue->stamp_cancel)
-                {
-                    // process task
-                    task.func();
-                }
-
-                ++queue->task_complete_count;
-                return true;
-            }
+            schedule();
         }
-
-        return false;
     }
 
-    void ThreadPool::wait(Queue* queue)
+    bool TaskNode::done() const
     {
-        // NOTE: we might be waiting here a while if other threads keep enqueuing tasks
-        while (queue->task_complete_count < queue->task_input_count)
-        {
-            if (!dequeue_and_process())
-            {
-                std::this_thread::yield();
-            }
-        }
+        Link* head = m_successors.load(std::memory_order_acquire);
+        return reinterpret_cast<uintptr_t>(head) == g_resolved_list;
     }
 
-    void ThreadPool::cancel(Queue* queue)
+    void TaskNode::schedule()
     {
-        queue->stamp_cancel = queue->task_input_count.load() - 1;
+        ThreadPool* pool = m_queue->pool;
+        pool->enqueue(m_queue, TaskFunction([this] {
+            execute();
+        }));
     }
 
-    ThreadPool::Queue* ThreadPool::createQueue(const std::string& name, int priority)
+    void TaskNode::resolve()
     {
-        Queue* queue = m_queue_cache.acquire();
-
-        queue->pool = this;
-        queue->priority = priority;
-        queue->task_input_count = 0;
-        queue->task_complete_count = 0;
-        queue->stamp_cancel = -1;
-        queue->name = name;
+        // close the list so that late precede() calls see the node as done
+        Link* resolved = reinterpret_cast<Link*>(g_resolved_list);
+        Link* head = m_successors.exchange(resolved, std::memory_order_acq_rel);
 
-        return queue;
+        // the successors are enqueued from the current worker; they will
+        // most likely be executed next in the same thread
+        while (head)
+        {
+            Link* next = head->next;
+            TaskNode* node = head->node;
+            freeTaskStorage(head, sizeof(Link), alignof(Link));
+            node->unblock();
+            head = next;
+        }
     }
 
-    void ThreadPool::deleteQueue(Queue* queue)
+    void TaskNode::execute()
     {
-        m_queue_cache.discard(queue);
+        m_function();
+        m_function.reset();
+        resolve();
     }
 
+} // namespace detail
+
     // ------------------------------------------------------------
-    // ConcurrentQueue
+    // TaskGraph
     // ------------------------------------------------------------
 
-    ConcurrentQueue::ConcurrentQueue()
+    TaskGraph::TaskGraph()
         : m_pool(ThreadPool::getInstance())
     {
-        m_queue = m_pool.createQueue("concurrent.default", int(Priority::NORMAL));
+        m_queue = m_pool.createQueue("graph.default", int(Priority::NORMAL));
     }
 
-    ConcurrentQueue::ConcurrentQueue(const std::string& name, Priority priority)
+    TaskGraph::TaskGraph(const std::string& name, Priority priority)
         : m_pool(ThreadPool::getInstance())
     {
         m_queue = m_pool.createQueue(name, int(priority));
     }
 
-    ConcurrentQueue::~ConcurrentQueue()
+    TaskGraph::TaskGraph(ThreadPool& pool, const std::string& name, Priority priority)
+        : m_pool(pool)
+    {
+        m_queue = m_pool.createQueue(name, int(priority));
+    }
+
+    TaskGraph::~TaskGraph()
     {
         wait();
+
+        for (detail::TaskNode* node : m_nodes)
+        {
+            node->~TaskNode();
+            detail::freeTaskStorage(node, sizeof(detail::TaskNode), alignof(detail::TaskNode));
+        }
+
         m_pool.deleteQueue(m_queue);
     }
 
-    void ConcurrentQueue::steal()
+    detail::TaskNode* TaskGraph::createNode()
     {
-        m_pool.dequeue_and_process();
+        void* address = detail::allocateTaskStorage(sizeof(detail::TaskNode), alignof(detail::TaskNode));
+        detail::TaskNode* node = new (address) detail::TaskNode(m_queue);
+        m_nodes.push_back(node);
+        return node;
     }
 
-    void ConcurrentQueue::cancel()
+    void TaskGraph::submit()
+    {
+        const size_t count = m_nodes.size();
+
+        // the nodes without pending predecessors are enqueued immediately
+        for (size_t i = m_submitted; i < count; ++i)
+        {
+            m_nodes[i]->unblock();
+        }
+
+        m_submitted = count;
+    }
+
+    void TaskGraph::cancel()
     {
+        // the successors of cancelled nodes are never scheduled
         m_pool.cancel(m_queue);
     }
 
-    void ConcurrentQueue::wait()
+    void TaskGraph::wait()
     {
         m_pool.wait(m_queue);
     }
 
+    bool TaskGraph::wait_for(std::chrono::nanoseconds timeout)
+    {
+        return m_pool.wait_for(m_queue, timeout);
+    }
+
+    // ------------------------------------------------------------
+    // parallel
+    // ------------------------------------------------------------
+
+namespace detail {
+
+    // the elements are timed until the sample is long enough to be reliable
+    static const std::chrono::nanoseconds g_parallel_sample_time = std::chrono::microseconds(20);
+
+    // target run time of one chunk; large enough to amortize the scheduling cost
+    static const double g_parallel_chunk_time = 50000.0;
+
+    void parallel(ParallelRange& range, int begin, int end, int grain)
+    {
+        if (begin >= end)
+            return;
+
+        ThreadPool& pool = ThreadPool::getInstance();
+        const int threads = int(pool.size());
+
+        int first = begin;
+        int chunk = grain;
+
+        if (grain <= 0)
+        {
+            // execute exponentially growing pieces until we have a usable measurement
+            auto start = std::chrono::steady_clock::now();
+            std::chrono::nanoseconds elapsed;
+
+            for (int count = 1; ; count *= 2)
+            {
+                int last = first + std::min(count, end - first);
+                range.process(0, first, last);
+                first = last;
+
+                if (first == end)
+                {
+                    range.prepare(0);
+                    return;
+                }
+
+                elapsed = std::chrono::steady_clock::now() - start;
+                if (elapsed >= g_parallel_sample_time)
+                    break;
+            }
+
+            const double cost = double(elapsed.count()) / double(first - begin);
+            const int remaining = end - first;
+
+            if (threads < 2 || cost * remaining < g_parallel_chunk_time * 2)
+            {
+                // not worth the scheduling overhead
+                range.process(0, first, end);
+                range.prepare(0);
+                return;
+            }
+
+            // large enough chunks for low overhead but at least one chunk per thread
+            chunk = int(std::min(g_parallel_chunk_time / cost, double(remaining)));
+            chunk = std::max(1, std::min(chunk, (remaining + threads - 1) / threads));
+        }
+        else if (threads < 2 || end - begin <= grain)
+        {
+            range.process(0, begin, end);
+            range.prepare(0);
+            return;
+        }
+
+        const int count = (end - first + chunk - 1) / chunk;
+        range.prepare(count);
+
+        // the chunks are claimed dynamically so that only one task per thread is needed
+        std::atomic<int> next { 0 };
+
+        auto work = [&range, &next, first, end, chunk, count]
+        {
+            for (;;)
+            {
+                int index = next.fetch_add(1, std::memory_order_relaxed);
+                if (index >= count)
+                    break;
+
+                int a = first + index * chunk;
+                int b = std::min(a + chunk, end);
+                range.process(index + 1, a, b);
+            }
+        };
+
+        ConcurrentQueue queue("parallel", Priority::HIGH);
+
+        const int helpers = std::min(threads, count) - 1;
+        for (int i = 0; i < helpers; ++i)
+        {
+            queue.enqueue(work);
+        }
+
+        work();
+        queue.wait();
+    }
+
+} // namespace detail
+
     // ------------------------------------------------------------
     // SerialQueue
     // ------------------------------------------------------------
 
+    struct SerialQueue::StrandNode
+    {
+        std::atomic<StrandNode*> next { nullptr };
+        u32 sequence { 0 };
+        TaskFunction func;
+    };
+
+    // the number of tasks executed before the strand yields the worker
+    static const int g_strand_batch_size = 64;
+
     SerialQueue::SerialQueue()
         : m_name("serial.default")
     {
@@ -330,10 +2166,29 @@ namespace mango
         });
     }
 
+    SerialQueue::SerialQueue(ThreadPool& pool, const std::string& name, Priority priority)
+        : m_name(name)
+        , m_pool(&pool)
+    {
+        m_strand_queue = pool.createQueue(name, int(priority));
+
+        m_strand_stub = acquireLocalObject<StrandNode>();
+        m_strand_stub->next = nullptr;
+        m_strand_head = m_strand_stub;
+        m_strand_tail = m_strand_stub;
+    }
+
     SerialQueue::~SerialQueue()
     {
         wait();
 
+        if (m_pool)
+        {
+            discardLocalObject<StrandNode>(m_strand_stub);
+            m_pool->deleteQueue(m_strand_queue);
+            return;
+        }
+
         m_stop = true;
         m_condition.notify_one();
         m_thread.join();
@@ -360,8 +2215,111 @@ namespace mango
         }
     }
 
+    void SerialQueue::submit(TaskFunction&& func)
+    {
+        StrandNode* node = acquireLocalObject<StrandNode>();
+        node->sequence = ++m_strand_sequence;
+        node->func = std::move(func);
+        push(node);
+
+        // the first pending task starts the strand in the ThreadPool; it stays active
+        // until there are no more tasks so that only one task is executed at a time
+        if (m_task_counter.fetch_add(1, std::memory_order_acq_rel) == 0)
+        {
+            m_pool->enqueue(m_strand_queue, TaskFunction([this] {
+                drain();
+            }));
+        }
+    }
+
+    void SerialQueue::push(StrandNode* node)
+    {
+        // Vyukov's intrusive MPSC queue
+        node->next.store(nullptr, std::memory_order_relaxed);
+        StrandNode* prev = m_strand_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    SerialQueue::StrandNode* SerialQueue::pop()
+    {
+        StrandNode* tail = m_strand_tail;
+        StrandNode* next = tail->next.load(std::memory_order_acquire);
+
+        if (tail == m_strand_stub)
+        {
+            if (!next)
+                return nullptr;
+
+            m_strand_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next)
+        {
+            m_strand_tail = next;
+            return tail;
+        }
+
+        if (tail != m_strand_head.load(std::memory_order_acquire))
+        {
+            // a producer has not linked the node yet
+            return nullptr;
+        }
+
+        push(m_strand_stub);
+
+        next = tail->next.load(std::memory_order_acquire);
+        if (next)
+        {
+            m_strand_tail = next;
+            return tail;
+        }
+
+        return nullptr;
+    }
+
+    void SerialQueue::drain()
+    {
+        for (int i = 0; i < g_strand_batch_size; ++i)
+        {
+            StrandNode* node;
+            while (!(node = pop()))
+            {
+                // the task is counted so it will be linked momentarily
+                cpu_pause();
+            }
+
+            if (node->sequence > m_strand_cancel.load(std::memory_order_relaxed))
+            {
+                node->func();
+            }
+
+            node->func.reset();
+            discardLocalObject<StrandNode>(node);
+
+            if (m_task_counter.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                // no more tasks; the next submit() restarts the strand
+                return;
+            }
+        }
+
+        // let the worker process other work between the batches
+        m_pool->enqueue(m_strand_queue, TaskFunction([this] {
+            drain();
+        }));
+    }
+
     void SerialQueue::cancel()
     {
+        if (m_pool)
+        {
+            // the pending tasks are discarded when the strand reaches them
+            m_strand_cancel = m_strand_sequence.load();
+            return;
+        }
+
         std::unique_lock<std::mutex> queue_lock(m_queue_mutex);
         m_task_counter -= u32(m_task_queue.size());
         m_task_queue.clear();
@@ -369,6 +2327,16 @@ namespace mango
 
     void SerialQueue::wait()
     {
+        if (m_pool)
+        {
+            // help the strand; the tasks are still executed one at a time
+            while (m_task_counter.load(std::memory_order_acquire))
+            {
+                m_pool->wait(m_strand_queue);
+            }
+            return;
+        }
+
         for (;;)
         {
             if (!m_task_counter.load(std::memory_order_relaxed))
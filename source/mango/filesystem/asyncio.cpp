@@ -0,0 +1,777 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstring>
+#include <mango/core/string.hpp>
+#include <mango/core/thread.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/filesystem/asyncio.hpp>
+
+#if !defined(MANGO_PLATFORM_WINDOWS)
+
+    #include <cerrno>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+
+    #if defined(MANGO_PLATFORM_LINUX) && defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #include <sys/mman.h>
+            #include <sys/syscall.h>
+            #include <linux/io_uring.h>
+            #if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+                #define MANGO_ENABLE_IO_URING
+            #endif
+        #endif
+    #endif
+
+#endif
+
+namespace
+{
+    using namespace mango;
+    using namespace mango::filesystem;
+
+    struct AsyncRequest
+    {
+        AsyncIO::Callback callback;
+        const AsyncFileHandle* file;
+        u64 offset;
+        u8* address;
+        size_t size;
+        bool write;
+        s64 result;
+    };
+
+} // namespace
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // AsyncFileHandle
+    // -----------------------------------------------------------------
+
+#if defined(MANGO_PLATFORM_WINDOWS)
+
+    struct AsyncFileHandle
+    {
+        std::string m_filename;
+        HANDLE m_handle;
+
+        AsyncFileHandle(const std::string& filename, Stream::OpenMode mode)
+            : m_filename(filename)
+        {
+            DWORD access = mode == Stream::READ ? GENERIC_READ : GENERIC_WRITE;
+            DWORD disposition = mode == Stream::READ ? OPEN_EXISTING : CREATE_ALWAYS;
+
+            m_handle = CreateFileW(u16_fromBytes(filename).c_str(), access, FILE_SHARE_READ, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (m_handle == INVALID_HANDLE_VALUE)
+            {
+                MANGO_EXCEPTION("[AsyncFile] CreateFileW() failed.");
+            }
+        }
+
+        ~AsyncFileHandle()
+        {
+            CloseHandle(m_handle);
+        }
+
+        u64 size() const
+        {
+            LARGE_INTEGER integer;
+            BOOL status = GetFileSizeEx(m_handle, &integer);
+            return status ? u64(integer.QuadPart) : 0;
+        }
+
+        s64 transfer(const AsyncRequest& request) const
+        {
+            size_t total = 0;
+
+            while (total < request.size)
+            {
+                const u64 offset = request.offset + total;
+
+                OVERLAPPED overlapped = { 0 };
+                overlapped.Offset = DWORD(offset);
+                overlapped.OffsetHigh = DWORD(offset >> 32);
+
+                DWORD bytes = DWORD(std::min(request.size - total, size_t(0x40000000)));
+                DWORD count = 0;
+                BOOL status = request.write ?
+                    WriteFile(m_handle, request.address + total, bytes, &count, &overlapped) :
+                    ReadFile(m_handle, request.address + total, bytes, &count, &overlapped);
+                if (!status && GetLastError() != ERROR_HANDLE_EOF)
+                {
+                    return -s64(GetLastError());
+                }
+
+                if (!count)
+                {
+                    // end of file
+                    break;
+                }
+
+                total += count;
+            }
+
+            return s64(total);
+        }
+    };
+
+#else
+
+    struct AsyncFileHandle
+    {
+        std::string m_filename;
+        int m_fd;
+
+        AsyncFileHandle(const std::string& filename, Stream::OpenMode mode)
+            : m_filename(filename)
+        {
+            int oflag = mode == Stream::READ ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+
+#if defined(O_CLOEXEC)
+            oflag |= O_CLOEXEC;
+#endif
+
+            m_fd = ::open(filename.c_str(), oflag, 0644);
+            if (m_fd < 0)
+            {
+                MANGO_EXCEPTION("[AsyncFile] open(\"%s\") failed (%s).", filename.c_str(), std::strerror(errno));
+            }
+        }
+
+        ~AsyncFileHandle()
+        {
+            ::close(m_fd);
+        }
+
+        u64 size() const
+        {
+            struct stat sb;
+            return ::fstat(m_fd, &sb) ? 0 : u64(sb.st_size);
+        }
+
+        s64 transfer(const AsyncRequest& request) const
+        {
+            size_t total = 0;
+
+            while (total < request.size)
+            {
+                const off_t offset = off_t(request.offset + total);
+                ssize_t bytes = request.write ?
+                    ::pwrite(m_fd, request.address + total, request.size - total, offset) :
+                    ::pread(m_fd, request.address + total, request.size - total, offset);
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return -s64(errno);
+                }
+
+                if (!bytes)
+                {
+                    // end of file
+                    break;
+                }
+
+                total += size_t(bytes);
+            }
+
+            return s64(total);
+        }
+    };
+
+#endif
+
+    // -----------------------------------------------------------------
+    // AsyncFile
+    // -----------------------------------------------------------------
+
+    AsyncFile::AsyncFile(const std::string& filename, Stream::OpenMode mode)
+        : m_handle(new AsyncFileHandle(filename, mode))
+    {
+    }
+
+    AsyncFile::~AsyncFile()
+    {
+        delete m_handle;
+    }
+
+    const std::string& AsyncFile::filename() const
+    {
+        return m_handle->m_filename;
+    }
+
+    u64 AsyncFile::size() const
+    {
+        return m_handle->size();
+    }
+
+    // -----------------------------------------------------------------
+    // AsyncRing
+    // -----------------------------------------------------------------
+
+#if defined(MANGO_ENABLE_IO_URING)
+
+    /*
+        Minimal io_uring interface using the raw system calls. The submission queue is
+        filled under the AsyncIOState mutex by the submitting threads and by the completion
+        thread which resubmits the short transfers. The completion queue has a single
+        consumer: the completion thread.
+    */
+
+    struct AsyncRing
+    {
+        int m_fd = -1;
+        u32 m_entries = 0;
+
+        u8* m_sq_ring = nullptr;
+        u8* m_cq_ring = nullptr;
+        size_t m_sq_ring_size = 0;
+        size_t m_cq_ring_size = 0;
+
+        io_uring_sqe* m_sqes = nullptr;
+        size_t m_sqes_size = 0;
+
+        u32* m_sq_tail;
+        u32* m_sq_mask;
+        u32* m_sq_array;
+
+        u32* m_cq_head;
+        u32* m_cq_tail;
+        u32* m_cq_mask;
+        io_uring_cqe* m_cqes;
+
+        AsyncRing(u32 depth)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+
+            m_fd = int(::syscall(__NR_io_uring_setup, depth, &params));
+            if (m_fd < 0)
+            {
+                // not supported by the kernel or disabled
+                return;
+            }
+
+            if (!(params.features & IORING_FEAT_RW_CUR_POS))
+            {
+                // IORING_OP_READ and IORING_OP_WRITE require Linux 5.6
+                close();
+                return;
+            }
+
+            m_entries = params.sq_entries;
+
+            m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+            m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+            const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single)
+            {
+                m_sq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+            }
+
+            void* sq = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            if (sq == MAP_FAILED)
+            {
+                close();
+                return;
+            }
+
+            m_sq_ring = reinterpret_cast<u8*>(sq);
+
+            if (single)
+            {
+                m_cq_ring = m_sq_ring;
+            }
+            else
+            {
+                void* cq = ::mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+                if (cq == MAP_FAILED)
+                {
+                    close();
+                    return;
+                }
+
+                m_cq_ring = reinterpret_cast<u8*>(cq);
+            }
+
+            m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            void* sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+            {
+                close();
+                return;
+            }
+
+            m_sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+            m_sq_tail = reinterpret_cast<u32*>(m_sq_ring + params.sq_off.tail);
+            m_sq_mask = reinterpret_cast<u32*>(m_sq_ring + params.sq_off.ring_mask);
+            m_sq_array = reinterpret_cast<u32*>(m_sq_ring + params.sq_off.array);
+
+            m_cq_head = reinterpret_cast<u32*>(m_cq_ring + params.cq_off.head);
+            m_cq_tail = reinterpret_cast<u32*>(m_cq_ring + params.cq_off.tail);
+            m_cq_mask = reinterpret_cast<u32*>(m_cq_ring + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe*>(m_cq_ring + params.cq_off.cqes);
+        }
+
+        ~AsyncRing()
+        {
+            close();
+        }
+
+        void close()
+        {
+            if (m_sqes)
+            {
+                ::munmap(m_sqes, m_sqes_size);
+                m_sqes = nullptr;
+            }
+
+            if (m_cq_ring && m_cq_ring != m_sq_ring)
+            {
+                ::munmap(m_cq_ring, m_cq_ring_size);
+            }
+
+            if (m_sq_ring)
+            {
+                ::munmap(m_sq_ring, m_sq_ring_size);
+            }
+
+            m_sq_ring = nullptr;
+            m_cq_ring = nullptr;
+
+            if (m_fd >= 0)
+            {
+                ::close(m_fd);
+                m_fd = -1;
+            }
+        }
+
+        bool valid() const
+        {
+            return m_sqes != nullptr;
+        }
+
+        // the caller guarantees that there is a free entry
+        void push(u8 opcode, int fd, u64 offset, void* address, u32 size, u64 user_data)
+        {
+            const u32 tail = *m_sq_tail;
+            const u32 index = tail & *m_sq_mask;
+
+            io_uring_sqe* sqe = m_sqes + index;
+            std::memset(sqe, 0, sizeof(io_uring_sqe));
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->off = offset;
+            sqe->addr = reinterpret_cast<u64>(address);
+            sqe->len = size;
+            sqe->user_data = user_data;
+
+            m_sq_array[index] = index;
+            __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        // remove the last entries which the kernel has not consumed
+        void rollback(u32 count)
+        {
+            __atomic_store_n(m_sq_tail, *m_sq_tail - count, __ATOMIC_RELEASE);
+        }
+
+        int enter(u32 submit, u32 complete, u32 flags)
+        {
+            for (;;)
+            {
+                int status = int(::syscall(__NR_io_uring_enter, m_fd, submit, complete, flags, nullptr, 0));
+                if (status >= 0 || errno != EINTR)
+                {
+                    return status < 0 ? -errno : status;
+                }
+            }
+        }
+    };
+
+#endif // MANGO_ENABLE_IO_URING
+
+    // -----------------------------------------------------------------
+    // AsyncIOState
+    // -----------------------------------------------------------------
+
+    struct AsyncIOState
+    {
+        ConcurrentQueue m_queue;
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+
+        std::vector<AsyncRequest*> m_batch;
+        size_t m_pending = 0; // requests whose callback has not returned
+        u32 m_depth;
+
+#if defined(MANGO_ENABLE_IO_URING)
+        std::unique_ptr<AsyncRing> m_ring;
+        std::thread m_thread;
+        u32 m_inflight = 0; // requests owned by the kernel
+#endif
+
+        AsyncIOState(u32 depth)
+            : m_queue("asyncio")
+            , m_depth(std::max(depth, 1u))
+        {
+            m_batch.reserve(m_depth);
+
+#if defined(MANGO_ENABLE_IO_URING)
+            m_ring.reset(new AsyncRing(m_depth));
+            if (m_ring->valid())
+            {
+                m_depth = m_ring->m_entries;
+                m_thread = std::thread([this] {
+                    reap();
+                });
+            }
+            else
+            {
+                m_ring.reset();
+            }
+#endif
+        }
+
+        ~AsyncIOState()
+        {
+            wait();
+
+#if defined(MANGO_ENABLE_IO_URING)
+            if (m_ring)
+            {
+                {
+                    // wake up the completion thread with a request which has no user data
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_ring->push(IORING_OP_NOP, -1, 0, nullptr, 0, 0);
+                    m_ring->enter(1, 0, 0);
+                }
+
+                m_thread.join();
+            }
+#endif
+        }
+
+        bool native() const
+        {
+#if defined(MANGO_ENABLE_IO_URING)
+            return m_ring != nullptr;
+#else
+            return false;
+#endif
+        }
+
+        void push(AsyncRequest* request)
+        {
+            bool full;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_batch.push_back(request);
+                ++m_pending;
+                full = m_batch.size() >= m_depth;
+
+                // wait() submits the requests issued from the callbacks
+                m_condition.notify_all();
+            }
+
+            if (full)
+            {
+                submit();
+            }
+        }
+
+        void complete(AsyncRequest* request)
+        {
+            request->callback(request->result);
+            delete request;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!--m_pending)
+            {
+                m_condition.notify_all();
+            }
+        }
+
+        void submit()
+        {
+            std::vector<AsyncRequest*> batch;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                batch.swap(m_batch);
+                m_batch.reserve(m_depth);
+            }
+
+            if (batch.empty())
+            {
+                return;
+            }
+
+#if defined(MANGO_ENABLE_IO_URING)
+            if (m_ring)
+            {
+                submitRing(batch);
+                return;
+            }
+#endif
+
+            for (AsyncRequest* request : batch)
+            {
+                m_queue.enqueue([this, request] {
+                    request->result = request->file->transfer(*request);
+                    complete(request);
+                });
+            }
+        }
+
+        void wait()
+        {
+            for (;;)
+            {
+                submit();
+
+                // the callbacks can issue more requests
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this] {
+                    return !m_pending || !m_batch.empty();
+                });
+
+                if (!m_pending)
+                {
+                    break;
+                }
+            }
+
+            // the tasks have returned from the callbacks
+            m_queue.wait();
+        }
+
+#if defined(MANGO_ENABLE_IO_URING)
+
+        // The ring requests are resubmitted until they have been transferred completely or
+        // a transfer returns zero (end of file) so that the results are the same as with
+        // the blocking transfers. The result holds the bytes transferred so far.
+
+        void submitRing(const std::vector<AsyncRequest*>& batch)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            size_t index = 0;
+
+            while (index < batch.size())
+            {
+                // the completion queue is twice the size of the submission queue so
+                // limiting the requests in flight guarantees that it never overflows
+                m_condition.wait(lock, [this] {
+                    return m_inflight < m_depth;
+                });
+
+                const size_t first = index;
+
+                while (index < batch.size() && m_inflight + (index - first) < m_depth)
+                {
+                    pushRing(batch[index++]);
+                }
+
+                const u32 count = u32(index - first);
+                m_inflight += count;
+                enterRing(batch.data() + first, count);
+            }
+        }
+
+        // the caller holds the mutex
+        void pushRing(AsyncRequest* request)
+        {
+            const size_t done = size_t(request->result);
+
+            // the kernel transfers at most 2 GB per request; the rest is resubmitted
+            u32 size = u32(std::min(request->size - done, size_t(0x7ffff000)));
+            u8 opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+            m_ring->push(opcode, request->file->m_fd, request->offset + done, request->address + done, size, reinterpret_cast<u64>(request));
+        }
+
+        // Submit the pushed requests; the caller holds the mutex. The requests which the
+        // kernel did not accept are removed from the submission queue and completed with
+        // the error so that they are not lost and wait() does not hang.
+        void enterRing(AsyncRequest* const* requests, u32 count)
+        {
+            u32 submitted = 0;
+            int status = 0;
+
+            while (submitted < count)
+            {
+                status = m_ring->enter(count - submitted, 0, 0);
+                if (status <= 0)
+                {
+                    break;
+                }
+
+                submitted += u32(status);
+            }
+
+            if (submitted < count)
+            {
+                const u32 failed = count - submitted;
+                m_ring->rollback(failed);
+                m_inflight -= failed;
+
+                for (u32 i = submitted; i < count; ++i)
+                {
+                    AsyncRequest* request = requests[i];
+                    request->result = status < 0 ? s64(status) : -s64(EIO);
+
+                    m_queue.enqueue([this, request] {
+                        complete(request);
+                    });
+                }
+
+                m_condition.notify_all();
+            }
+        }
+
+        void reap()
+        {
+            std::vector<AsyncRequest*> resubmit;
+
+            for (;;)
+            {
+                m_ring->enter(0, 1, IORING_ENTER_GETEVENTS);
+
+                u32 head = *m_ring->m_cq_head;
+                const u32 tail = __atomic_load_n(m_ring->m_cq_tail, __ATOMIC_ACQUIRE);
+                const u32 mask = *m_ring->m_cq_mask;
+
+                bool quit = false;
+                u32 count = 0;
+
+                for ( ; head != tail; ++head)
+                {
+                    const io_uring_cqe& cqe = m_ring->m_cqes[head & mask];
+
+                    AsyncRequest* request = reinterpret_cast<AsyncRequest*>(cqe.user_data);
+                    if (!request)
+                    {
+                        quit = true;
+                        continue;
+                    }
+
+                    if (cqe.res == -EINTR)
+                    {
+                        resubmit.push_back(request);
+                        continue;
+                    }
+
+                    if (cqe.res > 0)
+                    {
+                        request->result += cqe.res;
+                        if (size_t(request->result) < request->size)
+                        {
+                            // short transfer
+                            resubmit.push_back(request);
+                            continue;
+                        }
+                    }
+                    else if (cqe.res < 0)
+                    {
+                        request->result = cqe.res;
+                    }
+
+                    ++count;
+
+                    m_queue.enqueue([this, request] {
+                        complete(request);
+                    });
+                }
+
+                __atomic_store_n(m_ring->m_cq_head, head, __ATOMIC_RELEASE);
+
+                if (count || !resubmit.empty())
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+
+                    // the resubmitted requests stay in flight; the submission queue is
+                    // empty between the calls so there is room for them
+                    for (AsyncRequest* request : resubmit)
+                    {
+                        pushRing(request);
+                    }
+
+                    if (!resubmit.empty())
+                    {
+                        enterRing(resubmit.data(), u32(resubmit.size()));
+                        resubmit.clear();
+                    }
+
+                    m_inflight -= count;
+                    m_condition.notify_all();
+                }
+
+                if (quit)
+                {
+                    break;
+                }
+            }
+        }
+
+#endif // MANGO_ENABLE_IO_URING
+    };
+
+    // -----------------------------------------------------------------
+    // AsyncIO
+    // -----------------------------------------------------------------
+
+    AsyncIO::AsyncIO(u32 depth)
+        : m_state(new AsyncIOState(depth))
+    {
+    }
+
+    AsyncIO::~AsyncIO()
+    {
+        delete m_state;
+    }
+
+    bool AsyncIO::native() const
+    {
+        return m_state->native();
+    }
+
+    void AsyncIO::read(const AsyncFile& file, u64 offset, void* dest, size_t size, Callback callback)
+    {
+        AsyncRequest* request = new AsyncRequest { std::move(callback), file.m_handle, offset, reinterpret_cast<u8*>(dest), size, false, 0 };
+        m_state->push(request);
+    }
+
+    void AsyncIO::write(const AsyncFile& file, u64 offset, const void* data, size_t size, Callback callback)
+    {
+        u8* address = const_cast<u8*>(reinterpret_cast<const u8*>(data));
+        AsyncRequest* request = new AsyncRequest { std::move(callback), file.m_handle, offset, address, size, true, 0 };
+        m_state->push(request);
+    }
+
+    void AsyncIO::submit()
+    {
+        m_state->submit();
+    }
+
+    void AsyncIO::wait()
+    {
+        m_state->wait();
+    }
+
+} // namespace filesystem
+} // namespace mango
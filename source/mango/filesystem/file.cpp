@@ -125,6 +125,19 @@ namespace filesystem {
         return getMemory().size;
     }
 
+    void File::advise(VirtualMemory::Advice advice, ConstMemory range) const
+    {
+        if (m_memory)
+        {
+            m_memory->advise(advice, range);
+        }
+    }
+
+    void File::prefetch(ConstMemory range) const
+    {
+        advise(VirtualMemory::WILLNEED, range);
+    }
+
     ConstMemory File::getMemory() const
     {
         return m_memory ? *m_memory : ConstMemory();
@@ -5,56 +5,312 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <mango/core/hash.hpp>
+#include <mango/core/thread.hpp>
 
 namespace mango {
 namespace filesystem {
 
+    /*
+        Indexer is the directory of the archive mappers. The paths are interned into
+        a single string arena and looked up with open addressing hash tables; the headers
+        are stored in one array and the children of each folder are a contiguous, sorted
+        range of a shared array. There are no per-entry heap allocations beyond what the
+        Header itself owns.
+
+        The headers can be looked up while the index is being built so that the mappers
+        can skip the parent folders which have already been inserted. build() must be
+        called after the last insert() and before getFolder(); it groups and sorts the
+        children, in parallel for large archives.
+
+        Inserting an existing filename replaces the header.
+    */
+
     template <typename Header>
     class Indexer
     {
     public:
-        struct Folder
+        class Folder
         {
-            std::map<std::string, Header *> headers;
+        protected:
+            friend class Indexer;
+
+            const Header* const* m_begin = nullptr;
+            const Header* const* m_end = nullptr;
+
+        public:
+            const Header* const* begin() const
+            {
+                return m_begin;
+            }
+
+            const Header* const* end() const
+            {
+                return m_end;
+            }
+
+            size_t size() const
+            {
+                return size_t(m_end - m_begin);
+            }
         };
 
     protected:
-        std::map<std::string, Folder> folders;
-        std::map<std::string, Header> headers;
+        struct Key
+        {
+            u64 hash;
+            u32 offset; // offset in the string arena
+            u32 length;
+        };
+
+        struct Slot
+        {
+            u32 index; // index + 1, zero: empty slot
+            u32 hash; // upper bits of the hash to skip most string compares
+        };
+
+        std::vector<char> m_strings;
+
+        std::vector<Header> m_headers;
+        std::vector<Key> m_header_keys;
+        std::vector<u32> m_header_folders;
+        std::vector<Slot> m_header_slots;
+
+        std::vector<Key> m_folder_keys;
+        std::vector<Folder> m_folders;
+        std::vector<Slot> m_folder_slots;
+
+        std::vector<const Header*> m_children;
+        bool m_dirty = false;
+
+        static u64 hash(const std::string& s)
+        {
+            return xx3hash64(0, ConstMemory(reinterpret_cast<const u8*>(s.data()), s.length()));
+        }
+
+        Key intern(const std::string& s, u64 h)
+        {
+            Key key { h, u32(m_strings.size()), u32(s.length()) };
+            m_strings.insert(m_strings.end(), s.begin(), s.end());
+            return key;
+        }
+
+        const char* str(const Key& key) const
+        {
+            return m_strings.data() + key.offset;
+        }
+
+        bool less(u32 a, u32 b) const
+        {
+            const Key& ka = m_header_keys[a];
+            const Key& kb = m_header_keys[b];
+            int x = std::memcmp(str(ka), str(kb), std::min(ka.length, kb.length));
+            return x ? x < 0 : ka.length < kb.length;
+        }
+
+        s64 find(const std::vector<Slot>& slots, const std::vector<Key>& keys, const std::string& s, u64 h) const
+        {
+            if (slots.empty())
+            {
+                return -1;
+            }
+
+            const size_t mask = slots.size() - 1;
+
+            for (size_t i = size_t(h) & mask; ; i = (i + 1) & mask)
+            {
+                const Slot& slot = slots[i];
+                if (!slot.index)
+                {
+                    return -1;
+                }
+
+                if (slot.hash == u32(h >> 32))
+                {
+                    const Key& key = keys[slot.index - 1];
+                    if (key.hash == h && key.length == s.length() && !std::memcmp(str(key), s.data(), s.length()))
+                    {
+                        return s64(slot.index - 1);
+                    }
+                }
+            }
+        }
+
+        static void place(std::vector<Slot>& slots, const std::vector<Key>& keys, u32 index)
+        {
+            const size_t mask = slots.size() - 1;
+            const u64 h = keys[index].hash;
+
+            size_t i = size_t(h) & mask;
+            while (slots[i].index)
+            {
+                i = (i + 1) & mask;
+            }
+
+            slots[i] = { index + 1, u32(h >> 32) };
+        }
+
+        static void reserve(std::vector<Slot>& slots, const std::vector<Key>& keys)
+        {
+            // keep the load factor under 0.5
+            if ((keys.size() + 1) * 2 <= slots.size())
+            {
+                return;
+            }
+
+            std::vector<Slot> temp(std::max(size_t(64), slots.size() * 2), Slot { 0, 0 });
+            for (u32 i = 0; i < u32(keys.size()); ++i)
+            {
+                place(temp, keys, i);
+            }
+
+            slots.swap(temp);
+        }
 
     public:
         void insert(const std::string& foldername, const std::string& filename, const Header& header)
         {
-            Header* ptr = &headers[filename];
-            *ptr = header;
-            folders[foldername].headers.emplace(filename, ptr);
+            const u64 h = hash(filename);
+
+            s64 index = find(m_header_slots, m_header_keys, filename, h);
+            if (index >= 0)
+            {
+                m_headers[size_t(index)] = header;
+                return;
+            }
+
+            const u64 fh = hash(foldername);
+
+            s64 folder = find(m_folder_slots, m_folder_keys, foldername, fh);
+            if (folder < 0)
+            {
+                reserve(m_folder_slots, m_folder_keys);
+                folder = s64(m_folder_keys.size());
+                m_folder_keys.push_back(intern(foldername, fh));
+                place(m_folder_slots, m_folder_keys, u32(folder));
+            }
+
+            reserve(m_header_slots, m_header_keys);
+            m_headers.push_back(header);
+            m_header_keys.push_back(intern(filename, h));
+            m_header_folders.push_back(u32(folder));
+            place(m_header_slots, m_header_keys, u32(m_header_keys.size() - 1));
+
+            m_dirty = true;
+        }
+
+        void build()
+        {
+            const size_t num_folders = m_folder_keys.size();
+            const size_t num_headers = m_headers.size();
+
+            // group the children by folder (counting sort)
+            std::vector<u32> offsets(num_folders + 1, 0);
+            for (u32 folder : m_header_folders)
+            {
+                ++offsets[folder + 1];
+            }
+
+            for (size_t i = 0; i < num_folders; ++i)
+            {
+                offsets[i + 1] += offsets[i];
+            }
+
+            std::vector<u32> children(num_headers);
+            std::vector<u32> cursor(offsets.begin(), offsets.end() - 1);
+            for (u32 i = 0; i < u32(num_headers); ++i)
+            {
+                children[cursor[m_header_folders[i]]++] = i;
+            }
+
+            // sort the folders by name; large archives are sorted in parallel
+            auto sort = [&] (size_t first, size_t last)
+            {
+                for (size_t i = first; i < last; ++i)
+                {
+                    std::sort(children.begin() + offsets[i], children.begin() + offsets[i + 1], [this] (u32 a, u32 b)
+                    {
+                        return less(a, b);
+                    });
+                }
+            };
+
+            if (num_headers < 16384)
+            {
+                sort(0, num_folders);
+            }
+            else
+            {
+                ConcurrentQueue q("indexer", Priority::HIGH);
+
+                for (size_t first = 0; first < num_folders; )
+                {
+                    size_t last = first + 1;
+                    while (last < num_folders && offsets[last] - offsets[first] < 4096)
+                    {
+                        ++last;
+                    }
+
+                    q.enqueue(sort, first, last);
+                    first = last;
+                }
+
+                q.wait();
+            }
+
+            m_children.resize(num_headers);
+            for (size_t i = 0; i < num_headers; ++i)
+            {
+                m_children[i] = &m_headers[children[i]];
+            }
+
+            m_folders.resize(num_folders);
+            for (size_t i = 0; i < num_folders; ++i)
+            {
+                m_folders[i].m_begin = m_children.data() + offsets[i];
+                m_folders[i].m_end = m_children.data() + offsets[i + 1];
+            }
+
+            m_dirty = false;
         }
 
         const Folder* getFolder(const std::string& pathname) const
         {
-            const Folder* result = nullptr; // default: not found
+            assert(!m_dirty);
 
-            auto i = folders.find(pathname);
-            if (i != folders.end())
+            s64 index = find(m_folder_slots, m_folder_keys, pathname, hash(pathname));
+            if (index < 0)
             {
-                result = &i->second;
+                return nullptr; // not found
             }
 
-            return result;
+            return &m_folders[size_t(index)];
         }
 
         const Header* getHeader(const std::string& filename) const
         {
-            const Header* result = nullptr; // default: not found
-
-            auto i = headers.find(filename);
-            if (i != headers.end())
+            s64 index = find(m_header_slots, m_header_keys, filename, hash(filename));
+            if (index < 0)
             {
-                result = &i->second;
+                return nullptr; // not found
             }
 
-            return result;
+            return &m_headers[size_t(index)];
+        }
+
+        // call func(filename, header) for every header in insertion order
+        template <typename F>
+        void forEach(F func) const
+        {
+            for (size_t i = 0; i < m_headers.size(); ++i)
+            {
+                const Key& key = m_header_keys[i];
+                func(std::string(str(key), key.length), m_headers[i]);
+            }
         }
     };
 
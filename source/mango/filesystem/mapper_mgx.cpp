@@ -2,6 +2,10 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 #include <mango/core/core.hpp>
 #include <mango/filesystem/filesystem.hpp>
 #include <mango/image/fourcc.hpp>
@@ -91,6 +95,13 @@ namespace
             u64 block_offset = p.read64();
             u64 file_offset = p.read64();
 
+            // the blocks are accessed individually; the tables are read right away
+            adviseMemory(memory, VirtualMemory::RANDOM);
+            if (block_offset < memory.size)
+            {
+                adviseMemory(memory.slice(size_t(block_offset)), VirtualMemory::WILLNEED);
+            }
+
             read_blocks(memory.address + block_offset);
             read_files(memory.address + file_offset);
 
@@ -153,6 +164,11 @@ namespace
                     u32 size = p.read32();
                     header.segments.push_back({block_idx, offset, size});
 
+                    if (block_idx >= m_blocks.size())
+                    {
+                        MANGO_EXCEPTION("[mapper.mgx] Incorrect block index (%d)", block_idx);
+                    }
+
                     // inspect block
                     Block& block = m_blocks[block_idx];
                     if (block.method > 0)
@@ -176,6 +192,8 @@ namespace
             {
                 MANGO_EXCEPTION("[mapper.mgx] Incorrect block terminator (%x)", magic3);
             }
+
+            m_folders.build();
         }
     };
 
@@ -188,21 +206,166 @@ namespace filesystem {
     // VirtualMemoryMGX
     // -----------------------------------------------------------------
 
+    // the decompression buffers are backed by huge pages when they are large enough
+    static const Alignment g_buffer_alignment(MANGO_DEFAULT_ALIGNMENT, Alignment::HUGE_PAGES);
+
     class VirtualMemoryMGX : public mango::VirtualMemory
     {
     protected:
-        const u8* m_delete_address;
+        u8* m_delete_address;
+        bool m_tracked;
 
     public:
-        VirtualMemoryMGX(const u8* address, const u8* delete_address, size_t size)
+        VirtualMemoryMGX(const u8* address, u8* delete_address, size_t size)
             : m_delete_address(delete_address)
         {
             m_memory = ConstMemory(address, size);
+            m_tracked = m_delete_address && trackAllocation(MemoryCategory::MAPPER, size);
         }
 
         ~VirtualMemoryMGX()
         {
-            delete [] m_delete_address;
+            if (m_delete_address)
+            {
+                if (m_tracked)
+                {
+                    trackDeallocation(MemoryCategory::MAPPER, m_memory.size);
+                }
+                aligned_free(m_delete_address, m_memory.size, g_buffer_alignment);
+            }
+        }
+    };
+
+    static std::atomic<bool> g_mgx_verification { false };
+
+    static void verifyChecksum(const FileHeader& file, const std::string& filename, u32 checksum)
+    {
+        if (checksum != file.checksum)
+        {
+            MANGO_EXCEPTION("[mapper.mgx] File \"%s\" checksum mismatch.", filename.c_str());
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // BlockCache
+    // -----------------------------------------------------------------
+
+    // Small files share compressed blocks with their siblings. The decompressed blocks
+    // are cached so that the files are sliced out of a single decompression. The most
+    // recently used blocks are kept within the memory budget; the views returned to the
+    // client keep the block alive after it has been evicted.
+
+    static const size_t g_block_cache_budget = 64 * 1024 * 1024;
+
+    struct CachedBlock
+    {
+        std::mutex mutex; // held while the block is decompressed
+        u8* address = nullptr;
+        size_t size = 0;
+        bool ready = false;
+        bool tracked = false;
+
+        ~CachedBlock()
+        {
+            if (address)
+            {
+                if (tracked)
+                {
+                    trackDeallocation(MemoryCategory::MAPPER, size);
+                }
+                aligned_free(address, size, g_buffer_alignment);
+            }
+        }
+    };
+
+    class BlockCache
+    {
+    protected:
+        struct Entry
+        {
+            std::shared_ptr<CachedBlock> block;
+            std::list<u32>::iterator lru;
+        };
+
+        std::mutex m_mutex;
+        std::unordered_map<u32, Entry> m_entries;
+        std::list<u32> m_lru; // front: most recently used
+        size_t m_budget;
+        size_t m_size = 0;
+
+        void evict()
+        {
+            // the most recently used block is never evicted
+            while (m_size > m_budget && m_lru.size() > 1)
+            {
+                auto i = m_entries.find(m_lru.back());
+                m_size -= i->second.block->size;
+                m_entries.erase(i);
+                m_lru.pop_back();
+            }
+        }
+
+    public:
+        BlockCache(size_t budget)
+            : m_budget(budget)
+        {
+        }
+
+        template <typename Decompress>
+        std::shared_ptr<CachedBlock> get(u32 index, size_t size, Decompress decompress)
+        {
+            std::shared_ptr<CachedBlock> block;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                auto i = m_entries.find(index);
+                if (i != m_entries.end())
+                {
+                    block = i->second.block;
+                    m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+                }
+                else
+                {
+                    block = std::make_shared<CachedBlock>();
+                    block->size = size;
+
+                    m_lru.push_front(index);
+                    m_entries[index] = { block, m_lru.begin() };
+                    m_size += size;
+                    evict();
+                }
+            }
+
+            // concurrent requests for the same block wait for the first one to decompress it
+            std::lock_guard<std::mutex> lock(block->mutex);
+
+            if (!block->ready)
+            {
+                if (!block->address)
+                {
+                    block->address = reinterpret_cast<u8*>(aligned_malloc(size, g_buffer_alignment));
+                    block->tracked = trackAllocation(MemoryCategory::MAPPER, size);
+                }
+
+                decompress(Memory(block->address, size));
+                block->ready = true;
+            }
+
+            return block;
+        }
+    };
+
+    class VirtualMemoryBlockMGX : public mango::VirtualMemory
+    {
+    protected:
+        std::shared_ptr<CachedBlock> m_block;
+
+    public:
+        VirtualMemoryBlockMGX(std::shared_ptr<CachedBlock> block, size_t offset, size_t size)
+            : m_block(block)
+        {
+            m_memory = ConstMemory(block->address + offset, size);
         }
     };
 
@@ -215,11 +378,13 @@ namespace filesystem {
     public:
         HeaderMGX m_header;
         std::string m_password;
+        BlockCache m_cache;
 
     public:
         MapperMGX(ConstMemory parent, const std::string& password)
             : m_header(parent)
             , m_password(password)
+            , m_cache(g_block_cache_budget)
         {
         }
 
@@ -238,9 +403,9 @@ namespace filesystem {
             const Indexer<FileHeader>::Folder* ptrFolder = m_header.m_folders.getFolder(pathname);
             if (ptrFolder)
             {
-                for (auto i : ptrFolder->headers)
+                for (const FileHeader* ptr : *ptrFolder)
                 {
-                    const FileHeader& header = *i.second;
+                    const FileHeader& header = *ptr;
 
                     u32 flags = 0;
 
@@ -268,9 +433,9 @@ namespace filesystem {
             }
 
             const FileHeader& file = *ptrHeader;
+            const bool verify = g_mgx_verification.load(std::memory_order_relaxed);
 
             // TODO: compute segment.size instead of storing it in .mgx container
-            // TODO: checksum
             // TODO: encryption
 
             if (!file.isMultiSegment())
@@ -280,19 +445,31 @@ namespace filesystem {
 
                 if (file.isCompressed())
                 {
-                    if (segment.size != block.uncompressed && !file.isMultiSegment())
+                    if (segment.size != block.uncompressed && block.uncompressed <= g_block_cache_budget)
                     {
-                        // a small file stored in one block with other small files
-                        // cache the decompressed buffers
-
-                        // TODO: decompression cache for small-file blocks
-#if 0
-                        // simulate almost-zero-cost (AZC) decompression
-                        u8* ptr = new u8[file.size];
-                        std::memset(ptr, 0, file.size);
-                        VirtualMemoryMGX* vm = new VirtualMemoryMGX(ptr, ptr, file.size);
+                        // a small file stored in one block with other small files;
+                        // slice it out of the cached decompressed block
+
+                        if (u64(segment.offset) + file.size > block.uncompressed)
+                        {
+                            MANGO_EXCEPTION("[mapper.mgx] File \"%s\" is outside of the block.", filename.c_str());
+                        }
+
+                        Compressor compressor = getCompressor(Compressor::Method(block.method));
+                        ConstMemory src(m_header.m_memory.address + block.offset, size_t(block.compressed));
+
+                        std::shared_ptr<CachedBlock> cached = m_cache.get(segment.block, size_t(block.uncompressed), [&] (Memory dest) {
+                            adviseMemory(src, VirtualMemory::WILLNEED);
+                            compressor.decompress(dest, src);
+                        });
+
+                        if (verify)
+                        {
+                            verifyChecksum(file, filename, crc32c(0, ConstMemory(cached->address + segment.offset, size_t(file.size))));
+                        }
+
+                        VirtualMemoryBlockMGX* vm = new VirtualMemoryBlockMGX(cached, segment.offset, size_t(file.size));
                         return vm;
-#endif
                     }
                 }
                 else
@@ -307,6 +484,13 @@ namespace filesystem {
                         MANGO_EXCEPTION("[mapper.mgx] File \"%s\" has mapped region outside of parent memory.", filename.c_str());
                     }
 
+                    adviseMemory(ConstMemory(ptr, size_t(file.size)), VirtualMemory::WILLNEED);
+
+                    if (verify)
+                    {
+                        verifyChecksum(file, filename, crc32c(0, ConstMemory(ptr, size_t(file.size))));
+                    }
+
                     VirtualMemoryMGX* vm = new VirtualMemoryMGX(ptr, nullptr, size_t(file.size));
                     return vm;
                 }
@@ -314,9 +498,27 @@ namespace filesystem {
 
             // generic compression case
 
-            u8* ptr = new u8[size_t(file.size)];
+            // start reading all of the blocks before the decompression tasks touch them
+            for (auto &segment : file.segments)
+            {
+                const Block& block = m_header.m_blocks[segment.block];
+                if (block.method)
+                {
+                    adviseMemory(ConstMemory(m_header.m_memory.address + block.offset, size_t(block.compressed)), VirtualMemory::WILLNEED);
+                }
+                else
+                {
+                    adviseMemory(ConstMemory(m_header.m_memory.address + block.offset + segment.offset, size_t(segment.size)), VirtualMemory::WILLNEED);
+                }
+            }
+
+            u8* ptr = reinterpret_cast<u8*>(aligned_malloc(size_t(file.size), g_buffer_alignment));
             u8* x = ptr;
 
+            // the segments are hashed in the decompression tasks while they are hot in the cache
+            std::vector<u32> checksums(verify ? file.segments.size() : 0);
+            u32* checksum = checksums.data();
+
             ConcurrentQueue q("mgx.decompessor", Priority::HIGH);
 
             for (auto &segment : file.segments)
@@ -335,12 +537,26 @@ namespace filesystem {
                             Memory dest(x, size_t(block.uncompressed));
                             compressor.decompress(dest, src);
                         }
+                        else if (block.uncompressed <= g_block_cache_budget)
+                        {
+                            // partial segments are shared with other files (or deduplicated
+                            // within this file) so the decompressed block is cached
+                            std::shared_ptr<CachedBlock> cached = m_cache.get(segment.block, size_t(block.uncompressed), [&] (Memory dest) {
+                                compressor.decompress(dest, src);
+                            });
+                            std::memcpy(x, cached->address + segment.offset, segment.size);
+                        }
                         else
                         {
                             Buffer dest(size_t(block.uncompressed));
                             compressor.decompress(dest, src);
                             std::memcpy(x, Memory(dest).address + segment.offset, segment.size);
                         }
+
+                        if (checksum)
+                        {
+                            *checksum = crc32c(0, ConstMemory(x, segment.size));
+                        }
                     });
 
                     x += segment.size;
@@ -348,17 +564,177 @@ namespace filesystem {
                 else
                 {
                     std::memcpy(x, m_header.m_memory.address + block.offset + segment.offset, segment.size);
+
+                    if (checksum)
+                    {
+                        *checksum = crc32c(0, ConstMemory(x, segment.size));
+                    }
+
                     x += segment.size;
                 }
+
+                if (checksum)
+                {
+                    ++checksum;
+                }
             }
 
             q.wait();
 
+            if (verify)
+            {
+                u32 crc = 0;
+                for (size_t i = 0; i < file.segments.size(); ++i)
+                {
+                    crc = crc32c_combine(crc, checksums[i], file.segments[i].size);
+                }
+
+                if (crc != file.checksum)
+                {
+                    aligned_free(ptr, size_t(file.size), g_buffer_alignment);
+                    verifyChecksum(file, filename, crc);
+                }
+            }
+
             VirtualMemoryMGX* vm = new VirtualMemoryMGX(ptr, ptr, size_t(file.size));
             return vm;
         }
     };
 
+    // -----------------------------------------------------------------
+    // scrub
+    // -----------------------------------------------------------------
+
+    static MgxScrubStatus scrub(ConstMemory memory)
+    {
+        MgxScrubStatus status;
+
+        std::unique_ptr<HeaderMGX> header;
+
+        try
+        {
+            header.reset(new HeaderMGX(memory));
+        }
+        catch (Exception& e)
+        {
+            status.errors.push_back(e.what());
+            return status;
+        }
+
+        const std::vector<Block>& blocks = header->m_blocks;
+
+        struct Reference
+        {
+            u32* checksum;
+            u32 offset;
+            u32 size;
+        };
+
+        std::vector<const FileHeader*> files;
+        std::vector<std::string> filenames;
+        std::vector<std::vector<u32>> checksums;
+        std::vector<std::vector<Reference>> references(blocks.size());
+        std::unique_ptr<std::atomic<bool>[]> failed(new std::atomic<bool>[blocks.size()]);
+
+        header->m_folders.forEach([&] (const std::string& filename, const FileHeader& file)
+        {
+            if (!file.isFolder())
+            {
+                files.push_back(&file);
+                filenames.push_back(filename);
+                checksums.emplace_back(file.segments.size());
+            }
+        });
+
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            const auto& segments = files[i]->segments;
+            for (size_t j = 0; j < segments.size(); ++j)
+            {
+                references[segments[j].block].push_back({ &checksums[i][j], segments[j].offset, segments[j].size });
+            }
+        }
+
+        // every block is decompressed once and hashed for all of the files referencing it
+        ConcurrentQueue q("mgx.scrub", Priority::LOW);
+
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            failed[i] = false;
+
+            if (references[i].empty())
+            {
+                continue;
+            }
+
+            q.enqueue([&, i] {
+                const Block& block = blocks[i];
+
+                try
+                {
+                    if (block.offset + block.compressed > memory.size)
+                    {
+                        MANGO_EXCEPTION("[mapper.mgx] Block %d is outside of the container.", int(i));
+                    }
+
+                    ConstMemory src(memory.address + block.offset, size_t(block.compressed));
+                    ConstMemory data = src;
+                    Buffer buffer;
+
+                    if (block.method)
+                    {
+                        Compressor compressor = getCompressor(Compressor::Method(block.method));
+                        buffer.resize(size_t(block.uncompressed));
+                        compressor.decompress(buffer, src);
+                        data = buffer;
+                    }
+
+                    for (const auto& reference : references[i])
+                    {
+                        if (u64(reference.offset) + reference.size > data.size)
+                        {
+                            MANGO_EXCEPTION("[mapper.mgx] Segment is outside of block %d.", int(i));
+                        }
+
+                        *reference.checksum = crc32c(0, ConstMemory(data.address + reference.offset, reference.size));
+                    }
+                }
+                catch (Exception&)
+                {
+                    failed[i] = true;
+                }
+            });
+        }
+
+        q.wait();
+
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            const FileHeader& file = *files[i];
+
+            bool error = false;
+            u32 crc = 0;
+
+            for (size_t j = 0; j < file.segments.size(); ++j)
+            {
+                error |= failed[file.segments[j].block];
+                crc = crc32c_combine(crc, checksums[i][j], file.segments[j].size);
+            }
+
+            if (error || crc != file.checksum)
+            {
+                status.errors.push_back(filenames[i]);
+            }
+            else
+            {
+                ++status.files;
+                status.bytes += file.size;
+            }
+        }
+
+        return status;
+    }
+
     // -----------------------------------------------------------------
     // functions
     // -----------------------------------------------------------------
@@ -369,6 +745,21 @@ namespace filesystem {
         return mapper;
     }
 
+    void setMgxVerification(bool enable)
+    {
+        g_mgx_verification = enable;
+    }
+
+    FutureTask<MgxScrubStatus> scrubMgx(const std::string& filename)
+    {
+        // the container is opened right away so that missing files throw in the caller
+        std::shared_ptr<File> file = std::make_shared<File>(filename);
+
+        return FutureTask<MgxScrubStatus>([file] {
+            return scrub(*file);
+        });
+    }
+
 } // namespace filesystem
 } // namespace mango
 
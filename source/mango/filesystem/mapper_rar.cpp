@@ -38,17 +38,26 @@ namespace
     {
     protected:
         const u8* m_delete_address;
+        bool m_tracked;
 
     public:
         VirtualMemoryRAR(const u8* address, const u8* delete_address, size_t size)
             : m_delete_address(delete_address)
         {
             m_memory = ConstMemory(address, size);
+            m_tracked = m_delete_address && mango::trackAllocation(mango::MemoryCategory::MAPPER, size);
         }
 
         ~VirtualMemoryRAR()
         {
-            delete [] m_delete_address;
+            if (m_delete_address)
+            {
+                if (m_tracked)
+                {
+                    mango::trackDeallocation(mango::MemoryCategory::MAPPER, m_memory.size);
+                }
+                delete [] m_delete_address;
+            }
         }
     };
     
@@ -374,6 +383,9 @@ namespace
         {
             VirtualMemory* memory;
 
+            // start reading the entry before it is decompressed
+            adviseMemory(ConstMemory(data, size_t(packed_size)), VirtualMemory::WILLNEED);
+
             if (!compressed())
             {
                 // no compression
@@ -424,6 +436,9 @@ namespace filesystem {
             if (start)
             {
                 parse(start, end);
+
+                // the entries are accessed individually so the read-ahead would be wasted
+                adviseMemory(parent, VirtualMemory::RANDOM);
             }
         }
 
@@ -464,8 +479,18 @@ namespace filesystem {
                     m_folders.insert(folder, filename, header);
                     header.folder = true;
                     filename = folder;
+
+                    if (m_folders.getHeader(filename))
+                    {
+                        // the parent folders have already been inserted
+                        break;
+                    }
                 }
             }
+
+            // the headers have been copied into the index
+            std::vector<FileHeader>().swap(m_files);
+            m_folders.build();
         }
 
         void parse_rar4(const u8* start, const u8* end)
@@ -700,9 +725,9 @@ namespace filesystem {
             const Indexer<FileHeader>::Folder* ptrFolder = m_folders.getFolder(pathname);
             if (ptrFolder)
             {
-                for (auto i : ptrFolder->headers)
+                for (const FileHeader* ptr : *ptrFolder)
                 {
-                    const FileHeader& header = *i.second;
+                    const FileHeader& header = *ptr;
 
                     u32 flags = 0;
                     u64 size = header.unpacked_size;
@@ -543,21 +543,48 @@ namespace filesystem {
     // VirtualMemoryZIP
     // -----------------------------------------------------------------
 
+    // the decryption and decompression buffers are backed by huge pages when they are large enough
+    static const Alignment g_buffer_alignment(MANGO_DEFAULT_ALIGNMENT, Alignment::HUGE_PAGES);
+
+    static u8* allocate_buffer(size_t bytes)
+    {
+        return reinterpret_cast<u8*>(aligned_malloc(bytes, g_buffer_alignment));
+    }
+
+    static void free_buffer(u8* buffer, size_t bytes)
+    {
+        if (buffer)
+        {
+            aligned_free(buffer, bytes, g_buffer_alignment);
+        }
+    }
+
     class VirtualMemoryZIP : public mango::VirtualMemory
     {
     protected:
-        const u8* m_delete_address;
+        u8* m_delete_address;
+        size_t m_delete_size;
+        bool m_tracked;
 
     public:
-        VirtualMemoryZIP(const u8* address, const u8* delete_address, size_t size)
+        VirtualMemoryZIP(const u8* address, size_t size, u8* delete_address, size_t delete_size)
             : m_delete_address(delete_address)
+            , m_delete_size(delete_size)
         {
             m_memory = ConstMemory(address, size);
+            m_tracked = m_delete_address && trackAllocation(MemoryCategory::MAPPER, m_delete_size);
         }
 
         ~VirtualMemoryZIP()
         {
-            delete [] m_delete_address;
+            if (m_delete_address)
+            {
+                if (m_tracked)
+                {
+                    trackDeallocation(MemoryCategory::MAPPER, m_delete_size);
+                }
+                free_buffer(m_delete_address, m_delete_size);
+            }
         }
     };
 
@@ -578,11 +605,19 @@ namespace filesystem {
         {
             if (parent.address)
             {
+                // the entries are accessed individually so the read-ahead would be wasted
+                adviseMemory(parent, VirtualMemory::RANDOM);
+
                 DirEndRecord record(parent);
                 if (record.status())
                 {
                     const int numFiles = int(record.numEntriesTotal);
 
+                    if (record.dirStartOffset < parent.size && record.dirSize)
+                    {
+                        adviseMemory(parent.slice(size_t(record.dirStartOffset), size_t(record.dirSize)), VirtualMemory::WILLNEED);
+                    }
+
                     // read file headers
                     LittleEndianConstPointer p = parent.address + record.dirStartOffset;
 
@@ -600,11 +635,19 @@ namespace filesystem {
                                 m_folders.insert(folder, filename, header);
                                 header.is_folder = true;
                                 filename = folder;
+
+                                if (m_folders.getHeader(filename))
+                                {
+                                    // the parent folders have already been inserted
+                                    break;
+                                }
                             }
                         }
                     }
                 }
             }
+
+            m_folders.build();
         }
 
         ~MapperZIP()
@@ -626,7 +669,14 @@ namespace filesystem {
             const u8* address = start + offset;
             u64 size = 0;
 
+            // start reading the entry before it is decrypted and decompressed
+            if (offset < m_parent_memory.size && header.compressedSize)
+            {
+                adviseMemory(m_parent_memory.slice(size_t(offset), size_t(header.compressedSize)), VirtualMemory::WILLNEED);
+            }
+
             u8* buffer = nullptr; // remember allocated memory
+            size_t buffer_size = 0;
 
             //printf("[ZIP] compression: %d, encryption: %d \n", header.compression, header.encryption);
 
@@ -643,13 +693,14 @@ namespace filesystem {
 
                     // NOTE: decryption capability reduced on 32 bit platforms
                     const size_t compressed_size = size_t(header.compressedSize);
-                    buffer = new u8[compressed_size];
+                    buffer = allocate_buffer(compressed_size);
+                    buffer_size = compressed_size;
 
                     bool status = zip_decrypt(buffer, address, header.compressedSize, dcheader,
                                             header.versionUsed & 0xff, header.crc, password);
                     if (!status)
                     {
-                        delete[] buffer;
+                        free_buffer(buffer, buffer_size);
                         MANGO_EXCEPTION("[mapper.zip] Decryption failed (probably incorrect password).");
                     }
 
@@ -694,17 +745,18 @@ namespace filesystem {
                 case COMPRESSION_DEFLATE:
                 {
                     const size_t uncompressed_size = size_t(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = allocate_buffer(uncompressed_size);
 
                     u64 outsize = zip_decompress(address, uncompressed_buffer, header.compressedSize, header.uncompressedSize);
 
-                    delete[] buffer;
+                    free_buffer(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     if (outsize != header.uncompressedSize)
                     {
                         // incorrect output size
-                        delete[] buffer;
+                        free_buffer(buffer, buffer_size);
                         MANGO_EXCEPTION("[mapper.zip] Incorrect decompressed size.");
                     }
 
@@ -717,7 +769,7 @@ namespace filesystem {
                 case COMPRESSION_LZMA:
                 {
                     const size_t uncompressed_size = size_t(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = allocate_buffer(uncompressed_size);
 
                     // parse LZMA compression header
                     p = address;
@@ -725,7 +777,8 @@ namespace filesystem {
                     u16 lzma_propsize = p.read16();
                     if (lzma_propsize != 5)
                     {
-                        delete[] buffer;
+                        free_buffer(uncompressed_buffer, uncompressed_size);
+                        free_buffer(buffer, buffer_size);
                         MANGO_EXCEPTION("[mapper.zip] Incorrect LZMA header.");
                     }
                     address = p;
@@ -734,8 +787,9 @@ namespace filesystem {
                     lzma::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)),
                                      ConstMemory(address, size_t(compressed_size)));
 
-                    delete[] buffer;
+                    free_buffer(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     // use decode_buffer as memory map
                     address = buffer;
@@ -746,13 +800,14 @@ namespace filesystem {
                 case COMPRESSION_PPMD:
                 {
                     const std::size_t uncompressed_size = static_cast<std::size_t>(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = allocate_buffer(uncompressed_size);
 
                     ppmd8::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)),
                                       ConstMemory(address, size_t(header.compressedSize)));
 
-                    delete[] buffer;
+                    free_buffer(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     // use decode_buffer as memory map
                     address = buffer;
@@ -763,13 +818,14 @@ namespace filesystem {
                 case COMPRESSION_BZIP2:
                 {
                     const std::size_t uncompressed_size = static_cast<std::size_t>(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = allocate_buffer(uncompressed_size);
 
                     bzip2::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)),
                                       ConstMemory(address, size_t(header.compressedSize)));
 
-                    delete[] buffer;
+                    free_buffer(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     // use decode_buffer as memory map
                     address = buffer;
@@ -789,11 +845,11 @@ namespace filesystem {
             VirtualMemory* memory;
             if (buffer)
             {
-                memory = new VirtualMemoryZIP(buffer, buffer, size_t(size));
+                memory = new VirtualMemoryZIP(buffer, size_t(size), buffer, buffer_size);
             }
             else
             {
-                memory = new VirtualMemoryZIP(address, nullptr, size_t(size));
+                memory = new VirtualMemoryZIP(address, size_t(size), nullptr, 0);
             }
 
             return memory;
@@ -814,9 +870,9 @@ namespace filesystem {
             const Indexer<FileHeader>::Folder* ptrFolder = m_folders.getFolder(pathname);
             if (ptrFolder)
             {
-                for (auto i : ptrFolder->headers)
+                for (const FileHeader* ptr : *ptrFolder)
                 {
-                    const FileHeader& header = *i.second;
+                    const FileHeader& header = *ptr;
 
                     u32 flags = 0;
                     u64 size = header.uncompressedSize;
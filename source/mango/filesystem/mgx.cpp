@@ -0,0 +1,510 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <mango/core/buffer.hpp>
+#include <mango/core/crc32.hpp>
+#include <mango/core/hash.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/core/thread.hpp>
+#include <mango/filesystem/file.hpp>
+#include <mango/filesystem/path.hpp>
+#include <mango/filesystem/mgx.hpp>
+#include <mango/image/fourcc.hpp>
+
+namespace
+{
+    using namespace mango;
+    using namespace mango::filesystem;
+
+    constexpr u32 mgx_version = 1;
+
+    struct Segment
+    {
+        u32 block;
+        u32 offset;
+        u32 size;
+    };
+
+    struct FileEntry
+    {
+        std::string filename;
+        u64 size;
+        u32 checksum;
+        std::vector<Segment> segments; // no segments: folder
+    };
+
+    struct BlockEntry
+    {
+        u64 offset;
+        u64 compressed;
+        u64 uncompressed;
+        u32 method;
+    };
+
+    // -----------------------------------------------------------------
+    // Chunker
+    // -----------------------------------------------------------------
+
+    // Content-defined chunking with a gear rolling hash (FastCDC). The hash covers the
+    // last 64 bytes so the boundaries move with the content. Normalized chunking uses
+    // a stricter mask before the average size and a looser one after it to keep the
+    // chunk sizes close to the average.
+
+    class Chunker
+    {
+    protected:
+        u64 m_gear[256];
+        size_t m_min;
+        size_t m_avg;
+        size_t m_max;
+        u64 m_mask_small;
+        u64 m_mask_large;
+
+    public:
+        Chunker(size_t max_size)
+        {
+            u64 x = 0x9e3779b97f4a7c15ull;
+            for (auto& gear : m_gear)
+            {
+                // splitmix64
+                u64 z = (x += 0x9e3779b97f4a7c15ull);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                gear = z ^ (z >> 31);
+            }
+
+            m_max = std::min(max_size, size_t(256 * 1024));
+            m_avg = m_max / 4;
+            m_min = m_avg / 4;
+
+            const int bits = u32_log2(u32(m_avg));
+            m_mask_small = ~0ull << (64 - bits - 1);
+            m_mask_large = ~0ull << (64 - bits + 1);
+        }
+
+        size_t next(const u8* data, size_t size) const
+        {
+            if (size <= m_min)
+            {
+                return size;
+            }
+
+            const size_t limit = std::min(size, m_max);
+            const size_t normal = std::min(limit, m_avg);
+
+            u64 hash = 0;
+            size_t i = m_min;
+
+            for ( ; i < normal; ++i)
+            {
+                hash = (hash << 1) + m_gear[data[i]];
+                if (!(hash & m_mask_small))
+                    return i + 1;
+            }
+
+            for ( ; i < limit; ++i)
+            {
+                hash = (hash << 1) + m_gear[data[i]];
+                if (!(hash & m_mask_large))
+                    return i + 1;
+            }
+
+            return limit;
+        }
+    };
+
+    struct ChunkHash
+    {
+        size_t operator () (const XX3HASH128& key) const
+        {
+            return size_t(key[0]);
+        }
+    };
+
+    struct PendingBlock
+    {
+        Buffer input;
+        Buffer output;
+        u32 method = Compressor::NONE;
+        u32 files = 0;
+
+        PendingBlock(size_t capacity)
+        {
+            input.reserve(capacity);
+        }
+
+        void compress(const Compressor& compressor, int level)
+        {
+            if (compressor.method != Compressor::NONE)
+            {
+                output.resize(compressor.bound(input.size()));
+                size_t bytes = compressor.compress(output, input, level);
+                if (bytes < input.size())
+                {
+                    output.resize(bytes);
+                    method = compressor.method;
+                    return;
+                }
+            }
+
+            // incompressible blocks are stored so that the files can be mapped directly
+            method = Compressor::NONE;
+        }
+
+        ConstMemory result() const
+        {
+            return method ? ConstMemory(output) : ConstMemory(input);
+        }
+    };
+
+} // namespace
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // MgxWriterState
+    // -----------------------------------------------------------------
+
+    struct MgxWriterState
+    {
+        FileStream m_file;
+        Compressor m_compressor;
+        int m_level;
+        size_t m_block_size;
+        size_t m_max_pending;
+
+        std::vector<FileEntry> m_files;
+        std::set<std::string> m_folders;
+        std::vector<BlockEntry> m_blocks;
+
+        // blocks being compressed, in file order
+        std::deque<std::pair<std::unique_ptr<PendingBlock>, FutureTask<void>>> m_pending;
+        std::unique_ptr<PendingBlock> m_current;
+        u32 m_block_count = 0;
+
+        // deduplication
+        std::unique_ptr<Chunker> m_chunker;
+        std::unordered_map<XX3HASH128, Segment, ChunkHash> m_chunks;
+
+        MgxWriterState(const std::string& filename, Compressor::Method method, int level, size_t block_size, u32 flags)
+            : m_file(filename, Stream::WRITE)
+            , m_compressor(getCompressor(method))
+            , m_level(level)
+        {
+            // the segments address the blocks with 32 bit offsets
+            m_block_size = std::max(size_t(4096), std::min(block_size, size_t(1) << 30));
+            m_max_pending = size_t(std::max(1, ThreadPool::getInstanceSize())) * 2;
+            m_current.reset(new PendingBlock(m_block_size));
+
+            if (flags & MgxWriter::DEDUPLICATE)
+            {
+                m_chunker.reset(new Chunker(m_block_size));
+            }
+
+            LittleEndianStream s(m_file);
+            s.write32(u32_mask('m', 'g', 'x', '0'));
+        }
+
+        ~MgxWriterState()
+        {
+            // the tasks reference the blocks
+            for (auto& pending : m_pending)
+            {
+                pending.second.wait();
+            }
+        }
+
+        void addFolders(const std::string& filename)
+        {
+            for (size_t i = filename.find('/'); i != std::string::npos; i = filename.find('/', i + 1))
+            {
+                std::string folder = filename.substr(0, i + 1);
+                if (m_folders.insert(folder).second)
+                {
+                    m_files.push_back({ folder, 0, 0, {} });
+                }
+            }
+        }
+
+        void addFile(const std::string& filename, ConstMemory memory)
+        {
+            FileEntry entry;
+            entry.filename = filename;
+            entry.size = memory.size;
+            entry.checksum = crc32c(0, memory);
+
+            if (m_chunker && memory.size > 0)
+            {
+                addChunks(entry, memory);
+                m_files.push_back(std::move(entry));
+                return;
+            }
+
+            const size_t available = m_block_size - m_current->input.size();
+            if (memory.size > available && memory.size <= m_block_size)
+            {
+                // small files are not split; start a new block
+                submit();
+            }
+
+            const u8* p = memory.address;
+            size_t left = memory.size;
+
+            do
+            {
+                if (m_current->input.size() == m_block_size)
+                {
+                    submit();
+                }
+
+                size_t bytes = std::min(left, m_block_size - m_current->input.size());
+                entry.segments.push_back({ m_block_count, u32(m_current->input.size()), u32(bytes) });
+
+                m_current->input.append(p, bytes);
+                ++m_current->files;
+
+                p += bytes;
+                left -= bytes;
+            } while (left > 0);
+
+            m_files.push_back(std::move(entry));
+        }
+
+        void addChunks(FileEntry& entry, ConstMemory memory)
+        {
+            struct Chunk
+            {
+                ConstMemory memory;
+                XX3HASH128 key;
+            };
+
+            std::vector<Chunk> chunks;
+            size_t unique = 0;
+
+            for (size_t offset = 0; offset < memory.size; )
+            {
+                size_t bytes = m_chunker->next(memory.address + offset, memory.size - offset);
+                ConstMemory chunk = memory.slice(offset, bytes);
+                XX3HASH128 key = xx3hash128(0, chunk);
+
+                if (m_chunks.find(key) == m_chunks.end())
+                {
+                    unique += bytes;
+                }
+
+                chunks.push_back({ chunk, key });
+                offset += bytes;
+            }
+
+            const size_t available = m_block_size - m_current->input.size();
+            if (unique > available && unique <= m_block_size)
+            {
+                // the new data of small files is not split; start a new block
+                submit();
+            }
+
+            for (const Chunk& chunk : chunks)
+            {
+                Segment segment;
+
+                auto i = m_chunks.find(chunk.key);
+                if (i != m_chunks.end() && i->second.size == chunk.memory.size)
+                {
+                    // the chunk has already been stored
+                    segment = i->second;
+                }
+                else
+                {
+                    if (chunk.memory.size > m_block_size - m_current->input.size())
+                    {
+                        submit();
+                    }
+
+                    segment = { m_block_count, u32(m_current->input.size()), u32(chunk.memory.size) };
+                    m_current->input.append(chunk.memory.address, chunk.memory.size);
+                    m_chunks[chunk.key] = segment;
+                }
+
+                if (segment.block == m_block_count)
+                {
+                    ++m_current->files;
+                }
+
+                // merge the contiguous chunks into one segment
+                if (!entry.segments.empty())
+                {
+                    Segment& last = entry.segments.back();
+                    if (last.block == segment.block && last.offset + last.size == segment.offset)
+                    {
+                        last.size += segment.size;
+                        continue;
+                    }
+                }
+
+                entry.segments.push_back(segment);
+            }
+        }
+
+        void submit()
+        {
+            if (!m_current->files)
+            {
+                // nothing references the current block
+                return;
+            }
+
+            PendingBlock* block = m_current.release();
+            Compressor compressor = m_compressor;
+            int level = m_level;
+
+            m_pending.emplace_back(std::unique_ptr<PendingBlock>(block), FutureTask<void>([=] {
+                block->compress(compressor, level);
+            }));
+
+            ++m_block_count;
+            m_current.reset(new PendingBlock(m_block_size));
+
+            while (m_pending.size() > m_max_pending)
+            {
+                retire();
+            }
+        }
+
+        void retire()
+        {
+            auto& front = m_pending.front();
+            front.second.wait();
+
+            PendingBlock& block = *front.first;
+            ConstMemory data = block.result();
+
+            m_blocks.push_back({ m_file.offset(), u64(data.size), u64(block.input.size()), block.method });
+            m_file.write(data.address, data.size);
+
+            m_pending.pop_front();
+        }
+
+        void finish()
+        {
+            submit();
+
+            while (!m_pending.empty())
+            {
+                retire();
+            }
+
+            LittleEndianBufferedWriter s(m_file);
+
+            // block table
+            const u64 block_offset = s.offset();
+
+            s.write32(u32_mask('m', 'g', 'x', '1'));
+            s.write32(u32(m_blocks.size()));
+
+            for (const auto& block : m_blocks)
+            {
+                s.write64(block.offset);
+                s.write64(block.compressed);
+                s.write64(block.uncompressed);
+                s.write32(block.method);
+            }
+
+            s.write32(u32_mask('m', 'g', 'x', '2'));
+
+            // file table
+            const u64 file_offset = s.offset();
+
+            s.write32(u32_mask('m', 'g', 'x', '2'));
+            s.write32(u32(m_files.size()));
+
+            for (const auto& file : m_files)
+            {
+                s.write32(u32(file.filename.length()));
+                s.write(file.filename.data(), file.filename.length());
+                s.write64(file.size);
+                s.write32(file.checksum);
+                s.write32(u32(file.segments.size()));
+
+                for (const auto& segment : file.segments)
+                {
+                    s.write32(segment.block);
+                    s.write32(segment.offset);
+                    s.write32(segment.size);
+                }
+            }
+
+            s.write32(u32_mask('m', 'g', 'x', '3'));
+
+            // header
+            s.write32(u32_mask('m', 'g', 'x', '3'));
+            s.write32(mgx_version);
+            s.write64(block_offset);
+            s.write64(file_offset);
+
+            // the streams are flushed here so that close() sees the write errors
+            s.flush();
+            m_file.flush();
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // MgxWriter
+    // -----------------------------------------------------------------
+
+    MgxWriter::MgxWriter(const std::string& filename, Compressor::Method method, int level, size_t block_size, u32 flags)
+        : m_state(new MgxWriterState(filename, method, level, block_size, flags))
+    {
+    }
+
+    MgxWriter::~MgxWriter()
+    {
+        try
+        {
+            close();
+        }
+        catch (Exception&)
+        {
+            // the destructor cannot report the error; call close() to see it
+        }
+    }
+
+    void MgxWriter::write(const std::string& filename, ConstMemory memory)
+    {
+        if (!m_state)
+        {
+            MANGO_EXCEPTION("[MgxWriter] The container has been closed.");
+        }
+
+        if (filename.empty() || filename[0] == '/')
+        {
+            MANGO_EXCEPTION("[MgxWriter] Incorrect filename \"%s\".", filename.c_str());
+        }
+
+        m_state->addFolders(filename);
+
+        if (filename.back() != '/')
+        {
+            m_state->addFile(filename, memory);
+        }
+    }
+
+    void MgxWriter::close()
+    {
+        if (m_state)
+        {
+            std::unique_ptr<MgxWriterState> state(m_state);
+            m_state = nullptr;
+            state->finish();
+        }
+    }
+
+} // namespace filesystem
+} // namespace mango
@@ -6,13 +6,75 @@
 #define _FILE_OFFSET_BITS 64 /* LFS: 64 bit off_t */
 #endif
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <limits>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <mango/core/string.hpp>
+#include <mango/core/memory.hpp>
 #include <mango/core/exception.hpp>
 #include <mango/filesystem/file.hpp>
 
+namespace
+{
+    using namespace mango;
+
+    // O_DIRECT transfers must be aligned to the logical block size of the device
+    constexpr size_t g_direct_alignment = 4096;
+
+    size_t pread_all(int fd, void* dest, size_t size, u64 offset)
+    {
+        u8* ptr = reinterpret_cast<u8*>(dest);
+        size_t total = 0;
+
+        while (total < size)
+        {
+            ssize_t bytes = ::pread(fd, ptr + total, size - total, off_t(offset + total));
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                MANGO_EXCEPTION("[FileStream] pread() failed (%s).", std::strerror(errno));
+            }
+
+            if (!bytes)
+            {
+                // end of file
+                break;
+            }
+
+            total += size_t(bytes);
+        }
+
+        return total;
+    }
+
+    void pwrite_all(int fd, const void* data, size_t size, u64 offset)
+    {
+        const u8* ptr = reinterpret_cast<const u8*>(data);
+        size_t total = 0;
+
+        while (total < size)
+        {
+            ssize_t bytes = ::pwrite(fd, ptr + total, size - total, off_t(offset + total));
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                MANGO_EXCEPTION("[FileStream] pwrite() failed (%s).", std::strerror(errno));
+            }
+
+            total += size_t(bytes);
+        }
+    }
+
+} // namespace
+
 namespace mango {
 namespace filesystem {
 
@@ -20,20 +82,96 @@ namespace filesystem {
 	// FileHandle
     // -----------------------------------------------------------------
 
+    /*
+        The stream is buffered in user space and all transfers are positional so that
+        the kernel file offset is never used. In the WRITE mode the buffer combines the
+        small writes from the encoders; m_position is the file offset of the buffer's
+        first byte. In the READ mode the buffer holds [m_position, m_position + m_used)
+        and m_cursor is the read offset inside the buffer.
+    */
+
 	struct FileHandle
 	{
-		FILE* m_file;
+        int m_fd;
         std::string m_filename;
+        Stream::OpenMode m_mode;
+
+        u8* m_buffer;
+        size_t m_capacity;
+        size_t m_used = 0;
+        size_t m_cursor = 0;
+        u64 m_position = 0;
+
+        // logical file size in the WRITE mode
+        u64 m_size = 0;
+
+        // O_DIRECT is active; the buffer always starts at an aligned file offset
+        bool m_direct = false;
+        bool m_padded = false;
 
-        FileHandle(const std::string& filename, const char* mode)
-            : m_file(std::fopen(filename.c_str(), mode))
-            , m_filename(filename)
+        FileHandle(const std::string& filename, Stream::OpenMode mode, size_t buffer_size, u32 flags)
+            : m_filename(filename)
+            , m_mode(mode)
 		{
+            int oflag = mode == Stream::READ ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+
+#if defined(O_CLOEXEC)
+            oflag |= O_CLOEXEC;
+#endif
+
+            const bool direct = mode == Stream::WRITE && (flags & FileStream::DIRECT);
+
+#if defined(O_DIRECT)
+            if (direct)
+            {
+                m_fd = ::open(filename.c_str(), oflag | O_DIRECT, 0644);
+                m_direct = m_fd >= 0;
+            }
+
+            if (!m_direct)
+            {
+                // the filesystem does not support O_DIRECT
+                m_fd = ::open(filename.c_str(), oflag, 0644);
+            }
+#else
+            m_fd = ::open(filename.c_str(), oflag, 0644);
+#endif
+
+            if (m_fd < 0)
+            {
+                MANGO_EXCEPTION("[FileStream] open(\"%s\") failed (%s).", filename.c_str(), std::strerror(errno));
+            }
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+            if (direct)
+            {
+                // F_NOCACHE has no alignment requirements
+                ::fcntl(m_fd, F_NOCACHE, 1);
+            }
+#endif
+
+            MANGO_UNREFERENCED(direct);
+
+            // the direct transfers are done in whole blocks from an aligned buffer
+            m_capacity = std::max(buffer_size, g_direct_alignment);
+            m_capacity = (m_capacity + g_direct_alignment - 1) & ~(g_direct_alignment - 1);
+            m_buffer = reinterpret_cast<u8*>(aligned_malloc(m_capacity, Alignment(g_direct_alignment)));
 		}
 
 		~FileHandle()
 		{
-            std::fclose(m_file);
+            try
+            {
+                finishDirect();
+                flush();
+            }
+            catch (Exception&)
+            {
+                // the destructor cannot report the error
+            }
+
+            aligned_free(m_buffer);
+            ::close(m_fd);
 		}
 
         const std::string& filename() const
@@ -43,61 +181,244 @@ namespace filesystem {
 
         u64 size() const
 		{
+            if (m_mode == Stream::WRITE)
+            {
+                return std::max(m_size, m_position + m_used);
+            }
+
             struct stat sb;
-            int fd = ::fileno(m_file);
-            ::fflush(m_file);
-            ::fstat(fd, &sb);
-            return sb.st_size;
+            ::fstat(m_fd, &sb);
+            return u64(sb.st_size);
 		}
 
 		u64 offset() const
 		{
-	        return ftello(m_file);
+            return m_mode == Stream::WRITE ? m_position + m_used : m_position + m_cursor;
 		}
 
-		void seek(u64 distance, int method)
+		void seek(u64 offset)
 		{
-	        fseeko(m_file, distance, method);
+            if (m_mode == Stream::WRITE)
+            {
+                if (offset == m_position + m_used)
+                {
+                    return;
+                }
+
+                finishDirect();
+                flush();
+                m_position = offset;
+            }
+            else
+            {
+                if (offset >= m_position && offset <= m_position + m_used)
+                {
+                    // the offset is inside the buffered window
+                    m_cursor = size_t(offset - m_position);
+                }
+                else
+                {
+                    m_position = offset;
+                    m_used = 0;
+                    m_cursor = 0;
+                }
+            }
 		}
 
 	    void read(void* dest, size_t size)
 	    {
-    	    size_t status = std::fread(dest, 1, size, m_file);
-	        MANGO_UNREFERENCED(status);
+            u8* ptr = reinterpret_cast<u8*>(dest);
+
+            while (size)
+            {
+                size_t left = m_used - m_cursor;
+                if (!left)
+                {
+                    m_position += m_used;
+                    m_used = 0;
+                    m_cursor = 0;
+
+                    if (size >= m_capacity)
+                    {
+                        // large reads bypass the buffer
+                        size_t bytes = pread_all(m_fd, ptr, size, m_position);
+                        m_position += bytes;
+                        break;
+                    }
+
+                    m_used = pread_all(m_fd, m_buffer, m_capacity, m_position);
+                    if (!m_used)
+                    {
+                        // end of file
+                        break;
+                    }
+
+                    left = m_used;
+                }
+
+                size_t bytes = std::min(size, left);
+                std::memcpy(ptr, m_buffer + m_cursor, bytes);
+                m_cursor += bytes;
+                ptr += bytes;
+                size -= bytes;
+            }
 	    }
 
 	    void write(const void* data, size_t size)
 	    {
-	        size_t status = std::fwrite(data, 1, size, m_file);
-	        MANGO_UNREFERENCED(status);
+            const u8* ptr = reinterpret_cast<const u8*>(data);
+
+            if (!m_direct && !m_used && size >= m_capacity)
+            {
+                // large writes bypass the buffer
+                pwrite_all(m_fd, ptr, size, m_position);
+                m_position += size;
+                m_size = std::max(m_size, m_position);
+                return;
+            }
+
+            while (size)
+            {
+                size_t bytes = std::min(size, m_capacity - m_used);
+                std::memcpy(m_buffer + m_used, ptr, bytes);
+                m_used += bytes;
+                ptr += bytes;
+                size -= bytes;
+
+                if (m_used == m_capacity)
+                {
+                    writeBuffer(m_used);
+                }
+            }
 	    }
+
+        void writeBuffer(size_t bytes)
+        {
+            pwrite_all(m_fd, m_buffer, bytes, m_position);
+            m_position += bytes;
+            m_size = std::max(m_size, m_position);
+
+            // keep the unwritten tail at the start of the buffer
+            m_used -= bytes;
+            std::memmove(m_buffer, m_buffer + bytes, m_used);
+        }
+
+        void flush()
+        {
+            if (m_mode != Stream::WRITE || !m_used)
+            {
+                return;
+            }
+
+            if (m_direct)
+            {
+                // write the whole blocks directly; the partial block is padded with zeros
+                // and written again when it has been filled or the file is truncated
+                const size_t aligned = m_used & ~(g_direct_alignment - 1);
+                if (aligned)
+                {
+                    writeBuffer(aligned);
+                }
+
+                if (m_used)
+                {
+                    std::memset(m_buffer + m_used, 0, g_direct_alignment - m_used);
+                    pwrite_all(m_fd, m_buffer, g_direct_alignment, m_position);
+                    m_size = std::max(m_size, m_position + m_used);
+                    m_padded = true;
+                }
+            }
+            else
+            {
+                writeBuffer(m_used);
+            }
+        }
+
+        void finishDirect()
+        {
+            // the remaining transfers are done through the page cache
+            if (m_direct)
+            {
+                if (m_used)
+                {
+                    flush();
+                    m_position += m_used;
+                    m_used = 0;
+                }
+
+                if (m_padded)
+                {
+                    // remove the padding of the last block
+                    int status = ::ftruncate(m_fd, off_t(m_size));
+                    MANGO_UNREFERENCED(status);
+                    m_padded = false;
+                }
+
+                int flags = ::fcntl(m_fd, F_GETFL);
+#if defined(O_DIRECT)
+                ::fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+#else
+                MANGO_UNREFERENCED(flags);
+#endif
+                m_direct = false;
+            }
+        }
+
+        void preallocate(u64 size)
+        {
+#if defined(MANGO_PLATFORM_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+            // reserve the blocks without changing the file size
+            int status = ::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, off_t(size));
+            MANGO_UNREFERENCED(status);
+#elif defined(F_PREALLOCATE)
+            fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, off_t(size), 0 };
+            int status = ::fcntl(m_fd, F_PREALLOCATE, &store);
+            MANGO_UNREFERENCED(status);
+#else
+            MANGO_UNREFERENCED(size);
+#endif
+        }
+
+        size_t pread(u64 offset, void* dest, size_t size) const
+        {
+            return pread_all(m_fd, dest, size, offset);
+        }
+
+        void pwrite(u64 offset, const void* data, size_t size)
+        {
+            // positional writes are not aligned
+            finishDirect();
+
+            if (offset < m_position + m_used && offset + size > m_position)
+            {
+                // the buffered data would overwrite the range later
+                flush();
+            }
+
+            pwrite_all(m_fd, data, size, offset);
+            m_size = std::max(m_size, offset + size);
+        }
 	};
 
     // -----------------------------------------------------------------
     // FileStream
     // -----------------------------------------------------------------
 
-    FileStream::FileStream(const std::string& filename, OpenMode openmode)
+    FileStream::FileStream(const std::string& filename, OpenMode openmode, size_t buffer_size, u32 flags)
         : m_handle(nullptr)
     {
-		const char* mode;
-
        	switch (openmode)
         {
    	        case READ:
-                mode = "rb";
-                break;
-
    	        case WRITE:
-       	        mode = "wb";
-           	    break;
+                break;
 
             default:
 	            MANGO_EXCEPTION("[FileStream] Incorrect OpenMode.");
                 break;
         }
 
-		m_handle = new FileHandle(filename, mode);
+		m_handle = new FileHandle(filename, openmode, buffer_size, flags);
     }
 
     FileStream::~FileStream()
@@ -122,27 +443,28 @@ namespace filesystem {
 
     void FileStream::seek(u64 distance, SeekMode mode)
     {
-        int method;
+        u64 base;
 
+        // the arithmetic wraps around so that negative distances work like with fseeko()
         switch (mode)
         {
             case BEGIN:
-                method = SEEK_SET;
+                base = 0;
                 break;
 
             case CURRENT:
-                method = SEEK_CUR;
+                base = m_handle->offset();
                 break;
 
             case END:
-                method = SEEK_END;
+                base = m_handle->size();
                 break;
 
             default:
                 MANGO_EXCEPTION("[FileStream] Invalid seek mode.");
         }
 
-		m_handle->seek(distance, method);
+		m_handle->seek(base + distance);
     }
 
     void FileStream::read(void* dest, size_t size)
@@ -155,5 +477,270 @@ namespace filesystem {
 		m_handle->write(data, size);
     }
 
+    void FileStream::flush()
+    {
+        m_handle->flush();
+    }
+
+    void FileStream::preallocate(u64 size)
+    {
+        m_handle->preallocate(size);
+    }
+
+    size_t FileStream::pread(u64 offset, void* dest, size_t size) const
+    {
+        return m_handle->pread(offset, dest, size);
+    }
+
+    void FileStream::pwrite(u64 offset, const void* data, size_t size)
+    {
+        m_handle->pwrite(offset, data, size);
+    }
+
+    // -----------------------------------------------------------------
+	// MappedFileHandle
+    // -----------------------------------------------------------------
+
+	struct MappedFileHandle
+	{
+        std::string m_filename;
+        int m_fd;
+
+        u8* m_address = nullptr;
+        u64 m_capacity = 0; // size of the mapping
+        u64 m_file_size = 0; // the plain writes can extend the file beyond the mapping
+        u64 m_size = 0; // written size
+        u64 m_offset = 0;
+
+        MappedFileHandle(const std::string& filename, u64 capacity)
+            : m_filename(filename)
+		{
+            int oflag = O_RDWR | O_CREAT | O_TRUNC;
+
+#if defined(O_CLOEXEC)
+            oflag |= O_CLOEXEC;
+#endif
+
+            m_fd = ::open(filename.c_str(), oflag, 0644);
+            if (m_fd < 0)
+            {
+                MANGO_EXCEPTION("[MappedFileStream] open(\"%s\") failed (%s).", filename.c_str(), std::strerror(errno));
+            }
+
+            if (capacity)
+            {
+                try
+                {
+                    remap(capacity);
+                }
+                catch (Exception&)
+                {
+                    ::close(m_fd);
+                    throw;
+                }
+            }
+		}
+
+		~MappedFileHandle()
+		{
+            if (m_address)
+            {
+                ::munmap(m_address, size_t(m_capacity));
+            }
+
+            // remove the unused capacity
+            int status = ::ftruncate(m_fd, off_t(m_size));
+            MANGO_UNREFERENCED(status);
+
+            ::close(m_fd);
+		}
+
+        void remap(u64 capacity)
+        {
+            if (capacity > u64(std::numeric_limits<size_t>::max()))
+            {
+                MANGO_EXCEPTION("[MappedFileStream] The file does not fit into the address space.");
+            }
+
+            if (capacity > m_file_size)
+            {
+                if (::ftruncate(m_fd, off_t(capacity)) < 0)
+                {
+                    MANGO_EXCEPTION("[MappedFileStream] ftruncate() failed (%s).", std::strerror(errno));
+                }
+
+                m_file_size = capacity;
+            }
+
+#if defined(MANGO_PLATFORM_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+            // allocate the blocks so that running out of space is an error here
+            // instead of a SIGBUS when the mapping is written
+            if (::fallocate(m_fd, 0, off_t(m_capacity), off_t(capacity - m_capacity)) < 0 && errno == ENOSPC)
+            {
+                MANGO_EXCEPTION("[MappedFileStream] Out of space.");
+            }
+#endif
+
+            void* address;
+
+#if defined(MREMAP_MAYMOVE)
+            if (m_address)
+            {
+                address = ::mremap(m_address, size_t(m_capacity), size_t(capacity), MREMAP_MAYMOVE);
+            }
+            else
+            {
+                address = ::mmap(nullptr, size_t(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            }
+#else
+            if (m_address)
+            {
+                ::munmap(m_address, size_t(m_capacity));
+                m_address = nullptr;
+            }
+
+            address = ::mmap(nullptr, size_t(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+#endif
+
+            if (address == MAP_FAILED)
+            {
+                MANGO_EXCEPTION("[MappedFileStream] Memory mapping \"%s\" failed (%s).", m_filename.c_str(), std::strerror(errno));
+            }
+
+            m_address = reinterpret_cast<u8*>(address);
+            m_capacity = capacity;
+        }
+
+        void reserve(u64 capacity)
+        {
+            if (capacity > m_capacity)
+            {
+                // grow in large increments to amortize the remapping
+                const u64 page_mask = u64(::sysconf(_SC_PAGESIZE)) - 1;
+                capacity = std::max(capacity, m_capacity + m_capacity / 2);
+                capacity = std::max(capacity, u64(16 * 1024 * 1024));
+                capacity = (capacity + page_mask) & ~page_mask;
+                remap(capacity);
+            }
+        }
+
+        Memory acquire(size_t size)
+        {
+            reserve(m_offset + size);
+
+            Memory memory(m_address + m_offset, size);
+            m_offset += size;
+            m_size = std::max(m_size, m_offset);
+
+            return memory;
+        }
+
+        // The plain writes go through the page cache; copying into the mapping would
+        // fault in every page of the output. The page cache and the shared mapping
+        // are coherent so the writes and the windows can be mixed freely.
+        void write(const void* data, size_t size)
+        {
+            pwrite_all(m_fd, data, size, m_offset);
+
+            m_offset += size;
+            m_size = std::max(m_size, m_offset);
+            m_file_size = std::max(m_file_size, m_offset);
+        }
+
+        void read(void* dest, size_t size)
+        {
+            if (m_offset < m_size)
+            {
+                size = size_t(std::min(u64(size), m_size - m_offset));
+                m_offset += pread_all(m_fd, dest, size, m_offset);
+            }
+        }
+
+        void sync()
+        {
+            if (m_address && m_size)
+            {
+                ::msync(m_address, size_t(std::min(m_size, m_capacity)), MS_SYNC);
+            }
+
+            ::fsync(m_fd);
+        }
+	};
+
+    // -----------------------------------------------------------------
+    // MappedFileStream
+    // -----------------------------------------------------------------
+
+    MappedFileStream::MappedFileStream(const std::string& filename, u64 capacity)
+        : m_handle(new MappedFileHandle(filename, capacity))
+    {
+    }
+
+    MappedFileStream::~MappedFileStream()
+    {
+        delete m_handle;
+    }
+
+    const std::string& MappedFileStream::filename() const
+    {
+        return m_handle->m_filename;
+    }
+
+    u64 MappedFileStream::size() const
+    {
+        return m_handle->m_size;
+    }
+
+    u64 MappedFileStream::offset() const
+    {
+        return m_handle->m_offset;
+    }
+
+    void MappedFileStream::seek(u64 distance, SeekMode mode)
+    {
+        switch (mode)
+        {
+            case BEGIN:
+                m_handle->m_offset = distance;
+                break;
+
+            case CURRENT:
+                m_handle->m_offset += distance;
+                break;
+
+            case END:
+                m_handle->m_offset = m_handle->m_size + distance;
+                break;
+
+            default:
+                MANGO_EXCEPTION("[MappedFileStream] Invalid seek mode.");
+        }
+    }
+
+    void MappedFileStream::read(void* dest, size_t size)
+    {
+        m_handle->read(dest, size);
+    }
+
+    void MappedFileStream::write(const void* data, size_t size)
+    {
+        m_handle->write(data, size);
+    }
+
+    void MappedFileStream::reserve(u64 capacity)
+    {
+        m_handle->reserve(capacity);
+    }
+
+    Memory MappedFileStream::acquire(size_t size)
+    {
+        return m_handle->acquire(size);
+    }
+
+    void MappedFileStream::sync()
+    {
+        m_handle->sync();
+    }
+
 } // namespace filesystem
 } // namespace mango
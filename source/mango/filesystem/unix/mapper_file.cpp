@@ -40,12 +40,14 @@ namespace
         int m_file;
 		size_t m_size;
 		void* m_address;
+        size_t m_mapped_size;
 
     public:
         FileMemory(const std::string& filename, u64 x_offset, u64 x_size)
             : m_file(-1)
             , m_size(0)
             , m_address(nullptr)
+            , m_mapped_size(0)
         {
             m_file = open(filename.c_str(), O_RDONLY);
 
@@ -80,7 +82,9 @@ namespace
 
                     if (m_size > 0)
                     {
-                        m_address = ::mmap(nullptr, m_size, PROT_READ, MAP_FILE | MAP_SHARED, m_file, page_offset);
+                        // the mapping starts from the page boundary
+                        m_mapped_size = m_size + (file_offset - page_offset);
+                        m_address = ::mmap(nullptr, m_mapped_size, PROT_READ, MAP_FILE | MAP_SHARED, m_file, page_offset);
 
                         if (m_address == MAP_FAILED)
                         {
@@ -107,7 +111,7 @@ namespace
         {
             if (m_address)
             {
-                ::munmap(m_address, m_size);
+                ::munmap(m_address, m_mapped_size);
             }
 
             if (m_file != -1)
@@ -115,6 +119,31 @@ namespace
                 ::close(m_file);
             }
         }
+
+        void advise(Advice advice, ConstMemory range) const override
+        {
+            if (advice != DONTNEED)
+            {
+                VirtualMemory::advise(advice, range);
+                return;
+            }
+
+            if (!range.address)
+            {
+                range = m_memory;
+            }
+
+            // the pages are read back from the file so they can be dropped; only the pages
+            // completely inside the range are released
+            const uintptr_t mask = uintptr_t(get_pagesize() - 1);
+            const uintptr_t begin = (std::max(uintptr_t(range.address), uintptr_t(m_memory.address)) + mask) & ~mask;
+            const uintptr_t end = std::min(uintptr_t(range.address + range.size), uintptr_t(m_memory.address + m_memory.size)) & ~mask;
+
+            if (begin < end)
+            {
+                ::madvise(reinterpret_cast<void*>(begin), size_t(end - begin), MADV_DONTNEED);
+            }
+        }
     };
 
     // -----------------------------------------------------------------
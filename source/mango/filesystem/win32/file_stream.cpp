@@ -2,6 +2,10 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
 #include <mango/core/string.hpp>
 #include <mango/core/exception.hpp>
 #include <mango/filesystem/file.hpp>
@@ -13,19 +17,47 @@ namespace filesystem {
     // FileHandle
     // -----------------------------------------------------------------
 
+    /*
+        The stream is buffered in user space and every transfer is positional with an
+        OVERLAPPED offset so the file pointer of the handle is never used. In the WRITE
+        mode m_position is the file offset of the buffer's first byte; in the READ mode
+        the buffer holds [m_position, m_position + m_used) and m_cursor is the read
+        offset inside the buffer. The DIRECT flag is ignored.
+    */
+
 	struct FileHandle
 	{
         std::string m_filename;
 		HANDLE m_handle;
+        Stream::OpenMode m_mode;
+
+        std::vector<u8> m_buffer;
+        size_t m_used = 0;
+        size_t m_cursor = 0;
+        u64 m_position = 0;
+
+        // logical file size in the WRITE mode
+        u64 m_size = 0;
 
-		FileHandle(const std::string& filename, HANDLE handle)
+		FileHandle(const std::string& filename, HANDLE handle, Stream::OpenMode mode, size_t buffer_size)
 		    : m_filename(filename)
             , m_handle(handle)
+            , m_mode(mode)
+            , m_buffer(std::max(buffer_size, size_t(4096)))
 		{
 		}
 
 		~FileHandle()
 		{
+            try
+            {
+                flush();
+            }
+            catch (Exception&)
+            {
+                // the destructor cannot report the error
+            }
+
             CloseHandle(m_handle);
 		}
 
@@ -36,6 +68,11 @@ namespace filesystem {
 
 	    u64 size() const
 	    {
+            if (m_mode == Stream::WRITE)
+            {
+                return std::max(m_size, m_position + m_used);
+            }
+
 	        LARGE_INTEGER integer;
 	        BOOL status = GetFileSizeEx(m_handle, &integer);
             return status ? u64(integer.QuadPart) : 0;
@@ -43,43 +80,186 @@ namespace filesystem {
 
 	    u64 offset() const
 	    {
-    	    LARGE_INTEGER dist = { 0 };
-	        LARGE_INTEGER result = { 0 };
-	        BOOL status = SetFilePointerEx(m_handle, dist, &result, FILE_CURRENT);
-			MANGO_UNREFERENCED(status);
-	        return result.QuadPart;
+            return m_mode == Stream::WRITE ? m_position + m_used : m_position + m_cursor;
 	    }
 
-	    void seek(u64 distance, DWORD method)
+	    void seek(u64 offset)
 	    {
-	        LARGE_INTEGER dist;
-	        dist.QuadPart = distance;
-	        BOOL status = SetFilePointerEx(m_handle, dist, NULL, method);
-			MANGO_UNREFERENCED(status);
+            if (m_mode == Stream::WRITE)
+            {
+                if (offset != m_position + m_used)
+                {
+                    flush();
+                    m_position = offset;
+                }
+            }
+            else
+            {
+                if (offset >= m_position && offset <= m_position + m_used)
+                {
+                    // the offset is inside the buffered window
+                    m_cursor = size_t(offset - m_position);
+                }
+                else
+                {
+                    m_position = offset;
+                    m_used = 0;
+                    m_cursor = 0;
+                }
+            }
 	    }
 
+        size_t pread(u64 offset, void* dest, size_t size) const
+        {
+            u8* ptr = reinterpret_cast<u8*>(dest);
+            size_t total = 0;
+
+            while (total < size)
+            {
+                OVERLAPPED overlapped = { 0 };
+                overlapped.Offset = DWORD(offset + total);
+                overlapped.OffsetHigh = DWORD((offset + total) >> 32);
+
+                DWORD request = DWORD(std::min(size - total, size_t(0x40000000)));
+                DWORD bytes_read = 0;
+                BOOL status = ReadFile(m_handle, ptr + total, request, &bytes_read, &overlapped);
+                if (!status && GetLastError() != ERROR_HANDLE_EOF)
+                {
+                    MANGO_EXCEPTION("[FileStream] ReadFile() failed.");
+                }
+
+                if (!bytes_read)
+                {
+                    // end of file
+                    break;
+                }
+
+                total += bytes_read;
+            }
+
+            return total;
+        }
+
+        void pwrite(u64 offset, const void* data, size_t size)
+        {
+            if (offset < m_position + m_used && offset + size > m_position)
+            {
+                // the buffered data would overwrite the range later
+                flush();
+            }
+
+            pwriteFile(offset, data, size);
+        }
+
+        void pwriteFile(u64 offset, const void* data, size_t size)
+        {
+            const u8* ptr = reinterpret_cast<const u8*>(data);
+            size_t total = 0;
+
+            while (total < size)
+            {
+                OVERLAPPED overlapped = { 0 };
+                overlapped.Offset = DWORD(offset + total);
+                overlapped.OffsetHigh = DWORD((offset + total) >> 32);
+
+                DWORD request = DWORD(std::min(size - total, size_t(0x40000000)));
+                DWORD bytes_written = 0;
+                BOOL status = WriteFile(m_handle, ptr + total, request, &bytes_written, &overlapped);
+                if (!status)
+                {
+                    MANGO_EXCEPTION("[FileStream] WriteFile() failed.");
+                }
+
+                total += bytes_written;
+            }
+
+            m_size = std::max(m_size, offset + size);
+        }
+
 	    void read(void* dest, size_t size)
 	    {
-	        DWORD bytes_read;
-	        BOOL status = ReadFile(m_handle, dest, static_cast<DWORD>(size), &bytes_read, NULL);
-			MANGO_UNREFERENCED(status);
-			MANGO_UNREFERENCED(bytes_read);
+            u8* ptr = reinterpret_cast<u8*>(dest);
+
+            while (size)
+            {
+                size_t left = m_used - m_cursor;
+                if (!left)
+                {
+                    m_position += m_used;
+                    m_used = 0;
+                    m_cursor = 0;
+
+                    if (size >= m_buffer.size())
+                    {
+                        // large reads bypass the buffer
+                        m_position += pread(m_position, ptr, size);
+                        break;
+                    }
+
+                    m_used = pread(m_position, m_buffer.data(), m_buffer.size());
+                    if (!m_used)
+                    {
+                        // end of file
+                        break;
+                    }
+
+                    left = m_used;
+                }
+
+                size_t bytes = std::min(size, left);
+                std::memcpy(ptr, m_buffer.data() + m_cursor, bytes);
+                m_cursor += bytes;
+                ptr += bytes;
+                size -= bytes;
+            }
 	    }
 
 	    void write(const void* data, size_t size)
 	    {
-	        DWORD bytes_written;
-	        BOOL status = WriteFile(m_handle, data, static_cast<DWORD>(size), &bytes_written, NULL);
-			MANGO_UNREFERENCED(status);
-			MANGO_UNREFERENCED(bytes_written);
+            const u8* ptr = reinterpret_cast<const u8*>(data);
+
+            if (m_used + size > m_buffer.size())
+            {
+                flush();
+            }
+
+            if (size >= m_buffer.size())
+            {
+                // large writes bypass the buffer
+                pwriteFile(m_position, ptr, size);
+                m_position += size;
+                return;
+            }
+
+            std::memcpy(m_buffer.data() + m_used, ptr, size);
+            m_used += size;
 	    }
+
+        void flush()
+        {
+            if (m_mode == Stream::WRITE && m_used)
+            {
+                pwriteFile(m_position, m_buffer.data(), m_used);
+                m_position += m_used;
+                m_used = 0;
+            }
+        }
+
+        void preallocate(u64 size)
+        {
+            // reserve the clusters without changing the file size
+            FILE_ALLOCATION_INFO info;
+            info.AllocationSize.QuadPart = LONGLONG(size);
+            BOOL status = SetFileInformationByHandle(m_handle, FileAllocationInfo, &info, sizeof(info));
+            MANGO_UNREFERENCED(status);
+        }
 	};
 
     // -----------------------------------------------------------------
     // FileStream
     // -----------------------------------------------------------------
 
-    FileStream::FileStream(const std::string& filename, OpenMode mode)
+    FileStream::FileStream(const std::string& filename, OpenMode mode, size_t buffer_size, u32 flags)
         : m_handle(nullptr)
     {
         DWORD access;
@@ -102,14 +282,16 @@ namespace filesystem {
                 break;
         }
 
-        // TODO: mode parameter
+        // FILE_FLAG_NO_BUFFERING requires sector aligned transfers; the DIRECT flag is ignored
+        MANGO_UNREFERENCED(flags);
+
         HANDLE handle = CreateFileW(u16_fromBytes(filename).c_str(), access, 0, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
         if (handle == INVALID_HANDLE_VALUE)
         {
             MANGO_EXCEPTION("[FileStream] CreateFileW() failed.");
         }
 
-		m_handle = new FileHandle(filename, handle);
+		m_handle = new FileHandle(filename, handle, mode, buffer_size);
     }
 
     FileStream::~FileStream()
@@ -134,27 +316,28 @@ namespace filesystem {
 
     void FileStream::seek(u64 distance, SeekMode mode)
     {
-        DWORD method;
+        u64 base;
 
+        // the arithmetic wraps around so that negative distances work like with SetFilePointerEx()
         switch (mode)
         {
             case BEGIN:
-                method = FILE_BEGIN;
+                base = 0;
                 break;
 
             case CURRENT:
-                method = FILE_CURRENT;
+                base = m_handle->offset();
                 break;
 
             case END:
-                method = FILE_END;
+                base = m_handle->size();
                 break;
 
             default:
                 MANGO_EXCEPTION("[FileStream] Invalid seek mode.");
         }
 
-		m_handle->seek(distance, method);
+		m_handle->seek(base + distance);
     }
 
     void FileStream::read(void* dest, size_t size)
@@ -167,5 +350,282 @@ namespace filesystem {
 		m_handle->write(data, size);
     }
 
+    void FileStream::flush()
+    {
+        m_handle->flush();
+    }
+
+    void FileStream::preallocate(u64 size)
+    {
+        m_handle->preallocate(size);
+    }
+
+    size_t FileStream::pread(u64 offset, void* dest, size_t size) const
+    {
+        return m_handle->pread(offset, dest, size);
+    }
+
+    void FileStream::pwrite(u64 offset, const void* data, size_t size)
+    {
+        m_handle->pwrite(offset, data, size);
+    }
+
+    // -----------------------------------------------------------------
+    // MappedFileHandle
+    // -----------------------------------------------------------------
+
+	struct MappedFileHandle
+	{
+        std::string m_filename;
+		HANDLE m_file;
+        HANDLE m_map = NULL;
+
+        u8* m_address = nullptr;
+        u64 m_capacity = 0; // size of the mapping
+        u64 m_size = 0; // written size
+        u64 m_offset = 0;
+
+		MappedFileHandle(const std::string& filename, u64 capacity)
+		    : m_filename(filename)
+		{
+            m_file = CreateFileW(u16_fromBytes(filename).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (m_file == INVALID_HANDLE_VALUE)
+            {
+                MANGO_EXCEPTION("[MappedFileStream] CreateFileW() failed.");
+            }
+
+            if (capacity)
+            {
+                try
+                {
+                    remap(capacity);
+                }
+                catch (Exception&)
+                {
+                    CloseHandle(m_file);
+                    throw;
+                }
+            }
+		}
+
+		~MappedFileHandle()
+		{
+            unmap();
+
+            // remove the unused capacity
+            FILE_END_OF_FILE_INFO info;
+            info.EndOfFile.QuadPart = LONGLONG(m_size);
+            SetFileInformationByHandle(m_file, FileEndOfFileInfo, &info, sizeof(info));
+
+            CloseHandle(m_file);
+		}
+
+        void unmap()
+        {
+            if (m_address)
+            {
+                UnmapViewOfFile(m_address);
+                m_address = nullptr;
+            }
+
+            if (m_map)
+            {
+                CloseHandle(m_map);
+                m_map = NULL;
+            }
+        }
+
+        void remap(u64 capacity)
+        {
+            if (capacity > u64(std::numeric_limits<size_t>::max()))
+            {
+                MANGO_EXCEPTION("[MappedFileStream] The file does not fit into the address space.");
+            }
+
+            // the views cannot be resized; the file mapping extends the file to the new capacity
+            // (the plain writes can have extended the file beyond it already)
+            unmap();
+
+            m_map = CreateFileMappingW(m_file, NULL, PAGE_READWRITE, DWORD(capacity >> 32), DWORD(capacity), NULL);
+            if (!m_map)
+            {
+                MANGO_EXCEPTION("[MappedFileStream] CreateFileMappingW() failed.");
+            }
+
+            m_address = reinterpret_cast<u8*>(MapViewOfFile(m_map, FILE_MAP_WRITE, 0, 0, SIZE_T(capacity)));
+            if (!m_address)
+            {
+                MANGO_EXCEPTION("[MappedFileStream] MapViewOfFile() failed.");
+            }
+
+            m_capacity = capacity;
+        }
+
+        void reserve(u64 capacity)
+        {
+            if (capacity > m_capacity)
+            {
+                // grow in large increments to amortize the remapping
+                capacity = std::max(capacity, m_capacity + m_capacity / 2);
+                capacity = std::max(capacity, u64(16 * 1024 * 1024));
+                capacity = (capacity + 0xffff) & ~u64(0xffff);
+                remap(capacity);
+            }
+        }
+
+        Memory acquire(size_t size)
+        {
+            reserve(m_offset + size);
+
+            Memory memory(m_address + m_offset, size);
+            m_offset += size;
+            m_size = std::max(m_size, m_offset);
+
+            return memory;
+        }
+
+        // The plain writes go through the file cache; copying into the view would fault
+        // in every page of the output. The file cache and the views are coherent so the
+        // writes and the windows can be mixed freely.
+        void write(const void* data, size_t size)
+        {
+            const u8* ptr = reinterpret_cast<const u8*>(data);
+            size_t total = 0;
+
+            while (total < size)
+            {
+                OVERLAPPED overlapped = { 0 };
+                overlapped.Offset = DWORD(m_offset + total);
+                overlapped.OffsetHigh = DWORD((m_offset + total) >> 32);
+
+                DWORD request = DWORD(std::min(size - total, size_t(0x40000000)));
+                DWORD bytes_written = 0;
+                BOOL status = WriteFile(m_file, ptr + total, request, &bytes_written, &overlapped);
+                if (!status)
+                {
+                    MANGO_EXCEPTION("[MappedFileStream] WriteFile() failed.");
+                }
+
+                total += bytes_written;
+            }
+
+            m_offset += size;
+            m_size = std::max(m_size, m_offset);
+        }
+
+        void read(void* dest, size_t size)
+        {
+            u8* ptr = reinterpret_cast<u8*>(dest);
+
+            if (m_offset < m_size)
+            {
+                size = size_t(std::min(u64(size), m_size - m_offset));
+
+                for (size_t total = 0; total < size; )
+                {
+                    OVERLAPPED overlapped = { 0 };
+                    overlapped.Offset = DWORD(m_offset);
+                    overlapped.OffsetHigh = DWORD(m_offset >> 32);
+
+                    DWORD request = DWORD(std::min(size - total, size_t(0x40000000)));
+                    DWORD bytes_read = 0;
+                    BOOL status = ReadFile(m_file, ptr + total, request, &bytes_read, &overlapped);
+                    if (!status || !bytes_read)
+                    {
+                        MANGO_EXCEPTION("[MappedFileStream] ReadFile() failed.");
+                    }
+
+                    total += bytes_read;
+                    m_offset += bytes_read;
+                }
+            }
+        }
+
+        void sync()
+        {
+            if (m_address && m_size)
+            {
+                FlushViewOfFile(m_address, SIZE_T(std::min(m_size, m_capacity)));
+            }
+
+            FlushFileBuffers(m_file);
+        }
+	};
+
+    // -----------------------------------------------------------------
+    // MappedFileStream
+    // -----------------------------------------------------------------
+
+    MappedFileStream::MappedFileStream(const std::string& filename, u64 capacity)
+        : m_handle(new MappedFileHandle(filename, capacity))
+    {
+    }
+
+    MappedFileStream::~MappedFileStream()
+    {
+        delete m_handle;
+    }
+
+    const std::string& MappedFileStream::filename() const
+    {
+        return m_handle->m_filename;
+    }
+
+    u64 MappedFileStream::size() const
+    {
+        return m_handle->m_size;
+    }
+
+    u64 MappedFileStream::offset() const
+    {
+        return m_handle->m_offset;
+    }
+
+    void MappedFileStream::seek(u64 distance, SeekMode mode)
+    {
+        switch (mode)
+        {
+            case BEGIN:
+                m_handle->m_offset = distance;
+                break;
+
+            case CURRENT:
+                m_handle->m_offset += distance;
+                break;
+
+            case END:
+                m_handle->m_offset = m_handle->m_size + distance;
+                break;
+
+            default:
+                MANGO_EXCEPTION("[MappedFileStream] Invalid seek mode.");
+        }
+    }
+
+    void MappedFileStream::read(void* dest, size_t size)
+    {
+        m_handle->read(dest, size);
+    }
+
+    void MappedFileStream::write(const void* data, size_t size)
+    {
+        m_handle->write(data, size);
+    }
+
+    void MappedFileStream::reserve(u64 capacity)
+    {
+        m_handle->reserve(capacity);
+    }
+
+    Memory MappedFileStream::acquire(size_t size)
+    {
+        return m_handle->acquire(size);
+    }
+
+    void MappedFileStream::sync()
+    {
+        m_handle->sync();
+    }
+
 } // namespace filesystem
 } // namespace mango
@@ -905,38 +905,34 @@ namespace
         const bool origin = (block.getCompressionFlags() & TextureCompressionInfo::ORIGIN) != 0;
         const u8* data = memory.address;
 
-        ConcurrentQueue queue;
-
-        for (int y = 0; y < ysize; ++y)
+        parallel_for(0, ysize, [&] (int y0, int y1)
         {
-            u8* image = surface.image;
-            int stride = surface.stride;
-
-            if (origin)
+            for (int y = y0; y < y1; ++y)
             {
-                image += (ysize - y) * blockImageStride;
-                image -= stride;
-                stride = -stride;
-            }
-            else
-            {
-                image += y * blockImageStride;
-            }
+                u8* image = surface.image;
+                int stride = surface.stride;
 
-            queue.enqueue([&] (u8* image, const u8* data)
-            {
-                for (int x = 0; x < xsize; ++x)
+                if (origin)
                 {
-                    block.decode(block, image, data, stride);
-                    image += blockImageSize;
-                    data += block.bytes;
+                    image += (ysize - y) * blockImageStride;
+                    image -= stride;
+                    stride = -stride;
+                }
+                else
+                {
+                    image += y * blockImageStride;
                 }
-            }, image, data);
 
-            data += block.bytes * xsize;
-        }
+                const u8* src = data + y * block.bytes * xsize;
 
-        queue.wait();
+                for (int x = 0; x < xsize; ++x)
+                {
+                    block.decode(block, image, src, stride);
+                    image += blockImageSize;
+                    src += block.bytes;
+                }
+            }
+        });
     }
 
     void clipConvertBlockDecode(const TextureCompressionInfo& block, const Surface& surface, ConstMemory memory, int xsize, int ysize)
@@ -952,35 +948,36 @@ namespace
 
         const int blockStride = block.width * surface.format.bytes();
         const int xblocks = ceil_div(surface.width, block.width);
+        const int yblocks = ceil_div(surface.height, block.height);
 
-        ConcurrentQueue queue;
-
-        for (int y = 0; y < surface.height; y += block.height)
+        parallel_for(0, yblocks, [&] (int y0, int y1)
         {
-            rect.dest.address = surface.image + (origin ? surface.height - y - 1 : y) * surface.stride;
-            rect.height = std::min(y + block.height, surface.height) - y; // vertical clipping
+            MemoryArena& arena = getLocalMemoryArena();
+            MemoryArena::Scope scope(arena);
+            u8* temp = arena.allocate<u8>(block.height * rect.src.stride);
 
-            queue.enqueue([&] (BlitRect rect, const u8* data)
+            for (int yblock = y0; yblock < y1; ++yblock)
             {
-                Buffer temp(block.height * rect.src.stride);
-                rect.src.address = temp;
+                const int y = yblock * block.height;
+                const u8* src = data + yblock * block.bytes * xblocks;
+
+                BlitRect row = rect;
+                row.src.address = temp;
+                row.dest.address = surface.image + (origin ? surface.height - y - 1 : y) * surface.stride;
+                row.height = std::min(y + block.height, surface.height) - y; // vertical clipping
 
                 for (int x = 0; x < surface.width; x += block.width)
                 {
-                    block.decode(block, temp, data, rect.src.stride);
+                    block.decode(block, temp, src, row.src.stride);
 
-                    rect.width = std::min(x + block.width, surface.width) - x; // horizontal clipping
-                    blitter.convert(rect);
+                    row.width = std::min(x + block.width, surface.width) - x; // horizontal clipping
+                    blitter.convert(row);
 
-                    rect.dest.address += blockStride;
-                    data += block.bytes;
+                    row.dest.address += blockStride;
+                    src += block.bytes;
                 }
-            }, rect, data);
-
-            data += block.bytes * xblocks;
-        }
-
-        queue.wait();
+            }
+        });
     }
 
     // surface decode
@@ -1163,18 +1160,17 @@ namespace mango
             return status;
         }
 
-        ConcurrentQueue queue;
-
         u8* address = memory.address;
 
         const int xblocks = ceil_div(surface.width, width);
         const int yblocks = ceil_div(surface.height, height);
 
-        for (int y = 0; y < yblocks; ++y)
+        parallel_for(0, yblocks, [this, xblocks, &surface, address] (int y0, int y1)
         {
-            queue.enqueue([this, y, xblocks, &surface, address]
+            Bitmap temp(width, height, format);
+
+            for (int y = y0; y < y1; ++y)
             {
-                Bitmap temp(width, height, format);
                 u8* data = address + y * xblocks * bytes;
 
                 for (int x = 0; x < xblocks; ++x)
@@ -1186,10 +1182,8 @@ namespace mango
                     encode(*this, data, image, temp.stride);
                     data += bytes;
                 }
-            });
-        }
-
-        queue.wait();
+            }
+        });
 
         return status;
     }
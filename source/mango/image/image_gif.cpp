@@ -660,7 +660,7 @@ namespace
 		int chunkIndex = 0;
 		u8 chunk[256];
 
-		void writeBits(LittleEndianStream& s, u32 code, int numbits)
+		void writeBits(LittleEndianBufferedWriter& s, u32 code, int numbits)
 		{
 			while (numbits > 0)
 			{
@@ -689,14 +689,14 @@ namespace
 			}
 		}
 
-		void flushChunk(LittleEndianStream& s)
+		void flushChunk(LittleEndianBufferedWriter& s)
 		{
 			s.write8(chunkIndex);
 			s.write(chunk, chunkIndex);
 			chunkIndex = 0;
 		}
 
-		void terminate(LittleEndianStream& s)
+		void terminate(LittleEndianBufferedWriter& s)
 		{
 			if (index)
 			{
@@ -710,7 +710,7 @@ namespace
 		}
 	};
 
-	void gif_encode_image_block(LittleEndianStream& s, int depth, int width, int height, int stride, u8* image)
+	void gif_encode_image_block(LittleEndianBufferedWriter& s, int depth, int width, int height, int stride, u8* image)
 	{
 		const int minCodeSize = depth;
 		const u32 clearCode = 1 << depth;
@@ -790,7 +790,7 @@ namespace
 		int stride = surface.stride;
 		u8* image = surface.image;
 
-		LittleEndianStream s = stream;
+		LittleEndianBufferedWriter s(stream);
 
 		// identifier
 		s.write("GIF89a", 6);
@@ -835,6 +835,7 @@ namespace
 
 		// end of file
 		s.write8(0x3b);
+		s.flush();
 	}
 
     ImageEncodeStatus imageEncode(Stream& stream, const Surface& surface, const ImageEncodeOptions& options)
@@ -219,12 +219,21 @@ namespace
         const int blocks = (width / info.width) * (height / info.height);
         const int bytes = blocks * info.bytes;
 
-        // compress
-        Buffer buffer(bytes);
-        info.compress(buffer, surface);
+        filesystem::MappedFileStream* mapped = dynamic_cast<filesystem::MappedFileStream*>(&stream);
+        if (mapped)
+        {
+            // compress directly into the file
+            info.compress(mapped->acquire(bytes), surface);
+        }
+        else
+        {
+            // compress
+            Buffer buffer(bytes);
+            info.compress(buffer, surface);
 
-        // write results
-        stream.write(buffer, bytes);
+            // write results
+            stream.write(buffer, bytes);
+        }
 
         return status;
     }
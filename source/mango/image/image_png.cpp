@@ -501,7 +501,10 @@ namespace
         const u8* m_end = nullptr;
         const char* m_error = nullptr;
 
-        Buffer m_compressed;
+        // the compressed stream references the memory when it is stored in a single chunk,
+        // multiple chunks are concatenated into the thread's scratch arena
+        ConstMemory m_compressed;
+        size_t m_compressed_capacity = 0;
 
         // IHDR
         int m_width;
@@ -557,6 +560,7 @@ namespace
         void read_fdAT(BigEndianConstPointer p, u32 size);
 
         void parse();
+        void appendCompressed(const u8* data, size_t size);
         void filter(u8* buffer, int bytes, int height);
         void deinterlace1to4(u8* output, int width, int height, int stride, u8* buffer);
         void deinterlace8to16(u8* output, int width, int height, int stride, u8* buffer);
@@ -796,7 +800,7 @@ namespace
 
     void ParserPNG::read_IDAT(BigEndianConstPointer p, u32 size)
     {
-        m_compressed.append(p, size);
+        appendCompressed(p, size);
     }
 
     void ParserPNG::read_PLTE(BigEndianConstPointer p, u32 size)
@@ -963,7 +967,29 @@ namespace
         debugPrint("  Sequence: %d\n", sequence_number);
         MANGO_UNREFERENCED(sequence_number);
 
-        m_compressed.append(p, size);
+        appendCompressed(p, size);
+    }
+
+    void ParserPNG::appendCompressed(const u8* data, size_t size)
+    {
+        if (!m_compressed.size)
+        {
+            m_compressed = ConstMemory(data, size);
+            return;
+        }
+
+        const size_t required = m_compressed.size + size;
+
+        if (required > m_compressed_capacity)
+        {
+            m_compressed_capacity = std::max(required, m_compressed_capacity * 2);
+            u8* buffer = getLocalMemoryArena().allocate<u8>(m_compressed_capacity);
+            std::memcpy(buffer, m_compressed.address, m_compressed.size);
+            m_compressed.address = buffer;
+        }
+
+        std::memcpy(const_cast<u8*>(m_compressed.address) + m_compressed.size, data, size);
+        m_compressed.size = required;
     }
 
     void ParserPNG::parse()
@@ -1085,9 +1111,13 @@ namespace
 
         FilterDispatcher dispatcher(bpp);
 
+        MemoryArena& arena = getLocalMemoryArena();
+        MemoryArena::Scope scope(arena);
+
         // zero scanline
-        std::vector<u8> zeros(bytes, 0);
-        const u8* prev = zeros.data();
+        u8* zeros = arena.allocate<u8>(bytes);
+        std::memset(zeros, 0, bytes);
+        const u8* prev = zeros;
 
         for (int y = 0; y < height; ++y)
         {
@@ -1540,13 +1570,14 @@ namespace
 
     void ParserPNG::process(u8* image, int width, int height, int stride, u8* buffer, Palette* ptr_palette)
     {
-        Buffer temp;
+        MemoryArena& arena = getLocalMemoryArena();
+        MemoryArena::Scope scope(arena);
 
         if (m_interlace)
         {
             const int stride = FILTER_BYTE + getBytesPerLine(width);
 
-            temp.resize(height * stride);
+            u8* temp = arena.allocate<u8>(height * stride);
             std::memset(temp, 0, height * stride);
 
             // deinterlace does filter for each pass
@@ -1753,11 +1784,17 @@ namespace
     {
         ImageDecodeStatus status;
 
-        m_compressed.reset();
+        // the decoding scratch memory, including the concatenated compressed stream, is
+        // allocated from the thread's arena which is retained for the next image
+        MemoryArena& arena = getLocalMemoryArena();
+        MemoryArena::Scope scope(arena);
+
+        m_compressed = ConstMemory();
+        m_compressed_capacity = 0;
 
         parse();
 
-        if (!m_compressed.size())
+        if (!m_compressed.size)
         {
             setError("No compressed data.");
             return status;
@@ -1775,8 +1812,6 @@ namespace
         int stride = dest.stride;
         u8* image = dest.image;
 
-        std::unique_ptr<u8[]> framebuffer;
-
         // override with animation frame
         if (m_number_of_frames > 0)
         {
@@ -1785,8 +1820,7 @@ namespace
             stride = width * dest.format.bytes();
 
             // decode frame into temporary buffer (for composition)
-            image = new u8[stride * height];
-            framebuffer.reset(image);
+            image = arena.allocate<u8>(stride * height);
 
             // compute frame indices (for external users)
             m_current_frame_index = m_next_frame_index++;
@@ -1798,42 +1832,37 @@ namespace
 
         // decompression
         // - use STB for small buffers
-        // - use MINIZ for large buffers
+        // - use MINIZ for large buffers (or when STB fails)
 
         int buffer_size = getImageBufferSize(width, height);
+        debugPrint("  buffer bytes: %d\n", buffer_size);
 
-        if (m_compressed.size() <= 128 * 1024)
-        {
-            Memory mem = m_compressed;
-            int raw_len = buffer_size;
-            u8 *buffer = (u8*) stbi_zlib_decode_malloc_guesssize_headerflag(
-                reinterpret_cast<const char *>(mem.address),
-                int(mem.size),
-                raw_len,
-                &raw_len,
-                1);
-            if (buffer)
+        u8* buffer = arena.allocate<u8>(buffer_size);
+        bool decompressed = false;
+
+        if (m_compressed.size <= 128 * 1024)
+        {
+            int raw_len = stbi_zlib_decode_buffer(
+                reinterpret_cast<char *>(buffer),
+                buffer_size,
+                reinterpret_cast<const char *>(m_compressed.address),
+                int(m_compressed.size));
+            if (raw_len >= 0)
             {
                 debugPrint("  # total_out: %d \n", raw_len);
-
-                // process image
-                process(image, width, height, stride, buffer, ptr_palette);
-                STBI_FREE(buffer);
+                decompressed = true;
             }
         }
-        else
-        {
-            // allocate output buffer
-            debugPrint("  buffer bytes: %d\n", buffer_size);
-            Buffer buffer(buffer_size);
 
+        if (!decompressed)
+        {
             // decompress stream
             mz_stream stream;
             int status;
             memset(&stream, 0, sizeof(stream));
 
-            stream.next_in   = m_compressed;
-            stream.avail_in  = (unsigned int)m_compressed.size();
+            stream.next_in   = m_compressed.address;
+            stream.avail_in  = (unsigned int)m_compressed.size;
             stream.next_out  = buffer;
             stream.avail_out = (unsigned int)buffer_size;
 
@@ -1851,11 +1880,11 @@ namespace
 
             debugPrint("  # total_out: %d \n", int(stream.total_out));
             status = mz_inflateEnd(&stream);
-
-            // process image
-            process(image, width, height, stride, buffer, ptr_palette);
         }
 
+        // process image
+        process(image, width, height, stride, buffer, ptr_palette);
+
         if (m_number_of_frames > 0)
         {
             Surface d(dest, m_frame.xoffset, m_frame.yoffset, width, height);
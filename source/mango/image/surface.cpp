@@ -179,6 +179,9 @@ namespace
     {
         Surface surface(0, 0, Format(), 0, nullptr);
 
+        // the decoder reads the whole image; start reading it while the header is parsed
+        adviseMemory(memory, VirtualMemory::WILLNEED);
+
         ImageDecoder decoder(memory, extension);
         if (decoder.isDecoder())
         {
@@ -189,7 +192,7 @@ namespace
             surface.height = header.height;
             surface.format = format ? *format : header.format;
             surface.stride = surface.width * surface.format.bytes();
-            surface.image  = new u8[surface.height * surface.stride];
+            surface.image  = reinterpret_cast<u8*>(aligned_malloc(surface.height * surface.stride));
 
             // decode
             ImageDecodeStatus status = decoder.decode(surface);
@@ -211,6 +214,8 @@ namespace
         Surface surface(0, 0, Format(), 0, nullptr);
         palette.size = 0;
 
+        adviseMemory(memory, VirtualMemory::WILLNEED);
+
         ImageDecoder decoder(memory, extension);
         if (decoder.isDecoder())
         {
@@ -222,7 +227,7 @@ namespace
                 surface.height = header.height;
                 surface.format = IndexedFormat(8);
                 surface.stride = surface.width;
-                surface.image  = new u8[surface.height * surface.stride];
+                surface.image  = reinterpret_cast<u8*>(aligned_malloc(surface.height * surface.stride));
 
                 // decode
                 ImageDecodeOptions options;
@@ -404,58 +409,28 @@ namespace mango
         rect.width = dest.width;
         rect.height = dest.height;
 
-        ConcurrentQueue queue("blit", Priority::HIGH);
-
         Blitter blitter(dest.format, source.format);
 
-        const int threads = ThreadPool::getInstanceSize();
-        const int tasksize = (rect.width * rect.height) / threads;
-
         const bool fast = dest.format == source.format;
-
-        // don't use thread pool for:
-        // - really small tasks
-        // - when the pixel formats are identical ("fast mode")
-        const int N = (tasksize < 8192) || fast ? 1 : threads;
-        const int section = rect.height / N;
-
-        int ypos = 0;
-
-        // queue conversion tasks
-        for (int i = 0; i < N; ++i)
+        if (fast)
         {
-            const bool last = (i == (N - 1));
-            const int ycount = last ? rect.height - ypos : section;
-
-            if (N == 1)
-            {
-                // execute on main thread
-                BlitRect temp = rect;
-
-                temp.dest.address += ypos * rect.dest.stride;
-                temp.src.address += ypos * rect.src.stride;
-                temp.height = ycount;
-
-                blitter.convert(temp);
-            }
-            else
-            {
-                queue.enqueue([=, &blitter]
-                {
-                    BlitRect temp = rect;
-
-                    temp.dest.address += ypos * rect.dest.stride;
-                    temp.src.address += ypos * rect.src.stride;
-                    temp.height = ycount;
+            // identical pixel formats are copied in the calling thread; the copy is
+            // limited by the memory bandwidth and does not benefit from more threads
+            blitter.convert(rect);
+            return;
+        }
 
-                    blitter.convert(temp);
-                });
-            }
+        // the scanlines are converted in parallel when the surface is large enough
+        parallel_for(0, rect.height, [&] (int y0, int y1)
+        {
+            BlitRect temp = rect;
 
-            ypos += section;
-        }
+            temp.dest.address += y0 * rect.dest.stride;
+            temp.src.address += y0 * rect.src.stride;
+            temp.height = y1 - y0;
 
-        queue.wait();
+            blitter.convert(temp);
+        });
     }
 
     void Surface::xflip() const
@@ -523,49 +498,61 @@ namespace mango
     // Bitmap
     // ----------------------------------------------------------------------------
 
-    Bitmap::Bitmap(int w, int h, const Format& f, int s)
+    Bitmap::Bitmap(int w, int h, const Format& f, int s, Alignment alignment)
         : Surface(w, h, f, s, nullptr)
+        , m_alignment(alignment)
     {
         if (!stride)
         {
             stride = width * format.bytes();
         }
 
-        image = new u8[stride * height];
+        m_bytes = size_t(stride) * height;
+        image = reinterpret_cast<u8*>(aligned_malloc(m_bytes, m_alignment));
+        m_tracked = image && trackAllocation(MemoryCategory::BITMAP, m_bytes);
     }
 
     Bitmap::Bitmap(ConstMemory memory, const std::string& extension)
         : Surface(load_surface(memory, extension, nullptr))
     {
+        track();
     }
 
     Bitmap::Bitmap(ConstMemory memory, const std::string& extension, const Format& format)
         : Surface(load_surface(memory, extension, &format))
     {
+        track();
     }
 
     Bitmap::Bitmap(const std::string& filename)
         : Surface(load_surface(filename, nullptr))
     {
+        track();
     }
 
     Bitmap::Bitmap(const std::string& filename, const Format& format)
         : Surface(load_surface(filename, &format))
     {
+        track();
     }
 
     Bitmap::Bitmap(ConstMemory memory, const std::string& extension, Palette& palette)
         : Surface(load_palette_surface(memory, extension, palette))
     {
+        track();
     }
 
     Bitmap::Bitmap(const std::string& filename, Palette& palette)
         : Surface(load_palette_surface(filename, palette))
     {
+        track();
     }
 
     Bitmap::Bitmap(Bitmap&& bitmap)
         : Surface(bitmap)
+        , m_alignment(bitmap.m_alignment)
+        , m_bytes(bitmap.m_bytes)
+        , m_tracked(bitmap.m_tracked)
     {
         // move image ownership
         bitmap.image = nullptr;
@@ -573,22 +560,50 @@ namespace mango
 
     Bitmap::~Bitmap()
     {
-        delete[] image;
+        release();
     }
 
     Bitmap& Bitmap::operator = (Bitmap&& bitmap)
     {
-        // copy surface
-        format = bitmap.format;
-        image = bitmap.image;
-        stride = bitmap.stride;
-        width = bitmap.width;
-        height = bitmap.height;
-
-        // move image ownership
-        bitmap.image = nullptr;
+        if (this != &bitmap)
+        {
+            release();
+
+            // copy surface
+            format = bitmap.format;
+            image = bitmap.image;
+            stride = bitmap.stride;
+            width = bitmap.width;
+            height = bitmap.height;
+            m_alignment = bitmap.m_alignment;
+            m_bytes = bitmap.m_bytes;
+            m_tracked = bitmap.m_tracked;
+
+            // move image ownership
+            bitmap.image = nullptr;
+        }
 
         return *this;
     }
 
+    void Bitmap::track()
+    {
+        // decoded images are allocated by load_surface()
+        m_bytes = image ? size_t(stride) * height : 0;
+        m_tracked = image && trackAllocation(MemoryCategory::BITMAP, m_bytes);
+    }
+
+    void Bitmap::release()
+    {
+        if (image)
+        {
+            if (m_tracked)
+            {
+                trackDeallocation(MemoryCategory::BITMAP, m_bytes);
+            }
+            aligned_free(image, m_bytes, m_alignment);
+            image = nullptr;
+        }
+    }
+
 } // namespace mango
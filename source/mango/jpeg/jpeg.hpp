@@ -316,7 +316,8 @@ namespace jpeg {
         QuantTable quantTable[JPEG_MAX_COMPS_IN_SCAN];
         HuffTable huffTable[2][JPEG_MAX_COMPS_IN_SCAN];
 
-        AlignedPointer<s16> quantTableVector;
+        // the storage is padded so that the tables can be aligned for the SIMD iDCT
+        s16 quantTableStorage[64 * JPEG_MAX_COMPS_IN_SCAN + 32];
         s16* blockVector;
 
         std::vector<Frame> frames;
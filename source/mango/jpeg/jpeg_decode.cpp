@@ -207,15 +207,16 @@ namespace jpeg {
     // ----------------------------------------------------------------------------
 
     Parser::Parser(ConstMemory memory)
-        : quantTableVector(64 * JPEG_MAX_COMPS_IN_SCAN)
-        , blockVector(nullptr)
+        : blockVector(nullptr)
     {
         restartInterval = 0;
         restartCounter = 0;
 
+        s16* quantTableVector = reinterpret_cast<s16*>((uintptr_t(quantTableStorage) + 63) & ~uintptr_t(63));
+
         for (int i = 0; i < JPEG_MAX_COMPS_IN_SCAN; ++i)
         {
-            quantTable[i].table = quantTableVector.data() + i * 64;
+            quantTable[i].table = quantTableVector + i * 64;
         }
 
         m_surface = nullptr;
@@ -1561,9 +1562,10 @@ namespace jpeg {
             return status;
         }
 
-        // allocate blocks
-        AlignedPointer<s16> tempBlockVector(mcus * blocks_in_mcu * 64);
-        blockVector = tempBlockVector.data();
+        // allocate blocks from the thread's scratch arena; the memory is retained for the next image
+        MemoryArena& arena = getLocalMemoryArena();
+        MemoryArena::Scope scope(arena);
+        blockVector = arena.allocate<s16>(mcus * blocks_in_mcu * 64);
 
         // find best matching format
         SampleFormat sf = getSampleFormat(target.format);
@@ -1695,11 +1697,15 @@ namespace jpeg {
 
         int initPredictor = 1 << (precision - pointTransform - 1);
 
-        std::vector<int> scanLineCache[JPEG_MAX_BLOCKS_IN_MCU];
+        MemoryArena& arena = getLocalMemoryArena();
+        MemoryArena::Scope scope(arena);
+
+        int* scanLineCache[JPEG_MAX_BLOCKS_IN_MCU];
 
         for (int i = 0; i < components; ++i)
         {
-            scanLineCache[i] = std::vector<int>(width + 1, 0);
+            scanLineCache[i] = arena.allocate<int>(width + 1);
+            std::memset(scanLineCache[i], 0, (width + 1) * sizeof(int));
         }
 
         for (int y = 0; y < height; ++y)
@@ -1714,7 +1720,7 @@ namespace jpeg {
                 for (int currentComponent = 0; currentComponent < components; ++currentComponent)
                 {
                     // Predictors
-                    int* cache = scanLineCache[currentComponent].data();
+                    int* cache = scanLineCache[currentComponent];
                     int Ra = data[currentComponent];
                     int Rb = cache[x + 1];
                     int Rc = cache[x + 0];
@@ -1909,7 +1915,8 @@ namespace jpeg {
                 // enqueue task
                 queue.enqueue([=]
                 {
-                    AlignedPointer<s16> data(640);
+                    // the task's arena scope is rewound by the ThreadPool
+                    s16* data = getLocalMemoryArena().allocate<s16>(640);
 
                     DecodeState state = decodeState;
                     state.buffer.ptr = p;
@@ -377,11 +377,6 @@ namespace
         void write_markers(BigEndianStream& p, Sample sample, u32 width, u32 height);
     };
 
-    struct EncodeBuffer : Buffer
-    {
-        std::atomic<bool> ready { false };
-    };
-
     struct HuffmanEncoder
     {
         int ldc[3];
@@ -1874,39 +1869,37 @@ namespace
     {
         jpeg_encode jp(sample, surface.width, surface.height, surface.stride, quality);
 
-        const u8* input = surface.image;
-        int stride = surface.stride;
+        const int stride = surface.stride;
 
         // bitstream for each MCU scan
-        std::vector<EncodeBuffer> buffers(jp.vertical_mcus);
-
-        ConcurrentQueue queue;
+        std::vector<Buffer> buffers(jp.vertical_mcus);
 
         // encode MCUs
-        for (int y = 0; y < jp.vertical_mcus; ++y)
+        parallel_for(0, jp.vertical_mcus, [&] (int y0, int y1)
         {
-            auto read_func = jp.read_8x8; // default: optimized 8x8 reader
-
-            int rows;
-            const int bottom_mcu = jp.vertical_mcus - 1;
-            if (y < bottom_mcu)
+            for (int y = y0; y < y1; ++y)
             {
-                rows = jp.mcu_height;
-            }
-            else
-            {
-                // clipping
-                rows = jp.rows_in_bottom_mcus;
-                read_func = jp.read; // clipping reader
-            }
+                const u8* input = surface.image + y * stride * jp.mcu_height;
+                auto read_func = jp.read_8x8; // default: optimized 8x8 reader
+
+                int rows;
+                const int bottom_mcu = jp.vertical_mcus - 1;
+                if (y < bottom_mcu)
+                {
+                    rows = jp.mcu_height;
+                }
+                else
+                {
+                    // clipping
+                    rows = jp.rows_in_bottom_mcus;
+                    read_func = jp.read; // clipping reader
+                }
 
-            queue.enqueue([&jp, y, &buffers, input, stride, rows, read_func]
-            {
                 auto read = read_func;
                 const u8* image = input;
 
                 HuffmanEncoder huffman;
-                EncodeBuffer& buffer = buffers[y];
+                Buffer& buffer = buffers[y];
 
                 constexpr int buffer_size = 2048;
                 constexpr int flush_threshold = buffer_size - 512;
@@ -1957,13 +1950,8 @@ namespace
                 // flush encoding buffer
                 ptr = huffman.flush(ptr);
                 buffer.append(huff_temp, ptr - huff_temp);
-
-                // mark buffer ready for writing
-                buffer.ready = true;
-            });
-
-            input += surface.stride * jp.mcu_height;
-        }
+            }
+        });
 
         BigEndianStream s(stream);
 
@@ -1972,13 +1960,7 @@ namespace
 
         for (int y = 0; y < jp.vertical_mcus; ++y)
         {
-            EncodeBuffer& buffer = buffers[y];
-
-            for ( ; !buffer.ready; )
-            {
-                // buffer is not processed yet; help the thread pool while waiting
-                queue.steal();
-            }
+            Buffer& buffer = buffers[y];
 
             // write huffman bitstream
             s.write(buffer, size_t(buffer.size()));
@@ -0,0 +1,164 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <mango/core/thread.hpp>
+
+using namespace mango;
+
+/*
+    ThreadPool scaling benchmark.
+
+    Runs two workloads with pools of 1..N workers and prints the throughput:
+
+    nested: tasks which enqueue tiny child tasks into their own queue, the pattern
+            which keeps the worker local deques busy.
+    decode: one task per block row of an image, the pattern of the image decoders.
+
+    Usage: test-thread-scaling [max workers] (default: one for each processor)
+*/
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr int REPEAT = 5;
+
+    constexpr int NESTED_ROOTS = 64;
+    constexpr int NESTED_CHILDREN = 256;
+
+    constexpr int IMAGE_WIDTH = 2048;
+    constexpr int IMAGE_HEIGHT = 2048;
+    constexpr int IMAGE_BLOCK = 16;
+
+    u32 work(u32 x, int iterations)
+    {
+        for (int i = 0; i < iterations; ++i)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+        }
+        return x;
+    }
+
+    template <typename Function>
+    double measure(Function function)
+    {
+        double best = 0;
+
+        for (int i = 0; i < REPEAT; ++i)
+        {
+            Clock::time_point start = Clock::now();
+            function();
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            best = i ? std::min(best, seconds) : seconds;
+        }
+
+        return best;
+    }
+
+    // returns million tasks per second
+    double nested(ThreadPool& pool)
+    {
+        std::vector<u32> result(NESTED_ROOTS * NESTED_CHILDREN);
+
+        double seconds = measure([&]
+        {
+            ConcurrentQueue q(pool, "nested");
+
+            for (int i = 0; i < NESTED_ROOTS; ++i)
+            {
+                q.enqueue([&q, &result, i]
+                {
+                    for (int j = 0; j < NESTED_CHILDREN; ++j)
+                    {
+                        const int index = i * NESTED_CHILDREN + j;
+                        q.enqueue([&result, index]
+                        {
+                            result[index] = work(index + 1, 64);
+                        });
+                    }
+                });
+            }
+
+            q.wait();
+        });
+
+        const double tasks = NESTED_ROOTS * (NESTED_CHILDREN + 1);
+        return tasks / seconds / 1000000.0;
+    }
+
+    // returns million pixels per second
+    double decode(ThreadPool& pool)
+    {
+        std::vector<u8> input(IMAGE_WIDTH * IMAGE_HEIGHT * 3);
+        std::vector<u32> output(IMAGE_WIDTH * IMAGE_HEIGHT);
+
+        for (size_t i = 0; i < input.size(); ++i)
+        {
+            input[i] = u8(work(u32(i + 1), 1));
+        }
+
+        double seconds = measure([&]
+        {
+            ConcurrentQueue q(pool, "decode");
+
+            for (int y = 0; y < IMAGE_HEIGHT; y += IMAGE_BLOCK)
+            {
+                q.enqueue([&input, &output, y]
+                {
+                    // YCbCr to RGBA conversion of one block row
+                    for (int i = y * IMAGE_WIDTH; i < (y + IMAGE_BLOCK) * IMAGE_WIDTH; ++i)
+                    {
+                        const int Y = input[i * 3 + 0] << 16;
+                        const int cb = input[i * 3 + 1] - 128;
+                        const int cr = input[i * 3 + 2] - 128;
+                        const int r = std::min(std::max((Y + 91881 * cr) >> 16, 0), 255);
+                        const int g = std::min(std::max((Y - 22554 * cb - 46802 * cr) >> 16, 0), 255);
+                        const int b = std::min(std::max((Y + 116130 * cb) >> 16, 0), 255);
+                        output[i] = 0xff000000 | (b << 16) | (g << 8) | r;
+                    }
+                });
+            }
+
+            q.wait();
+        });
+
+        const double pixels = IMAGE_WIDTH * IMAGE_HEIGHT;
+        return pixels / seconds / 1000000.0;
+    }
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    int count = std::max(int(std::thread::hardware_concurrency()), 1);
+    if (argc > 1)
+    {
+        count = std::max(std::atoi(argv[1]), 1);
+    }
+
+    std::printf("workers      nested (Mtasks/s)     decode (Mpixels/s)\n");
+
+    for (int workers = 1; workers <= count; ++workers)
+    {
+        ThreadPool::Config config;
+        config.size = workers;
+        config.name = "scaling";
+
+        ThreadPool pool(config);
+
+        double a = nested(pool);
+        double b = decode(pool);
+        std::printf("%7d %22.2f %22.2f\n", workers, a, b);
+    }
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <mango/core/thread.hpp>
+
+using namespace mango;
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+    using Milliseconds = std::chrono::milliseconds;
+
+    int g_failures = 0;
+
+    void check(bool condition, const char* message)
+    {
+        std::printf("%s: %s\n", condition ? "passed" : "FAILED", message);
+        if (!condition)
+        {
+            ++g_failures;
+        }
+    }
+
+    double elapsed(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    ThreadPool::Config createConfig(size_t size, const char* name)
+    {
+        ThreadPool::Config config;
+        config.size = size;
+        config.name = name;
+        return config;
+    }
+
+    // A thread waiting for its queue must not pick up long LOW priority tasks of
+    // unrelated queues; the wait latency stays bounded by the queue's own work.
+    void test_wait_latency()
+    {
+        ThreadPool pool(createConfig(2, "latency"));
+
+        std::atomic<bool> stop { false };
+        std::atomic<int> picked { 0 };
+        const std::thread::id waiter = std::this_thread::get_id();
+
+        ConcurrentQueue low(pool, "low", Priority::LOW);
+        for (int i = 0; i < 16; ++i)
+        {
+            low.enqueue([&]
+            {
+                // the waiter helps with the low queue itself only after stop
+                if (!stop && std::this_thread::get_id() == waiter)
+                {
+                    ++picked;
+                }
+
+                Clock::time_point start = Clock::now();
+                while (!stop && Clock::now() - start < Milliseconds(200))
+                {
+                    std::this_thread::yield();
+                }
+            });
+        }
+
+        double worst = 0;
+
+        for (int i = 0; i < 20; ++i)
+        {
+            ConcurrentQueue q(pool, "q", Priority::HIGH);
+            std::atomic<int> count { 0 };
+
+            Clock::time_point start = Clock::now();
+            for (int j = 0; j < 16; ++j)
+            {
+                q.enqueue([&] { ++count; });
+            }
+            q.wait();
+
+            worst = std::max(worst, elapsed(start));
+        }
+
+        stop = true;
+        low.wait();
+
+        std::printf("  worst wait latency: %.2f ms\n", worst);
+        check(picked == 0, "waiter does not pick up LOW priority tasks");
+        check(worst < 100.0, "wait latency is not bound to LOW priority tasks");
+    }
+
+    // A task waiting for its child queue must leave the unrelated nested tasks in its
+    // deque to the other workers.
+    void test_nested_wait()
+    {
+        ThreadPool pool(createConfig(2, "nested"));
+
+        std::atomic<bool> inverted { false };
+
+        ConcurrentQueue outer(pool, "outer");
+        outer.enqueue([&]
+        {
+            const std::thread::id waiter = std::this_thread::get_id();
+
+            ConcurrentQueue q(pool, "q");
+            ConcurrentQueue x(pool, "x");
+
+            q.enqueue([] { std::this_thread::sleep_for(Milliseconds(1)); });
+            x.enqueue([&]
+            {
+                if (std::this_thread::get_id() == waiter)
+                {
+                    inverted = true;
+                }
+                std::this_thread::sleep_for(Milliseconds(200));
+            });
+
+            q.wait();
+        });
+
+        check(outer.wait_for(std::chrono::seconds(5)), "nested wait completes");
+        check(!inverted, "nested waiter does not pick up unrelated local tasks");
+        outer.wait();
+    }
+
+    // In a single worker pool no thief can reach the worker's deque; a waiting task
+    // has to run the nested tasks buried on top of its queue's tasks.
+    void test_single_worker_wait()
+    {
+        ThreadPool pool(createConfig(1, "single"));
+
+        std::atomic<int> count { 0 };
+
+        ConcurrentQueue outer(pool, "outer");
+        outer.enqueue([&]
+        {
+            ConcurrentQueue q(pool, "q");
+            ConcurrentQueue x(pool, "x");
+
+            q.enqueue([&] { ++count; });
+            x.enqueue([&] { ++count; });
+
+            q.wait();
+        });
+
+        check(outer.wait_for(std::chrono::seconds(5)), "single worker nested wait completes");
+        check(count == 2, "single worker runs the nested tasks");
+        outer.wait();
+    }
+
+    // wait_for() must return within its timeout while a long task of the same queue runs.
+    void test_wait_for()
+    {
+        ThreadPool pool(createConfig(2, "timeout"));
+
+        ConcurrentQueue q(pool, "q");
+        for (int i = 0; i < 4; ++i)
+        {
+            q.enqueue([] { std::this_thread::sleep_for(Milliseconds(500)); });
+        }
+
+        Clock::time_point start = Clock::now();
+        bool drained = q.wait_for(Milliseconds(10));
+        double time = elapsed(start);
+
+        std::printf("  wait_for(10 ms) returned after %.2f ms\n", time);
+        check(!drained, "wait_for() reports the queue was not drained");
+        check(time < 10.0 + 50.0, "wait_for() returns within its timeout");
+
+        check(q.wait_for(std::chrono::seconds(5)), "wait_for() reports the queue was drained");
+    }
+
+} // namespace
+
+int main()
+{
+    test_wait_latency();
+    test_nested_wait();
+    test_single_worker_wait();
+    test_wait_for();
+
+    if (g_failures)
+    {
+        std::printf("%d test(s) failed.\n", g_failures);
+        return 1;
+    }
+
+    return 0;
+}